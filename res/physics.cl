@@ -1,21 +1,36 @@
+// Positions, velocities and accelerations are stored as x, y and z planes of stride floats each,
+// where stride is the global size. Padding bodies have zero mass.
+
+// Built with -DACCUM_DOUBLE (mixed precision), each pair term is still evaluated in float but
+// the per-body sums are kept in double, so long sums over many small terms do not lose them
+#ifdef ACCUM_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double accum_t;
+typedef double3 accum3_t;
+#define convert_accum3 convert_double3
+#else
+typedef float accum_t;
+typedef float3 accum3_t;
+#define convert_accum3 convert_float3
+#endif
+
 __kernel void apply_gravity(__global float* pos,
                             __global float* vel,
                             __global float* acc,
                             __global float* mass) {
     int id = get_global_id(0);
-    int loc = id * 3;
-
-    float px = pos[loc];
-    float py = pos[loc + 1];
-    float pz = pos[loc + 2];
     int n = get_global_size(0);
 
+    float px = pos[id];
+    float py = pos[id + n];
+    float pz = pos[id + 2 * n];
+
     float EPS = 1e-6f;
+    accum_t ax = 0.0f, ay = 0.0f, az = 0.0f;
     for (int j = 0; j < n; j++) {
-        int loc_j = j * 3;
-        float dx = pos[loc_j]     - px;
-        float dy = pos[loc_j + 1] - py;
-        float dz = pos[loc_j + 2] - pz;
+        float dx = pos[j]         - px;
+        float dy = pos[j + n]     - py;
+        float dz = pos[j + 2 * n] - pz;
 
         float mag_sq = dx * dx + dy * dy + dz * dz + EPS;
         float mag_sixth = mag_sq * mag_sq * mag_sq;
@@ -24,9 +39,64 @@ __kernel void apply_gravity(__global float* pos,
         float f_gravity_j = (mass[j] * inv_mag_cubed); // Partial force due to jth body on ith body
 
         // Accumulate forces of all other particles on work-item particle given by id
-        acc[loc]     += dx * f_gravity_j;
-        acc[loc + 1] += dy * f_gravity_j;
-        acc[loc + 2] += dz * f_gravity_j;
+        ax += dx * f_gravity_j;
+        ay += dy * f_gravity_j;
+        az += dz * f_gravity_j;
+    }
+
+    acc[id]         += (float)ax;
+    acc[id + n]     += (float)ay;
+    acc[id + 2 * n] += (float)az;
+}
+
+// Same sum as apply_gravity, but each work-group cooperatively copies a tile of get_local_size(0)
+// bodies (position and mass) into local memory, then every work-item sums over that tile.
+// n is the padded body count; the global size may be rounded up past it.
+__kernel void apply_gravity_tiled(__global const float* pos,
+                                  __global float* acc,
+                                  __global const float* mass,
+                                  __local float4* tile,
+                                  int n) {
+    int id = get_global_id(0);
+    int lid = get_local_id(0);
+    int tile_size = get_local_size(0);
+
+    float px = 0.0f, py = 0.0f, pz = 0.0f;
+    if (id < n) {
+        px = pos[id];
+        py = pos[id + n];
+        pz = pos[id + 2 * n];
+    }
+
+    float EPS = 1e-6f;
+    accum_t ax = 0.0f, ay = 0.0f, az = 0.0f;
+    for (int base = 0; base < n; base += tile_size) {
+        int j = base + lid;
+        tile[lid] = j < n ? (float4)(pos[j], pos[j + n], pos[j + 2 * n], mass[j])
+                          : (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int k = 0; k < tile_size; k++) {
+            float4 body = tile[k];
+            float dx = body.x - px;
+            float dy = body.y - py;
+            float dz = body.z - pz;
+
+            float mag_sq = dx * dx + dy * dy + dz * dz + EPS;
+            float inv_mag_cubed = rsqrt(mag_sq * mag_sq * mag_sq);
+            float f_gravity_j = body.w * inv_mag_cubed;
+
+            ax += dx * f_gravity_j;
+            ay += dy * f_gravity_j;
+            az += dz * f_gravity_j;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (id < n) {
+        acc[id]         += (float)ax;
+        acc[id + n]     += (float)ay;
+        acc[id + 2 * n] += (float)az;
     }
 }
 
@@ -34,29 +104,371 @@ __kernel void apply_gravity(__global float* pos,
 __kernel void update_positions(__global float* pos,
                                __global float* vel,
                                __global float* acc,
-                               __global float* dt) {
+                               float t) {
 
     float G_CONSTANT = 6.67408E-11f;
     int id = get_global_id(0);
-    float t = dt[0];
+    int n = get_global_size(0);
 
-    // We need to know how far apart each component is... data is glm::vec3 format on the GPU
-    int loc = id * 3;
-    float gaxdt = G_CONSTANT * acc[loc]     * t;
-    float gaydt = G_CONSTANT * acc[loc + 1] * t;
-    float gazdt = G_CONSTANT * acc[loc + 2] * t;
+    int x = id, y = id + n, z = id + 2 * n;
+    float gaxdt = G_CONSTANT * acc[x] * t;
+    float gaydt = G_CONSTANT * acc[y] * t;
+    float gazdt = G_CONSTANT * acc[z] * t;
 
-    pos[loc]     += vel[loc]     * t + (gaxdt * t * 0.5f);
-    pos[loc + 1] += vel[loc + 1] * t + (gaydt * t * 0.5f);
-    pos[loc + 2] += vel[loc + 2] * t + (gazdt * t * 0.5f);
+    pos[x] += vel[x] * t + (gaxdt * t * 0.5f);
+    pos[y] += vel[y] * t + (gaydt * t * 0.5f);
+    pos[z] += vel[z] * t + (gazdt * t * 0.5f);
 
     // Update velocities for next tick
-    vel[loc]     += gaxdt;
-    vel[loc + 1] += gaydt;
-    vel[loc + 2] += gazdt;
+    vel[x] += gaxdt;
+    vel[y] += gaydt;
+    vel[z] += gazdt;
 
     // Clear the acceleration for next tick
-    acc[loc]     = 0.0f;
-    acc[loc + 1] = 0.0f;
-    acc[loc + 2] = 0.0f;
+    acc[x] = 0.0f;
+    acc[y] = 0.0f;
+    acc[z] = 0.0f;
+}
+
+// The two halves of a kick-drift-kick step. kick also clears acc when clear is set, ready for
+// apply_gravity or apply_gravity_tiled to accumulate the acceleration at the new positions.
+__kernel void kick(__global float* vel,
+                   __global float* acc,
+                   float dt,
+                   int clear) {
+    float G_CONSTANT = 6.67408E-11f;
+    int id = get_global_id(0);
+    int n = get_global_size(0);
+
+    int x = id, y = id + n, z = id + 2 * n;
+    float gdt = G_CONSTANT * dt;
+    vel[x] += gdt * acc[x];
+    vel[y] += gdt * acc[y];
+    vel[z] += gdt * acc[z];
+    if (clear) {
+        acc[x] = 0.0f;
+        acc[y] = 0.0f;
+        acc[z] = 0.0f;
+    }
+}
+
+__kernel void drift(__global float* pos,
+                    __global const float* vel,
+                    float dt) {
+    int id = get_global_id(0);
+    int n = get_global_size(0);
+
+    pos[id]         += vel[id] * dt;
+    pos[id + n]     += vel[id + n] * dt;
+    pos[id + 2 * n] += vel[id + 2 * n] * dt;
+}
+
+// Interleave positions as x, y, z triples for OpenGL. Run with one work-item per real body.
+__kernel void pack_positions(__global const float* pos,
+                             __global float* packed,
+                             int stride) {
+    int id = get_global_id(0);
+    packed[id * 3]     = pos[id];
+    packed[id * 3 + 1] = pos[id + stride];
+    packed[id * 3 + 2] = pos[id + 2 * stride];
+}
+
+// The float4 kernels below keep each body as (x, y, z, mass) so a single load fetches everything
+// the force loop needs. Velocities are float4 too, with w unused.
+
+// Sum the pull of all n bodies on p, staging tiles of get_local_size(0) bodies in local memory.
+// Every work-item of the group has to call this, including those past n.
+float3 gravity_tiles(__global const float4* bodies, __local float4* tile, float3 p, int n) {
+    int lid = get_local_id(0);
+    int tile_size = get_local_size(0);
+
+    float EPS = 1e-6f;
+    accum3_t a = (accum3_t)(0.0f, 0.0f, 0.0f);
+    for (int base = 0; base < n; base += tile_size) {
+        int j = base + lid;
+        tile[lid] = j < n ? bodies[j] : (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int k = 0; k < tile_size; k++) {
+            float4 body = tile[k];
+            float3 d = body.xyz - p;
+
+            float mag_sq = dot(d, d) + EPS;
+            float inv_mag_cubed = rsqrt(mag_sq * mag_sq * mag_sq);
+            a += convert_accum3(d * (body.w * inv_mag_cubed));
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    return convert_float3(a);
+}
+
+// Accelerations (without G) are written once, not accumulated, so acc needs no clearing
+__kernel void apply_gravity4(__global const float4* bodies,
+                             __global float4* acc,
+                             __local float4* tile,
+                             int n) {
+    int id = get_global_id(0);
+    float3 p = id < n ? bodies[id].xyz : (float3)(0.0f, 0.0f, 0.0f);
+    float3 a = gravity_tiles(bodies, tile, p, n);
+    if (id < n)
+        acc[id] = (float4)(a, 0.0f);
+}
+
+// apply_gravity4 for bodies [offset, offset + count) only, so several devices can share a step.
+// acc holds just those bodies, starting from offset.
+__kernel void apply_gravity_range(__global const float4* bodies,
+                                  __global float4* acc,
+                                  __local float4* tile,
+                                  int n,
+                                  int offset,
+                                  int count) {
+    int id = get_global_id(0);
+    float3 p = id < count ? bodies[offset + id].xyz : (float3)(0.0f, 0.0f, 0.0f);
+    float3 a = gravity_tiles(bodies, tile, p, n);
+    if (id < count)
+        acc[id] = (float4)(a, 0.0f);
+}
+
+// Call after apply_gravity4 is completed
+__kernel void update_positions4(__global float4* bodies,
+                                __global float4* vel,
+                                __global const float4* acc,
+                                float dt) {
+    float G_CONSTANT = 6.67408E-11f;
+    int id = get_global_id(0);
+
+    float3 gadt = G_CONSTANT * acc[id].xyz * dt;
+    float4 body = bodies[id];
+    float4 v = vel[id];
+    body.xyz += v.xyz * dt + gadt * dt * 0.5f;
+    v.xyz += gadt;
+    bodies[id] = body;
+    vel[id] = v;
+}
+
+// kick and drift for the float4 layout. apply_gravity4 overwrites acc, so nothing is cleared.
+__kernel void kick4(__global float4* vel,
+                    __global const float4* acc,
+                    float dt) {
+    float G_CONSTANT = 6.67408E-11f;
+    int id = get_global_id(0);
+    vel[id].xyz += G_CONSTANT * dt * acc[id].xyz;
+}
+
+__kernel void drift4(__global float4* bodies,
+                     __global const float4* vel,
+                     float dt) {
+    int id = get_global_id(0);
+    bodies[id].xyz += vel[id].xyz * dt;
+}
+
+// apply_gravity4 and update_positions4 in one launch. Other work-groups still read the old
+// positions, so the new ones go to a second buffer that becomes the input of the next step.
+__kernel void step_fused(__global const float4* bodies,
+                         __global float4* bodies_out,
+                         __global float4* vel,
+                         __local float4* tile,
+                         float dt,
+                         int n) {
+    float G_CONSTANT = 6.67408E-11f;
+    int id = get_global_id(0);
+    float4 body = id < n ? bodies[id] : (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+    float3 a = gravity_tiles(bodies, tile, body.xyz, n);
+    if (id >= n)
+        return;
+
+    float3 gadt = G_CONSTANT * a * dt;
+    float4 v = vel[id];
+    body.xyz += v.xyz * dt + gadt * dt * 0.5f;
+    v.xyz += gadt;
+    bodies_out[id] = body;
+    vel[id] = v;
+}
+
+// Convert between the planar layout and the float4 layout. Run with one work-item per padded body.
+__kernel void pack_bodies(__global const float* pos,
+                          __global const float* vel,
+                          __global const float* mass,
+                          __global float4* bodies,
+                          __global float4* vel4) {
+    int id = get_global_id(0);
+    int n = get_global_size(0);
+    bodies[id] = (float4)(pos[id], pos[id + n], pos[id + 2 * n], mass[id]);
+    vel4[id] = (float4)(vel[id], vel[id + n], vel[id + 2 * n], 0.0f);
+}
+
+__kernel void unpack_bodies(__global const float4* bodies,
+                            __global const float4* vel4,
+                            __global float* pos,
+                            __global float* vel) {
+    int id = get_global_id(0);
+    int n = get_global_size(0);
+    float4 body = bodies[id];
+    float4 v = vel4[id];
+    pos[id] = body.x;
+    pos[id + n] = body.y;
+    pos[id + 2 * n] = body.z;
+    vel[id] = v.x;
+    vel[id + n] = v.y;
+    vel[id + 2 * n] = v.z;
+}
+
+// pack_positions for the float4 layout
+__kernel void pack_positions4(__global const float4* bodies,
+                              __global float* packed) {
+    int id = get_global_id(0);
+    float4 body = bodies[id];
+    packed[id * 3]     = body.x;
+    packed[id * 3 + 1] = body.y;
+    packed[id * 3 + 2] = body.z;
+}
+
+// Fourth order Hermite with a shared step, on the planar layout. acc and jerk include G here.
+// Each step predicts every body from its acceleration and jerk, evaluates both again at the
+// predicted state and corrects.
+
+// Acceleration and jerk from all n bodies, read from global memory like apply_gravity
+__kernel void hermite_force(__global const float* pos,
+                            __global const float* vel,
+                            __global const float* mass,
+                            __global float* acc,
+                            __global float* jerk) {
+    float G_CONSTANT = 6.67408E-11f;
+    int id = get_global_id(0);
+    int n = get_global_size(0);
+
+    float3 p = (float3)(pos[id], pos[id + n], pos[id + 2 * n]);
+    float3 v = (float3)(vel[id], vel[id + n], vel[id + 2 * n]);
+
+    float EPS = 1e-6f;
+    accum3_t a = (accum3_t)(0.0f, 0.0f, 0.0f);
+    accum3_t j = (accum3_t)(0.0f, 0.0f, 0.0f);
+    for (int k = 0; k < n; k++) {
+        float3 d = (float3)(pos[k], pos[k + n], pos[k + 2 * n]) - p;
+        float3 dv = (float3)(vel[k], vel[k + n], vel[k + 2 * n]) - v;
+
+        float inv_r = rsqrt(dot(d, d) + EPS);
+        float inv_r2 = inv_r * inv_r;
+        float m_r3 = mass[k] * inv_r * inv_r2;
+        // d/dt (d / r^3) = dv / r^3 - 3 (d . dv) d / r^5
+        float rv = 3.0f * dot(d, dv) * inv_r2;
+        a += convert_accum3(m_r3 * d);
+        j += convert_accum3(m_r3 * (dv - rv * d));
+    }
+    float3 ga = G_CONSTANT * convert_float3(a);
+    float3 gj = G_CONSTANT * convert_float3(j);
+
+    acc[id]          = ga.x;
+    acc[id + n]      = ga.y;
+    acc[id + 2 * n]  = ga.z;
+    jerk[id]         = gj.x;
+    jerk[id + n]     = gj.y;
+    jerk[id + 2 * n] = gj.z;
+}
+
+// Same sum as hermite_force with the sources staged through local memory like
+// apply_gravity_tiled: each tile holds get_local_size(0) positions with their masses and the
+// matching velocities. The global size may be rounded up past n.
+__kernel void hermite_force_tiled(__global const float* pos,
+                                  __global const float* vel,
+                                  __global const float* mass,
+                                  __global float* acc,
+                                  __global float* jerk,
+                                  __local float4* tile_pos,
+                                  __local float4* tile_vel,
+                                  int n) {
+    float G_CONSTANT = 6.67408E-11f;
+    int id = get_global_id(0);
+    int lid = get_local_id(0);
+    int tile_size = get_local_size(0);
+
+    float3 p = (float3)(0.0f, 0.0f, 0.0f);
+    float3 v = (float3)(0.0f, 0.0f, 0.0f);
+    if (id < n) {
+        p = (float3)(pos[id], pos[id + n], pos[id + 2 * n]);
+        v = (float3)(vel[id], vel[id + n], vel[id + 2 * n]);
+    }
+
+    float EPS = 1e-6f;
+    accum3_t a = (accum3_t)(0.0f, 0.0f, 0.0f);
+    accum3_t j = (accum3_t)(0.0f, 0.0f, 0.0f);
+    for (int base = 0; base < n; base += tile_size) {
+        int src = base + lid;
+        if (src < n) {
+            tile_pos[lid] = (float4)(pos[src], pos[src + n], pos[src + 2 * n], mass[src]);
+            tile_vel[lid] = (float4)(vel[src], vel[src + n], vel[src + 2 * n], 0.0f);
+        } else {
+            tile_pos[lid] = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+            tile_vel[lid] = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int k = 0; k < tile_size; k++) {
+            float4 body = tile_pos[k];
+            float3 d = body.xyz - p;
+            float3 dv = tile_vel[k].xyz - v;
+
+            float inv_r = rsqrt(dot(d, d) + EPS);
+            float inv_r2 = inv_r * inv_r;
+            float m_r3 = body.w * inv_r * inv_r2;
+            float rv = 3.0f * dot(d, dv) * inv_r2;
+            a += convert_accum3(m_r3 * d);
+            j += convert_accum3(m_r3 * (dv - rv * d));
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (id < n) {
+        float3 ga = G_CONSTANT * convert_float3(a);
+        float3 gj = G_CONSTANT * convert_float3(j);
+        acc[id]          = ga.x;
+        acc[id + n]      = ga.y;
+        acc[id + 2 * n]  = ga.z;
+        jerk[id]         = gj.x;
+        jerk[id + n]     = gj.y;
+        jerk[id + 2 * n] = gj.z;
+    }
+}
+
+__kernel void hermite_predict(__global const float* pos,
+                              __global const float* vel,
+                              __global const float* acc,
+                              __global const float* jerk,
+                              __global float* pred_pos,
+                              __global float* pred_vel,
+                              float dt) {
+    int id = get_global_id(0);
+    int n = get_global_size(0);
+
+    float half = dt * 0.5f, third = dt * (1.0f / 3.0f);
+    for (int c = id; c < 3 * n; c += n) {
+        pred_pos[c] = pos[c] + dt * (vel[c] + half * (acc[c] + third * jerk[c]));
+        pred_vel[c] = vel[c] + dt * (acc[c] + half * jerk[c]);
+    }
+}
+
+// The higher derivatives are only ever used multiplied by powers of dt, so the tiny dt^3 and
+// dt^5 are never divided by
+__kernel void hermite_correct(__global float* pos,
+                              __global float* vel,
+                              __global float* acc,
+                              __global float* jerk,
+                              __global const float* pred_pos,
+                              __global const float* pred_vel,
+                              __global const float* next_acc,
+                              __global const float* next_jerk,
+                              float dt) {
+    int id = get_global_id(0);
+    int n = get_global_size(0);
+
+    float dt2 = dt * dt;
+    for (int c = id; c < 3 * n; c += n) {
+        float a0 = acc[c], a1 = next_acc[c], j0 = jerk[c], j1 = next_jerk[c];
+        float a2_dt2 = -6.0f * (a0 - a1) - dt * (4.0f * j0 + 2.0f * j1);
+        float a3_dt3 = 12.0f * (a0 - a1) + 6.0f * dt * (j0 + j1);
+        pos[c] = pred_pos[c] + dt2 * (a2_dt2 * (1.0f / 24.0f) + a3_dt3 * (1.0f / 120.0f));
+        vel[c] = pred_vel[c] + dt * (a2_dt2 * (1.0f / 6.0f) + a3_dt3 * (1.0f / 24.0f));
+        acc[c] = a1;
+        jerk[c] = j1;
+    }
 }
@@ -0,0 +1,49 @@
+#ifndef GRAVITY_ALIGNED_ALLOCATOR_H
+#define GRAVITY_ALIGNED_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// Allocator returning page aligned storage, so SIMD loads never split cache lines and OpenCL
+// runtimes can wrap the arrays with CL_MEM_USE_HOST_PTR without copying them, which some only do
+// for page aligned memory
+template<typename T>
+struct aligned_allocator {
+    using value_type = T;
+    static constexpr std::size_t ALIGNMENT = 4096;
+
+    aligned_allocator() = default;
+
+    template<typename U>
+    aligned_allocator(const aligned_allocator<U> &)
+    {
+    }
+
+    T *allocate(std::size_t n)
+    {
+        return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t{ALIGNMENT}));
+    }
+
+    void deallocate(T *p, std::size_t)
+    {
+        ::operator delete(p, std::align_val_t{ALIGNMENT});
+    }
+};
+
+template<typename T, typename U>
+inline bool operator==(const aligned_allocator<T> &, const aligned_allocator<U> &)
+{
+    return true;
+}
+
+template<typename T, typename U>
+inline bool operator!=(const aligned_allocator<T> &, const aligned_allocator<U> &)
+{
+    return false;
+}
+
+template<typename T>
+using aligned_vector = std::vector<T, aligned_allocator<T>>;
+
+#endif  // GRAVITY_ALIGNED_ALLOCATOR_H
@@ -0,0 +1,73 @@
+#include <glm/glm.hpp>
+
+#include <cmath>
+
+#include "barnes_hut.h"
+
+barnes_hut::barnes_hut(float theta, int leaf_size) : theta{theta}, leaf_size{leaf_size} {}
+
+const char *barnes_hut::name()
+{
+    return "bh";
+}
+
+void barnes_hut::compute(PBodies &bodies)
+{
+    tree.build(bodies, leaf_size);
+
+    auto n = bodies.size();
+    auto theta_sq = theta * theta;
+    auto nodes = tree.nodes.data();
+    auto px = tree.pos.x(), py = tree.pos.y(), pz = tree.pos.z();
+    auto mass = tree.mass.data();
+    auto acc_x = bodies.acc.x(), acc_y = bodies.acc.y(), acc_z = bodies.acc.z();
+
+    // Walk the bodies in Morton order so neighbouring iterations open similar cells
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int k = 0; k < n; k++) {
+        auto x = px[k], y = py[k], z = pz[k];
+        auto ax = 0.0f, ay = 0.0f, az = 0.0f;
+
+        int stack[STACK_SIZE];
+        auto top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            auto &node = nodes[stack[--top]];
+
+            if (node.child_count == 0) {
+                for (int j = node.begin; j < node.end; j++) {
+                    float dx = px[j] - x;
+                    float dy = py[j] - y;
+                    float dz = pz[j] - z;
+                    float mag_sq = dx * dx + dy * dy + dz * dz + PBodies::EPS;
+                    float f_gravity_j = mass[j] / std::sqrt(mag_sq * mag_sq * mag_sq);
+                    ax += dx * f_gravity_j;
+                    ay += dy * f_gravity_j;
+                    az += dz * f_gravity_j;
+                }
+                continue;
+            }
+
+            float dx = node.com.x - x;
+            float dy = node.com.y - y;
+            float dz = node.com.z - z;
+            float mag_sq = dx * dx + dy * dy + dz * dz + PBodies::EPS;
+
+            if (node.size * node.size < theta_sq * mag_sq) {
+                // Far enough away, use the cell's center of mass
+                float f_gravity = node.mass / std::sqrt(mag_sq * mag_sq * mag_sq);
+                ax += dx * f_gravity;
+                ay += dy * f_gravity;
+                az += dz * f_gravity;
+            } else {
+                for (int c = 0; c < node.child_count; c++)
+                    stack[top++] = node.first_child + c;
+            }
+        }
+
+        auto i = tree.order[k];
+        acc_x[i] += ax;
+        acc_y[i] += ay;
+        acc_z[i] += az;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef GRAVITY_BARNES_HUT_H
+#define GRAVITY_BARNES_HUT_H
+
+#include "octree.h"
+#include "pobject.h"
+#include "solver.h"
+
+// O(n log n) approximation of the direct sum. A cell is treated as a point mass at its center
+// of mass when size / distance < theta, otherwise its children are opened.
+class barnes_hut : public gravity_solver
+{
+public:
+    barnes_hut(float theta, int leaf_size);
+    void compute(PBodies &bodies) override;
+    const char *name() override;
+
+private:
+    octree tree;
+    float theta;
+    int leaf_size;
+
+    static constexpr int STACK_SIZE = 8 * 64;
+};
+
+#endif  // GRAVITY_BARNES_HUT_H
@@ -0,0 +1,234 @@
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "block_timestep.h"
+#include "profiler.h"
+
+// Fraction of |a| / |jerk| used for the first step of every body, before there are higher
+// derivatives for the full criterion
+static constexpr float START_ETA = 0.01f;
+
+block_integrator::block_integrator(PBodies &bodies, float eta, int levels)
+    : bodies{bodies},
+      eta{eta},
+      levels{std::clamp(levels, 0, 30)},
+      started{false},
+      level(bodies.size(), 0),
+      last(bodies.size(), 0),
+      steps{0},
+      substeps{0},
+      interactions{0},
+      shared_interactions{0}
+{
+    for (auto a : {&acc, &jerk, &pred_pos, &pred_vel, &next_acc, &next_jerk})
+        a->resize(bodies.padded_size());
+    active.reserve(bodies.size());
+}
+
+void block_integrator::reset()
+{
+    started = false;
+}
+
+int64_t block_integrator::ticks(int body_level) const
+{
+    return int64_t{1} << (levels - body_level);
+}
+
+// Acceleration (with G) and jerk on each target from every body at its predicted position and
+// velocity. The target itself is at zero distance with zero relative velocity, so it adds nothing.
+void block_integrator::evaluate(const int *targets, int count, float *ax, float *ay, float *az,
+                                float *jx, float *jy, float *jz)
+{
+    int n = bodies.size();
+    const float *px = pred_pos.x(), *py = pred_pos.y(), *pz = pred_pos.z();
+    const float *vx = pred_vel.x(), *vy = pred_vel.y(), *vz = pred_vel.z();
+    const float *mass = bodies.mass.data();
+
+#pragma omp parallel for schedule(static)
+    for (int k = 0; k < count; k++) {
+        auto i = targets[k];
+        float xi = px[i], yi = py[i], zi = pz[i];
+        float vxi = vx[i], vyi = vy[i], vzi = vz[i];
+        float sum_ax = 0.0f, sum_ay = 0.0f, sum_az = 0.0f;
+        float sum_jx = 0.0f, sum_jy = 0.0f, sum_jz = 0.0f;
+
+#pragma omp simd reduction(+ : sum_ax, sum_ay, sum_az, sum_jx, sum_jy, sum_jz)
+        for (int j = 0; j < n; j++) {
+            float dx = px[j] - xi, dy = py[j] - yi, dz = pz[j] - zi;
+            float dvx = vx[j] - vxi, dvy = vy[j] - vyi, dvz = vz[j] - vzi;
+            float r2 = dx * dx + dy * dy + dz * dz + PBodies::EPS;
+            float inv_r = 1.0f / std::sqrt(r2);
+            float inv_r2 = inv_r * inv_r;
+            float m_r3 = mass[j] * inv_r * inv_r2;
+            // d/dt (d / r^3) = dv / r^3 - 3 (d . dv) d / r^5
+            float rv = 3.0f * (dx * dvx + dy * dvy + dz * dvz) * inv_r2;
+
+            sum_ax += m_r3 * dx;
+            sum_ay += m_r3 * dy;
+            sum_az += m_r3 * dz;
+            sum_jx += m_r3 * (dvx - rv * dx);
+            sum_jy += m_r3 * (dvy - rv * dy);
+            sum_jz += m_r3 * (dvz - rv * dz);
+        }
+        ax[k] = PBodies::G_CONSTANT * sum_ax;
+        ay[k] = PBodies::G_CONSTANT * sum_ay;
+        az[k] = PBodies::G_CONSTANT * sum_az;
+        jx[k] = PBodies::G_CONSTANT * sum_jx;
+        jy[k] = PBodies::G_CONSTANT * sum_jy;
+        jz[k] = PBodies::G_CONSTANT * sum_jz;
+    }
+}
+
+// Every body starts at tick 0 on the longest step that START_ETA allows
+void block_integrator::start(float dt)
+{
+    int n = bodies.size();
+    std::copy(bodies.pos.data.begin(), bodies.pos.data.end(), pred_pos.data.begin());
+    std::copy(bodies.vel.data.begin(), bodies.vel.data.end(), pred_vel.data.begin());
+    active.resize(n);
+    for (auto i = 0; i < n; i++)
+        active[i] = i;
+    evaluate(active.data(), n, acc.x(), acc.y(), acc.z(), jerk.x(), jerk.y(), jerk.z());
+
+    for (auto i = 0; i < n; i++) {
+        auto a = glm::length(acc.get(i)), j = glm::length(jerk.get(i));
+        auto limit = j > 0.0f ? START_ETA * a / j : dt;
+        auto l = 0;
+        while (l < levels && dt / (1 << l) > limit)
+            l++;
+        level[i] = l;
+        last[i] = 0;
+    }
+    started = true;
+}
+
+// Taylor series to the tick for every body, from the start of its current step
+void block_integrator::predict(int64_t tick, float tick_dt)
+{
+    int n = bodies.size();
+    const float *px = bodies.pos.x(), *py = bodies.pos.y(), *pz = bodies.pos.z();
+    const float *vx = bodies.vel.x(), *vy = bodies.vel.y(), *vz = bodies.vel.z();
+    const float *ax = acc.x(), *ay = acc.y(), *az = acc.z();
+    const float *jx = jerk.x(), *jy = jerk.y(), *jz = jerk.z();
+    float *qx = pred_pos.x(), *qy = pred_pos.y(), *qz = pred_pos.z();
+    float *wx = pred_vel.x(), *wy = pred_vel.y(), *wz = pred_vel.z();
+    const int64_t *start = last.data();
+
+#pragma omp parallel for simd schedule(static)
+    for (int i = 0; i < n; i++) {
+        float t = (tick - start[i]) * tick_dt;
+        float t2 = t * 0.5f, t3 = t * (1.0f / 3.0f);
+        qx[i] = px[i] + t * (vx[i] + t2 * (ax[i] + t3 * jx[i]));
+        qy[i] = py[i] + t * (vy[i] + t2 * (ay[i] + t3 * jy[i]));
+        qz[i] = pz[i] + t * (vz[i] + t2 * (az[i] + t3 * jz[i]));
+        wx[i] = vx[i] + t * (ax[i] + t2 * jx[i]);
+        wy[i] = vy[i] + t * (ay[i] + t2 * jy[i]);
+        wz[i] = vz[i] + t * (az[i] + t2 * jz[i]);
+    }
+}
+
+// Hermite corrector for the active bodies, whose new acceleration and jerk are in next_acc and
+// next_jerk, then the length of their next step. The higher derivatives are fitted in double:
+// the shortest steps are small enough that their fifth power leaves the float range.
+void block_integrator::correct(int64_t tick, float tick_dt)
+{
+    int count = active.size();
+
+#pragma omp parallel for schedule(static)
+    for (int k = 0; k < count; k++) {
+        auto i = active[k];
+        auto dt = static_cast<double>(ticks(level[i])) * tick_dt;
+        auto a0 = glm::dvec3{acc.get(i)}, j0 = glm::dvec3{jerk.get(i)};
+        auto a1 = glm::dvec3{next_acc.get(k)}, j1 = glm::dvec3{next_jerk.get(k)};
+
+        auto dt2 = dt * dt, dt3 = dt2 * dt;
+        auto a2 = (-6.0 * (a0 - a1) - dt * (4.0 * j0 + 2.0 * j1)) / dt2;
+        auto a3 = (12.0 * (a0 - a1) + 6.0 * dt * (j0 + j1)) / dt3;
+        auto p = glm::dvec3{pred_pos.get(i)} + dt3 * dt * (a2 / 24.0 + dt * a3 / 120.0);
+        auto v = glm::dvec3{pred_vel.get(i)} + dt3 * (a2 / 6.0 + dt * a3 / 24.0);
+        bodies.pos.set(i, glm::vec3{p});
+        bodies.vel.set(i, glm::vec3{v});
+        acc.set(i, glm::vec3{a1});
+        jerk.set(i, glm::vec3{j1});
+
+        // Aarseth's criterion, with the second derivative moved to the end of the step
+        auto a2_end = a2 + dt * a3;
+        auto la1 = glm::length(a1), lj1 = glm::length(j1);
+        auto la2 = glm::length(a2_end), la3 = glm::length(a3);
+        auto denominator = lj1 * la3 + la2 * la2;
+        auto limit = denominator > 0.0 ? std::sqrt(eta * (la1 * la2 + lj1 * lj1) / denominator)
+                                       : 2.0 * dt;
+
+        // Halve as often as needed, but only double once, and only where the longer step
+        // stays aligned to its own block
+        auto l = level[i];
+        while (l < levels && ticks(l) * static_cast<double>(tick_dt) > limit)
+            l++;
+        if (l == level[i] && l > 0 && limit >= 2.0 * dt && tick % ticks(l - 1) == 0)
+            l--;
+        level[i] = l;
+        last[i] = tick;
+    }
+}
+
+void block_integrator::step(float dt)
+{
+    PROFILE_SCOPE("block_step");
+    if (!started)
+        start(dt);
+
+    int n = bodies.size();
+    auto end = ticks(0);
+    auto tick_dt = dt / static_cast<float>(end);
+    auto shortest = end;
+
+    // The previous call left every body at its end, which is tick 0 of this one
+    for (auto &t : last)
+        t = 0;
+
+    for (auto tick = int64_t{0}; tick < end;) {
+        auto next = end;
+        for (auto i = 0; i < n; i++)
+            next = std::min(next, last[i] + ticks(level[i]));
+
+        active.clear();
+        for (auto i = 0; i < n; i++)
+            if (last[i] + ticks(level[i]) == next)
+                active.push_back(i);
+
+        predict(next, tick_dt);
+        int count = active.size();
+        evaluate(active.data(), count, next_acc.x(), next_acc.y(), next_acc.z(), next_jerk.x(),
+                 next_jerk.y(), next_jerk.z());
+        correct(next, tick_dt);
+
+        shortest = std::min(shortest, next - tick);
+        interactions += static_cast<uint64_t>(count) * n;
+        substeps++;
+        tick = next;
+    }
+    shared_interactions += static_cast<uint64_t>(n) * n * (end / shortest);
+    steps++;
+}
+
+void block_integrator::print_stats()
+{
+    auto histogram = std::vector<int>(levels + 1, 0);
+    for (auto l : level)
+        histogram[l]++;
+
+    std::printf("block steps: %.1f substeps per step, %.3g interactions, %.1fx fewer than a "
+                "shared step at the shortest level\n",
+                steps ? static_cast<double>(substeps) / steps : 0.0,
+                static_cast<double>(interactions),
+                interactions ? static_cast<double>(shared_interactions) / interactions : 0.0);
+    std::printf("bodies per level:");
+    for (auto l = 0; l <= levels; l++)
+        if (histogram[l])
+            std::printf(" %d:%d", l, histogram[l]);
+    std::printf("\n");
+}
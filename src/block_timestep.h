@@ -0,0 +1,59 @@
+#ifndef GRAVITY_BLOCK_TIMESTEP_H
+#define GRAVITY_BLOCK_TIMESTEP_H
+
+#include <cstdint>
+#include <vector>
+
+#include "pobject.h"
+
+// Fourth order Hermite integration with power of two block timesteps (Makino & Aarseth 1992).
+// Each body steps by dt / 2^level, with the level picked from its acceleration and its
+// derivatives by Aarseth's criterion. At every substep only the bodies whose step ends there
+// have their acceleration and jerk summed over all (predicted) bodies, so bodies on long steps
+// cost nothing in between. Every body lands on the end of each call to step, so the positions
+// and velocities in PBodies are synchronised whenever they are read.
+class block_integrator
+{
+public:
+    // eta is the accuracy parameter of the step criterion, levels the most times a step may be
+    // halved
+    block_integrator(PBodies &bodies, float eta, int levels);
+
+    // Advance every body by dt. The first call, and the first after reset, starts the bodies
+    // from their current positions and velocities.
+    void step(float dt);
+
+    // The positions or velocities were changed from outside
+    void reset();
+
+    // Substeps taken and how many interactions they cost, against a shared step as small as
+    // the smallest block step
+    void print_stats();
+
+    static constexpr float DEFAULT_ETA = 0.02f;
+    static constexpr int DEFAULT_LEVELS = 10;
+
+private:
+    PBodies &bodies;
+    float eta;
+    int levels;
+    bool started;
+    // Acceleration (with G) and jerk at the start of each body's current step, the positions
+    // and velocities of every body predicted to the current substep, and the new acceleration
+    // and jerk of the active bodies, in the order of active
+    vec3_array acc, jerk, pred_pos, pred_vel, next_acc, next_jerk;
+    std::vector<int> level;
+    std::vector<int64_t> last;  // Tick each body's current step started at
+    std::vector<int> active;
+
+    uint64_t steps, substeps, interactions, shared_interactions;
+
+    int64_t ticks(int body_level) const;
+    void start(float dt);
+    void predict(int64_t tick, float tick_dt);
+    void evaluate(const int *targets, int count, float *ax, float *ay, float *az, float *jx,
+                  float *jy, float *jz);
+    void correct(int64_t tick, float tick_dt);
+};
+
+#endif  // GRAVITY_BLOCK_TIMESTEP_H
@@ -0,0 +1,101 @@
+#include <cstring>
+#include <iostream>
+
+#include "cl_common.h"
+
+bool check_error(cl_int err, const char *message)
+{
+    if (err != CL_SUCCESS) {
+        std::cerr << "ERROR: " << message << " (" << err << ")" << std::endl;
+        return true;
+    }
+    return false;
+}
+
+std::string get_device_name(cl_device_id id)
+{
+    auto size = 0UL;
+    clGetDeviceInfo(id, CL_DEVICE_NAME, 0, nullptr, &size);
+    auto s = std::string(size, '\0');
+    clGetDeviceInfo(id, CL_DEVICE_NAME, size, const_cast<char *>(s.data()), nullptr);
+    // size counts the terminator
+    s.resize(std::strlen(s.c_str()));
+    return s;
+}
+
+std::string get_platform_name(cl_platform_id id)
+{
+    auto size = 0UL;
+    clGetPlatformInfo(id, CL_PLATFORM_NAME, 0, nullptr, &size);
+    auto s = std::string(size, '\0');
+    clGetPlatformInfo(id, CL_PLATFORM_NAME, size, const_cast<char *>(s.data()), nullptr);
+    // size counts the terminator
+    s.resize(std::strlen(s.c_str()));
+    return s;
+}
+
+std::vector<cl_platform_id> get_platforms()
+{
+    auto platformIdCount = 0U;
+    clGetPlatformIDs(0, nullptr, &platformIdCount);
+
+    auto platforms = std::vector<cl_platform_id>(platformIdCount);
+    clGetPlatformIDs(platformIdCount, platforms.data(), nullptr);
+
+    return platforms;
+}
+
+cl_platform_id find_platform(const std::string &preferred_platform)
+{
+    auto platforms = get_platforms();
+    if (platforms.empty())
+        throw std::runtime_error{"No OpenCL platforms found"};
+
+    for (auto &platform : platforms) {
+        auto platform_name = get_platform_name(platform);
+        if (platform_name.find(preferred_platform) != std::string::npos)
+            return platform;
+    }
+
+    // Otherwise just pick the first platform if we couldn't find preferred one
+    return platforms[0];
+}
+
+void check_build_errors(cl_int error, cl_program program, cl_device_id device)
+{
+    if (error) {
+        auto len = 0UL;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &len);
+        auto log = std::string(len, '\0');
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, len,
+                              const_cast<char *>(log.c_str()), nullptr);
+        std::cerr << "build error(" << error << "): " << log << "\n";
+    }
+}
+
+cl_program make_program(const char *kernel_source, cl_context context, cl_device_id device,
+                        const char *options)
+{
+    auto error = 0;
+    auto program = clCreateProgramWithSource(context, 1, &kernel_source, nullptr, nullptr);
+
+    error = clBuildProgram(program, 0, nullptr, options, nullptr, nullptr);
+    check_build_errors(error, program, device);
+
+    return program;
+}
+
+cl_command_queue get_command_queue(cl_context context, cl_device_id device, bool profiling)
+{
+    auto error = 0;
+#ifdef __APPLE__
+    auto ret = clCreateCommandQueue(context, device, profiling ? CL_QUEUE_PROFILING_ENABLE : 0,
+                                    &error);
+#else
+    cl_queue_properties properties[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+    auto ret = clCreateCommandQueueWithProperties(context, device,
+                                                  profiling ? properties : nullptr, &error);
+#endif
+    check_error(error, "clCreateCommandQueueWithProperties");
+    return ret;
+}
@@ -0,0 +1,48 @@
+#ifndef GRAVITY_CL_COMMON_H
+#define GRAVITY_CL_COMMON_H
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// OpenCL helpers shared by physics_cl and multi_executor
+
+// Prints the error and returns true if err is not CL_SUCCESS
+bool check_error(cl_int err, const char *message);
+
+#define throw_error_info(err, message)                                                            \
+    do {                                                                                          \
+        if ((err) != CL_SUCCESS) {                                                                \
+            std::stringstream ss;                                                                 \
+            ss << "error at " << __FILE__ << ":" << __LINE__ << " " << (message) << " (" << (err) \
+               << ')';                                                                            \
+            throw std::runtime_error{ss.str()};                                                   \
+        }                                                                                         \
+    } while (0);
+
+std::string get_device_name(cl_device_id id);
+std::string get_platform_name(cl_platform_id id);
+std::vector<cl_platform_id> get_platforms();
+
+// The first platform whose name contains preferred_platform, or else the first platform
+cl_platform_id find_platform(const std::string &preferred_platform);
+
+void check_build_errors(cl_int error, cl_program program, cl_device_id device);
+
+// Builds the program for every device of the context, printing the build log on failure.
+// options are passed to the OpenCL compiler, such as -D definitions.
+cl_program make_program(const char *kernel_source, cl_context context, cl_device_id device,
+                        const char *options = nullptr);
+
+// In-order queue, with event profiling if asked for
+cl_command_queue get_command_queue(cl_context context, cl_device_id device,
+                                   bool profiling = false);
+
+#endif  // GRAVITY_CL_COMMON_H
@@ -92,6 +92,9 @@ void GLDisplay::update()
             closed = true;
         } else if (e.type == SDL_KEYDOWN) {
             auto keyPressed = e.key.keysym.sym;
+            if (keys.size() == MAX_QUEUED_KEYS)
+                keys.pop_front();
+            keys.push_back(keyPressed);
             if (keyPressed == SDLK_UP) {
                 clear_enabled = !clear_enabled;
             }
@@ -114,3 +117,12 @@ void GLDisplay::update()
     }
     SDL_GL_SwapWindow(window);
 }
+
+bool GLDisplay::next_key(SDL_Keycode &key)
+{
+    if (keys.empty())
+        return false;
+    key = keys.front();
+    keys.pop_front();
+    return true;
+}
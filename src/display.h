@@ -1,6 +1,8 @@
 #ifndef DISPLAY_H
 #define DISPLAY_H
 
+#include <deque>
+
 #include "SDL.h"
 
 class GLDisplay
@@ -32,12 +34,18 @@ public:
     bool resized();
     void clear(float r, float g, float b, float a);
     void update();
+    // Keys pressed since the last call, oldest first. Returns false when there are none.
+    bool next_key(SDL_Keycode &key);
 
 private:
     SDL_Window *window;
     SDL_GLContext glContext;
     int _width, _height;
     bool closed, clear_enabled, fullscreen, _resized;
+    std::deque<SDL_Keycode> keys;
+
+    // Programs that never read keys should not collect them forever
+    static constexpr size_t MAX_QUEUED_KEYS = 64;
 };
 
 #endif
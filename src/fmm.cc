@@ -0,0 +1,349 @@
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+#include "fmm.h"
+
+static double binomial(int n, int k)
+{
+    auto result = 1.0;
+    for (int i = 1; i <= k; i++)
+        result = result * (n - k + i) / i;
+    return result;
+}
+
+fmm::fmm(int order, float theta, int leaf_size)
+    : order{std::clamp(order, 1, MAX_ORDER)}, leaf_size{leaf_size}, theta{theta}
+{
+    auto p = this->order;
+    term_index.assign((p + 1) * (p + 1) * (p + 1), -1);
+    for (int d = 0; d <= p; d++) {
+        for (int a = d; a >= 0; a--) {
+            for (int b = d - a; b >= 0; b--) {
+                auto c = d - a - b;
+                term_index[(a * (p + 1) + b) * (p + 1) + c] = static_cast<int>(degree.size());
+                exponent[0].push_back(a);
+                exponent[1].push_back(b);
+                exponent[2].push_back(c);
+                degree.push_back(d);
+            }
+        }
+    }
+    nterms = static_cast<int>(degree.size());
+    make_operators();
+}
+
+const char *fmm::name()
+{
+    return "fmm";
+}
+
+int fmm::index_of(int a, int b, int c)
+{
+    if (a < 0 || b < 0 || c < 0 || a + b + c > order)
+        return -1;
+    return term_index[(a * (order + 1) + b) * (order + 1) + c];
+}
+
+void fmm::make_operators()
+{
+    monomial_parent.assign(nterms, -1);
+    monomial_axis.assign(nterms, 0);
+    for (int axis = 0; axis < 3; axis++) {
+        minus_one[axis].assign(nterms, -1);
+        minus_two[axis].assign(nterms, -1);
+    }
+
+    for (int t = 0; t < nterms; t++) {
+        int k[3] = {exponent[0][t], exponent[1][t], exponent[2][t]};
+        for (int axis = 0; axis < 3; axis++) {
+            int one[3] = {k[0], k[1], k[2]};
+            int two[3] = {k[0], k[1], k[2]};
+            one[axis] -= 1;
+            two[axis] -= 2;
+            minus_one[axis][t] = index_of(one[0], one[1], one[2]);
+            minus_two[axis][t] = index_of(two[0], two[1], two[2]);
+        }
+        for (int axis = 0; axis < 3 && t > 0; axis++) {
+            if (k[axis] > 0) {
+                monomial_parent[t] = minus_one[axis][t];
+                monomial_axis[t] = axis;
+                break;
+            }
+        }
+    }
+
+    // Multi-index binomial coefficient, the product of the per-axis binomials
+    auto multi_binomial = [&](int n, int k) {
+        auto result = 1.0;
+        for (int axis = 0; axis < 3; axis++)
+            result *= binomial(exponent[axis][n], exponent[axis][k]);
+        return result;
+    };
+    auto difference = [&](int n, int k) {
+        return index_of(exponent[0][n] - exponent[0][k], exponent[1][n] - exponent[1][k],
+                        exponent[2][n] - exponent[2][k]);
+    };
+
+    m2m_ops.clear();
+    m2l_ops.clear();
+    l2l_ops.clear();
+    for (int n = 0; n < nterms; n++) {
+        for (int k = 0; k < nterms; k++) {
+            // M2M: M_parent[n] += binom(n, k) M_child[k] s^(n - k)
+            auto nk = difference(n, k);
+            if (nk >= 0)
+                m2m_ops.push_back({n, k, nk, multi_binomial(n, k)});
+
+            // L2L: L_child[k] += binom(n, k) L_parent[n] t^(n - k)
+            if (nk >= 0)
+                l2l_ops.push_back({k, n, nk, multi_binomial(n, k)});
+
+            // M2L: L[n] += (-1)^|k| binom(n + k, n) M[k] a_(n + k)
+            auto sum = index_of(exponent[0][n] + exponent[0][k], exponent[1][n] + exponent[1][k],
+                                exponent[2][n] + exponent[2][k]);
+            if (sum >= 0) {
+                auto sign = degree[k] % 2 ? -1.0 : 1.0;
+                m2l_ops.push_back({n, k, sum, sign * multi_binomial(sum, n)});
+            }
+        }
+    }
+
+    // L2P: the gradient of sum L[n] t^n along each axis
+    for (int axis = 0; axis < 3; axis++) {
+        l2p_ops[axis].clear();
+        for (int n = 0; n < nterms; n++) {
+            if (exponent[axis][n] > 0)
+                l2p_ops[axis].push_back({0, n, minus_one[axis][n], double(exponent[axis][n])});
+        }
+    }
+}
+
+void fmm::monomials(double x, double y, double z, double *out)
+{
+    double d[3] = {x, y, z};
+    out[0] = 1.0;
+    for (int t = 1; t < nterms; t++)
+        out[t] = out[monomial_parent[t]] * d[monomial_axis[t]];
+}
+
+// Taylor coefficients a_k = d^k phi / k! of phi(r) = (|r|^2 + EPS)^(-1/2), using the recurrence
+// |k| R^2 a_k + (2|k| - 1) sum_i r_i a_(k - e_i) + (|k| - 1) sum_i a_(k - 2e_i) = 0
+void fmm::taylor_coefficients(double x, double y, double z, double *out)
+{
+    double r[3] = {x, y, z};
+    auto r_sq = x * x + y * y + z * z + PBodies::EPS;
+    auto inv_r_sq = 1.0 / r_sq;
+    out[0] = std::sqrt(inv_r_sq);
+    for (int t = 1; t < nterms; t++) {
+        auto n = degree[t];
+        auto first = 0.0, second = 0.0;
+        for (int axis = 0; axis < 3; axis++) {
+            if (minus_one[axis][t] >= 0)
+                first += r[axis] * out[minus_one[axis][t]];
+            if (minus_two[axis][t] >= 0)
+                second += out[minus_two[axis][t]];
+        }
+        out[t] = -((2 * n - 1) * first + (n - 1) * second) * inv_r_sq / n;
+    }
+}
+
+void fmm::compute(PBodies &bodies)
+{
+    tree.build(bodies, leaf_size);
+
+    auto n = bodies.size();
+    auto nodes = tree.num_nodes();
+    if (n == 0)
+        return;
+
+    for (int axis = 0; axis < 3; axis++)
+        center[axis].resize(nodes);
+    radius.resize(nodes);
+    multipoles.assign(static_cast<size_t>(nodes) * nterms, 0.0);
+    locals.assign(static_cast<size_t>(nodes) * nterms, 0.0);
+    sorted_acc.resize(n);
+
+#pragma omp parallel
+#pragma omp single
+    {
+        upward(0);
+        interact(0, 0);
+        downward(0);
+    }
+
+    auto acc_x = bodies.acc.x(), acc_y = bodies.acc.y(), acc_z = bodies.acc.z();
+    auto sorted_x = sorted_acc.x(), sorted_y = sorted_acc.y(), sorted_z = sorted_acc.z();
+#pragma omp parallel for
+    for (int k = 0; k < n; k++) {
+        auto i = tree.order[k];
+        acc_x[i] += sorted_x[k];
+        acc_y[i] += sorted_y[k];
+        acc_z[i] += sorted_z[k];
+    }
+}
+
+// P2M at the leaves and M2M on the way back up, expansions are centered on the center of mass
+void fmm::upward(int index)
+{
+    auto &node = tree.nodes[index];
+    center[0][index] = node.com.x;
+    center[1][index] = node.com.y;
+    center[2][index] = node.com.z;
+    auto multipole = &multipoles[static_cast<size_t>(index) * nterms];
+
+    double mono[MAX_ORDER_TERMS];
+    if (node.child_count == 0) {
+        auto px = tree.pos.x(), py = tree.pos.y(), pz = tree.pos.z();
+        auto r_max = 0.0;
+        for (int j = node.begin; j < node.end; j++) {
+            auto dx = px[j] - center[0][index];
+            auto dy = py[j] - center[1][index];
+            auto dz = pz[j] - center[2][index];
+            r_max = std::max(r_max, dx * dx + dy * dy + dz * dz);
+            monomials(dx, dy, dz, mono);
+            for (int t = 0; t < nterms; t++)
+                multipole[t] += tree.mass[j] * mono[t];
+        }
+        radius[index] = std::sqrt(r_max);
+        return;
+    }
+
+    for (int c = node.first_child; c < node.first_child + node.child_count; c++) {
+        if (tree.nodes[c].end - tree.nodes[c].begin > TASK_CUTOFF) {
+#pragma omp task
+            upward(c);
+        } else {
+            upward(c);
+        }
+    }
+#pragma omp taskwait
+
+    auto r_max = 0.0;
+    for (int c = node.first_child; c < node.first_child + node.child_count; c++) {
+        auto dx = center[0][c] - center[0][index];
+        auto dy = center[1][c] - center[1][index];
+        auto dz = center[2][c] - center[2][index];
+        r_max = std::max(r_max, std::sqrt(dx * dx + dy * dy + dz * dz) + radius[c]);
+
+        auto child = &multipoles[static_cast<size_t>(c) * nterms];
+        monomials(dx, dy, dz, mono);
+        for (auto &op : m2m_ops)
+            multipole[op.o] += op.coeff * child[op.i] * mono[op.f];
+    }
+    radius[index] = r_max;
+}
+
+// Dual tree walk. Only the target side is split into tasks, so each task owns the locals and
+// accelerations of its target subtree and no two tasks ever write the same cell.
+void fmm::interact(int target, int source)
+{
+    auto &t = tree.nodes[target];
+    auto &s = tree.nodes[source];
+
+    auto dx = center[0][target] - center[0][source];
+    auto dy = center[1][target] - center[1][source];
+    auto dz = center[2][target] - center[2][source];
+    auto distance = std::sqrt(dx * dx + dy * dy + dz * dz);
+
+    if (radius[target] + radius[source] < theta * distance) {
+        m2l(target, source);
+    } else if (t.child_count == 0 && s.child_count == 0) {
+        p2p(target, source);
+    } else if (s.child_count == 0 || (t.child_count > 0 && radius[target] >= radius[source])) {
+        for (int c = t.first_child; c < t.first_child + t.child_count; c++) {
+            if (tree.nodes[c].end - tree.nodes[c].begin > TASK_CUTOFF) {
+#pragma omp task
+                interact(c, source);
+            } else {
+                interact(c, source);
+            }
+        }
+#pragma omp taskwait
+    } else {
+        for (int c = s.first_child; c < s.first_child + s.child_count; c++)
+            interact(target, c);
+    }
+}
+
+void fmm::m2l(int target, int source)
+{
+    double a[MAX_ORDER_TERMS];
+    taylor_coefficients(center[0][target] - center[0][source],
+                        center[1][target] - center[1][source],
+                        center[2][target] - center[2][source], a);
+
+    auto multipole = &multipoles[static_cast<size_t>(source) * nterms];
+    auto local = &locals[static_cast<size_t>(target) * nterms];
+    for (auto &op : m2l_ops)
+        local[op.o] += op.coeff * multipole[op.i] * a[op.f];
+}
+
+void fmm::p2p(int target, int source)
+{
+    auto &t = tree.nodes[target];
+    auto &s = tree.nodes[source];
+    auto px = tree.pos.x(), py = tree.pos.y(), pz = tree.pos.z();
+    auto mass = tree.mass.data();
+    auto acc_x = sorted_acc.x(), acc_y = sorted_acc.y(), acc_z = sorted_acc.z();
+
+    for (int i = t.begin; i < t.end; i++) {
+        auto ax = 0.0f, ay = 0.0f, az = 0.0f;
+        for (int j = s.begin; j < s.end; j++) {
+            float dx = px[j] - px[i];
+            float dy = py[j] - py[i];
+            float dz = pz[j] - pz[i];
+            float mag_sq = dx * dx + dy * dy + dz * dz + PBodies::EPS;
+            float f_gravity_j = mass[j] / std::sqrt(mag_sq * mag_sq * mag_sq);
+            ax += dx * f_gravity_j;
+            ay += dy * f_gravity_j;
+            az += dz * f_gravity_j;
+        }
+        acc_x[i] += ax;
+        acc_y[i] += ay;
+        acc_z[i] += az;
+    }
+}
+
+// L2L from each cell to its children, and L2P at the leaves
+void fmm::downward(int index)
+{
+    auto &node = tree.nodes[index];
+    auto local = &locals[static_cast<size_t>(index) * nterms];
+
+    double mono[MAX_ORDER_TERMS];
+    if (node.child_count == 0) {
+        auto px = tree.pos.x(), py = tree.pos.y(), pz = tree.pos.z();
+        auto acc_x = sorted_acc.x(), acc_y = sorted_acc.y(), acc_z = sorted_acc.z();
+        for (int j = node.begin; j < node.end; j++) {
+            monomials(px[j] - center[0][index], py[j] - center[1][index],
+                      pz[j] - center[2][index], mono);
+            double grad[3] = {0.0, 0.0, 0.0};
+            for (int axis = 0; axis < 3; axis++) {
+                for (auto &op : l2p_ops[axis])
+                    grad[axis] += op.coeff * local[op.i] * mono[op.f];
+            }
+            acc_x[j] += static_cast<float>(grad[0]);
+            acc_y[j] += static_cast<float>(grad[1]);
+            acc_z[j] += static_cast<float>(grad[2]);
+        }
+        return;
+    }
+
+    for (int c = node.first_child; c < node.first_child + node.child_count; c++) {
+        auto child = &locals[static_cast<size_t>(c) * nterms];
+        monomials(center[0][c] - center[0][index], center[1][c] - center[1][index],
+                  center[2][c] - center[2][index], mono);
+        for (auto &op : l2l_ops)
+            child[op.o] += op.coeff * local[op.i] * mono[op.f];
+
+        if (tree.nodes[c].end - tree.nodes[c].begin > TASK_CUTOFF) {
+#pragma omp task
+            downward(c);
+        } else {
+            downward(c);
+        }
+    }
+#pragma omp taskwait
+}
@@ -0,0 +1,64 @@
+#ifndef GRAVITY_FMM_H
+#define GRAVITY_FMM_H
+
+#include <vector>
+
+#include "octree.h"
+#include "pobject.h"
+#include "solver.h"
+
+// Fast multipole method using Cartesian Taylor expansions of the softened 1/r potential up to a
+// configurable order. Cells interact through a dual tree walk: well separated pairs of cells
+// (r_a + r_b < theta * distance) go through a multipole to local translation, everything else
+// is split until it reaches pairs of leaves, which are summed directly. This costs O(n) for a
+// fixed order and leaf size.
+class fmm : public gravity_solver
+{
+public:
+    fmm(int order, float theta, int leaf_size);
+    void compute(PBodies &bodies) override;
+    const char *name() override;
+
+private:
+    // One entry of a flattened translation operator: out[o] += coeff * in[i] * factor[f]
+    struct term_op {
+        int o, i, f;
+        double coeff;
+    };
+
+    octree tree;
+    int order, nterms, leaf_size;
+    float theta;
+
+    // Multi-index (a, b, c) with a + b + c <= order for each term, ordered by degree
+    std::vector<int> exponent[3];
+    std::vector<int> term_index;  // Inverse of exponent, see index_of
+    std::vector<int> degree;
+    // For term k, the index of k - e_axis used to build monomials and Taylor coefficients
+    std::vector<int> monomial_parent, monomial_axis;
+    std::vector<int> minus_one[3], minus_two[3];
+
+    std::vector<term_op> m2m_ops, m2l_ops, l2l_ops;
+    std::vector<term_op> l2p_ops[3];
+
+    std::vector<double> center[3], radius;
+    std::vector<double> multipoles, locals;
+    vec3_array sorted_acc;
+
+    int index_of(int a, int b, int c);
+    void make_operators();
+    void monomials(double x, double y, double z, double *out);
+    void taylor_coefficients(double x, double y, double z, double *out);
+
+    void upward(int node);
+    void interact(int target, int source);
+    void m2l(int target, int source);
+    void p2p(int target, int source);
+    void downward(int node);
+
+    static constexpr int TASK_CUTOFF = 1 << 10;  // Spawn tasks for cells with more bodies
+    static constexpr int MAX_ORDER = 12;
+    static constexpr int MAX_ORDER_TERMS = (MAX_ORDER + 1) * (MAX_ORDER + 2) * (MAX_ORDER + 3) / 6;
+};
+
+#endif  // GRAVITY_FMM_H
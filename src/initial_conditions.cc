@@ -0,0 +1,266 @@
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "initial_conditions.h"
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"). The counter holds
+// the index of the body and the number of blocks drawn for it so far, so each body has its own
+// stream that no other body or thread touches.
+class philox_stream
+{
+public:
+    philox_stream(uint64_t seed, uint64_t index)
+        : key{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)},
+          counter{static_cast<uint32_t>(index), static_cast<uint32_t>(index >> 32), 0, 0},
+          used{4}
+    {
+    }
+
+    uint32_t next()
+    {
+        if (used == 4)
+            refill();
+        return out[used++];
+    }
+
+    // [0, 1)
+    float uniform()
+    {
+        return (next() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // (0, 1], safe to take the log or a negative power of
+    float uniform_open()
+    {
+        return ((next() >> 8) + 1) * (1.0f / 16777216.0f);
+    }
+
+    float uniform(float lo, float hi)
+    {
+        return lo + (hi - lo) * uniform();
+    }
+
+    float normal()
+    {
+        auto r = std::sqrt(-2.0f * std::log(uniform_open()));
+        return r * std::cos(TWO_PI * uniform());
+    }
+
+    // Uniformly distributed on the unit sphere
+    glm::vec3 direction()
+    {
+        auto z = uniform(-1.0f, 1.0f);
+        auto phi = TWO_PI * uniform();
+        auto s = std::sqrt(1.0f - z * z);
+        return {s * std::cos(phi), s * std::sin(phi), z};
+    }
+
+    static constexpr float TWO_PI = 6.28318531f;
+
+private:
+    uint32_t key[2], counter[4], out[4];
+    int used;
+
+    void refill()
+    {
+        uint32_t c[4] = {counter[0], counter[1], counter[2], counter[3]};
+        uint32_t k[2] = {key[0], key[1]};
+        for (int round = 0; round < 10; round++) {
+            auto p0 = uint64_t{0xD2511F53} * c[0];
+            auto p1 = uint64_t{0xCD9E8D57} * c[2];
+            uint32_t next[4] = {static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0],
+                                static_cast<uint32_t>(p1),
+                                static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1],
+                                static_cast<uint32_t>(p0)};
+            c[0] = next[0];
+            c[1] = next[1];
+            c[2] = next[2];
+            c[3] = next[3];
+            k[0] += 0x9E3779B9;
+            k[1] += 0xBB67AE85;
+        }
+        out[0] = c[0];
+        out[1] = c[1];
+        out[2] = c[2];
+        out[3] = c[3];
+        counter[2]++;
+        used = 0;
+    }
+};
+
+struct body {
+    glm::vec3 pos, vel, color;
+    float mass;
+};
+
+using scene_generator = body (*)(philox_stream &rng, int index, int count);
+
+static constexpr float G = PBodies::G_CONSTANT;
+static constexpr float CENTRAL_MASS = 5e14f;
+
+// The last body of the orbiting scenes holds them together
+static body central_body()
+{
+    return {{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}, {1.0f, 1.0f, 1.0f}, CENTRAL_MASS};
+}
+
+// Four cubes of bodies orbiting the central mass in different planes
+static body blocks_body(philox_stream &rng, int i, int count)
+{
+    if (i == count - 1)
+        return central_body();
+
+    auto range = 0.2f;
+    auto offset = glm::vec3{rng.uniform(-range, range), rng.uniform(-range, range),
+                            rng.uniform(-range, range)};
+    auto b = body{};
+    if (i < (1.0f / 4.0f) * count) {
+        b.pos = offset + glm::vec3{-1.3f, 0.0f, 0.0f};
+        b.vel = {0.0f, 110.0f, 0.0f};
+        b.color = {0.0f, 1.0f, 0.0f};
+    } else if (i < (2.0f / 3.0f) * count) {
+        b.pos = offset + glm::vec3{1.3f, 0.0f, 0.0f};
+        b.vel = {0.0f, -110.0f, 0.0f};
+        b.color = {1.0f, 0.0f, 1.0f};
+    } else if (i < (3.0f / 4.0f) * count) {
+        b.pos = offset + glm::vec3{0.0f, 1.3f, 0.0f};
+        b.vel = {0.0f, 0.0f, 110.0f};
+        b.color = {1.0f, 1.0f, 1.0f};
+    } else {
+        b.pos = offset + glm::vec3{0.0f, -1.3f, 0.0f};
+        b.vel = {0.0f, 0.0f, -110.0f};
+        b.color = {1.0f, 0.0f, 0.0f};
+    }
+    b.mass = rng.uniform(0.0f, range) * 9.5e9f;
+    return b;
+}
+
+static constexpr float PLUMMER_MASS = 5e13f;
+static constexpr float PLUMMER_RADIUS = 0.5f;
+
+// One member of a Plummer sphere in virial equilibrium, sampled as in Aarseth, Henon & Wielen
+// (1974). The few bodies beyond ten scale radii are drawn again.
+static body plummer_member(philox_stream &rng, int members, glm::vec3 center, glm::vec3 drift)
+{
+    auto a = PLUMMER_RADIUS;
+    auto r = 0.0f;
+    do {
+        r = a / std::sqrt(std::pow(rng.uniform_open(), -2.0f / 3.0f) - 1.0f);
+    } while (!(r < 10.0f * a));
+
+    // Speed as a fraction q of the local escape speed, by rejection from q^2 (1 - q^2)^3.5
+    auto q = 0.0f;
+    do {
+        q = rng.uniform();
+    } while (0.1f * rng.uniform() > q * q * std::pow(1.0f - q * q, 3.5f));
+    auto escape =
+        std::sqrt(2.0f * G * PLUMMER_MASS / a) * std::pow(1.0f + r * r / (a * a), -0.25f);
+
+    auto t = std::min(r / (3.0f * a), 1.0f);
+    auto b = body{};
+    b.pos = center + r * rng.direction();
+    b.vel = drift + q * escape * rng.direction();
+    b.color = glm::mix(glm::vec3{1.0f, 0.95f, 0.8f}, glm::vec3{0.4f, 0.5f, 1.0f}, t);
+    b.mass = PLUMMER_MASS / members;
+    return b;
+}
+
+static body plummer_body(philox_stream &rng, int, int count)
+{
+    return plummer_member(rng, count, {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f});
+}
+
+// Two Plummer spheres falling towards each other slightly off-centre
+static body collision_body(philox_stream &rng, int i, int count)
+{
+    auto half = count / 2;
+    auto first = i < half;
+    auto b = first
+                 ? plummer_member(rng, half, {-1.5f, 0.15f, 0.0f}, {50.0f, 0.0f, 0.0f})
+                 : plummer_member(rng, count - half, {1.5f, -0.15f, 0.0f}, {-50.0f, 0.0f, 0.0f});
+    b.color = first ? glm::vec3{0.0f, 1.0f, 0.0f} : glm::vec3{1.0f, 0.0f, 1.0f};
+    return b;
+}
+
+static constexpr float DISK_MASS = 1e14f;
+static constexpr float DISK_SCALE = 0.5f;
+static constexpr float DISK_THICKNESS = 0.02f;
+
+// Exponential disk in the x-z plane on circular orbits around the central mass. The radius
+// density R exp(-R / DISK_SCALE) is a gamma distribution, the sum of two exponentials.
+static body disk_body(philox_stream &rng, int i, int count)
+{
+    if (i == count - 1)
+        return central_body();
+
+    auto R = 0.0f;
+    do {
+        R = -DISK_SCALE * std::log(rng.uniform_open() * rng.uniform_open());
+    } while (!(R < 8.0f * DISK_SCALE) || R < 0.01f * DISK_SCALE);
+    auto phi = philox_stream::TWO_PI * rng.uniform();
+
+    // Disk mass inside R, counted as if it were spherical
+    auto x = R / DISK_SCALE;
+    auto enclosed = CENTRAL_MASS + DISK_MASS * (1.0f - (1.0f + x) * std::exp(-x));
+    auto speed = std::sqrt(G * enclosed / R);
+
+    auto t = std::min(x / 3.0f, 1.0f);
+    auto b = body{};
+    b.pos = {R * std::cos(phi), DISK_THICKNESS * rng.normal(), R * std::sin(phi)};
+    b.vel = {-speed * std::sin(phi), 0.0f, speed * std::cos(phi)};
+    b.color = glm::mix(glm::vec3{1.0f, 0.9f, 0.6f}, glm::vec3{0.5f, 0.6f, 1.0f}, t);
+    b.mass = DISK_MASS / (count - 1);
+    return b;
+}
+
+static scene_generator find_scene(const std::string &name)
+{
+    if (name == "blocks")
+        return blocks_body;
+    if (name == "plummer")
+        return plummer_body;
+    if (name == "disk")
+        return disk_body;
+    if (name == "collision")
+        return collision_body;
+    throw std::runtime_error{"unknown initial conditions: " + name};
+}
+
+void init_bodies(PBodies &bodies, const ic_options &options, int count, int first)
+{
+    auto generate = find_scene(options.name);
+    auto n = bodies.size();
+    float *px = bodies.pos.x(), *py = bodies.pos.y(), *pz = bodies.pos.z();
+    float *vx = bodies.vel.x(), *vy = bodies.vel.y(), *vz = bodies.vel.z();
+    float *ax = bodies.acc.x(), *ay = bodies.acc.y(), *az = bodies.acc.z();
+
+#pragma omp parallel for schedule(static)
+    for (int k = 0; k < n; k++) {
+        auto rng = philox_stream{options.seed, static_cast<uint64_t>(first + k)};
+        auto b = generate(rng, first + k, count);
+        px[k] = b.pos.x;
+        py[k] = b.pos.y;
+        pz[k] = b.pos.z;
+        vx[k] = b.vel.x;
+        vy[k] = b.vel.y;
+        vz[k] = b.vel.z;
+        ax[k] = 0.0f;
+        ay[k] = 0.0f;
+        az[k] = 0.0f;
+        bodies.mass[k] = b.mass;
+        bodies.color[k] = b.color;
+    }
+}
+
+void init_bodies(PBodies &bodies, const ic_options &options)
+{
+    init_bodies(bodies, options, bodies.size(), 0);
+}
+
+void init_bodies(PBodies &bodies)
+{
+    init_bodies(bodies, ic_options{"blocks", 1});
+}
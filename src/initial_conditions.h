@@ -0,0 +1,25 @@
+#ifndef GRAVITY_INITIAL_CONDITIONS_H
+#define GRAVITY_INITIAL_CONDITIONS_H
+
+#include <cstdint>
+#include <string>
+
+#include "pobject.h"
+
+struct ic_options {
+    std::string name;  // blocks, plummer, disk, collision
+    uint64_t seed;
+};
+
+// Fill bodies with bodies first to first + bodies.size() - 1 of a scene of count bodies. Every
+// body is drawn from a counter-based generator keyed by the seed and its index, so a slice comes
+// out the same no matter how many threads or processes generate the scene.
+void init_bodies(PBodies &bodies, const ic_options &options, int count, int first);
+
+// The whole scene
+void init_bodies(PBodies &bodies, const ic_options &options);
+
+// The default scene: blocks of bodies orbiting a heavy central mass
+void init_bodies(PBodies &bodies);
+
+#endif  // GRAVITY_INITIAL_CONDITIONS_H
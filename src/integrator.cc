@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+#include "block_timestep.h"
+#include "integrator.h"
+#include "profiler.h"
+
+// Solvers accumulate into acc, so anything left in it has to be cleared first
+static void compute_force(PBodies &bodies, gravity_solver &solver, metrics *live, bool clear)
+{
+    PROFILE_SCOPE("force");
+    auto timer = metric_timer{live, metric_phase::force};
+    if (clear)
+        std::fill(bodies.acc.data.begin(), bodies.acc.data.end(), 0.0f);
+    solver.compute(bodies);
+}
+
+// The original scheme: x += v dt + a dt^2 / 2, v += a dt. First order, so it needs small steps.
+class euler_integrator : public integrator
+{
+public:
+    void step(PBodies &bodies, gravity_solver &solver, float dt, metrics *live) override
+    {
+        compute_force(bodies, solver, live, false);
+        auto timer = metric_timer{live, metric_phase::integrate};
+        bodies.integrate(dt);
+    }
+
+    const char *name() override
+    {
+        return "euler";
+    }
+};
+
+// Kick-drift-kick compositions. acc is kept between steps, since the closing kick of one step
+// uses the same acceleration as the opening kick of the next.
+class symplectic_integrator : public integrator
+{
+public:
+    symplectic_integrator(const char *scheme, std::vector<float> weights)
+        : scheme{scheme}, weights{std::move(weights)}, primed{false}
+    {
+    }
+
+    void step(PBodies &bodies, gravity_solver &solver, float dt, metrics *live) override
+    {
+        if (!primed) {
+            compute_force(bodies, solver, live, true);
+            primed = true;
+        }
+
+        symplectic_step(bodies, weights, dt, live,
+                        [&] { compute_force(bodies, solver, live, true); });
+    }
+
+    void reset() override
+    {
+        primed = false;
+    }
+
+    const char *name() override
+    {
+        return scheme;
+    }
+
+private:
+    const char *scheme;
+    std::vector<float> weights;
+    bool primed;  // acc holds the acceleration at the current positions
+};
+
+// Sums forces and jerks directly, so make_integrator only pairs it with the direct solver
+class hermite_integrator : public integrator
+{
+public:
+    hermite_integrator(float eta, int levels) : eta{eta}, levels{levels}, bound{nullptr} {}
+
+    void step(PBodies &bodies, gravity_solver &, float dt, metrics *live) override
+    {
+        if (bound != &bodies) {
+            block = std::make_unique<block_integrator>(bodies, eta, levels);
+            bound = &bodies;
+        }
+        auto timer = metric_timer{live, metric_phase::force};
+        block->step(dt);
+    }
+
+    void reset() override
+    {
+        if (block)
+            block->reset();
+    }
+
+    void print_stats() override
+    {
+        if (block)
+            block->print_stats();
+    }
+
+    const char *name() override
+    {
+        return "hermite";
+    }
+
+private:
+    float eta;
+    int levels;
+    std::unique_ptr<block_integrator> block;
+    PBodies *bound;
+};
+
+std::vector<float> symplectic_weights(const std::string &name)
+{
+    if (name == "leapfrog")
+        return {1.0f};
+    if (name == "yoshida4") {
+        // Three leapfrog substeps whose second order errors cancel (Yoshida 1990)
+        auto cbrt2 = std::cbrt(2.0);
+        auto w1 = 1.0 / (2.0 - cbrt2), w0 = -cbrt2 * w1;
+        return {static_cast<float>(w1), static_cast<float>(w0), static_cast<float>(w1)};
+    }
+    return {};
+}
+
+std::unique_ptr<integrator> make_integrator(const integrator_options &options,
+                                            const std::string &solver)
+{
+    if (options.name == "euler")
+        return std::make_unique<euler_integrator>();
+    if (options.name == "leapfrog")
+        return std::make_unique<symplectic_integrator>("leapfrog", symplectic_weights("leapfrog"));
+    if (options.name == "yoshida4")
+        return std::make_unique<symplectic_integrator>("yoshida4", symplectic_weights("yoshida4"));
+    if (options.name == "hermite") {
+        if (solver != "direct")
+            throw std::runtime_error{"the hermite integrator sums forces itself and needs the "
+                                     "direct solver, not " + solver};
+        return std::make_unique<hermite_integrator>(options.eta, options.levels);
+    }
+    throw std::runtime_error{"unknown integrator: " + options.name};
+}
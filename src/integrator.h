@@ -0,0 +1,65 @@
+#ifndef GRAVITY_INTEGRATOR_H
+#define GRAVITY_INTEGRATOR_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+#include "pobject.h"
+#include "solver.h"
+
+// Advances the bodies by one step of dt, asking the solver for accelerations as often as the
+// scheme needs them. Force and integration time go to live, if there are metrics.
+class integrator
+{
+public:
+    virtual ~integrator() = default;
+    virtual void step(PBodies &bodies, gravity_solver &solver, float dt, metrics *live) = 0;
+    // The positions or velocities were changed from outside since the last step
+    virtual void reset() {}
+    virtual void print_stats() {}
+    virtual const char *name() = 0;
+};
+
+struct integrator_options {
+    std::string name;  // euler, leapfrog, yoshida4, hermite
+    float eta;         // Hermite timestep accuracy parameter
+    int levels;        // Most times a Hermite block step may be halved, 0 for shared steps
+};
+
+// solver names the force solver the integrator will be stepped with, since not every scheme
+// can use every solver
+std::unique_ptr<integrator> make_integrator(const integrator_options &options,
+                                            const std::string &solver);
+
+// Drift lengths of the symplectic schemes as fractions of dt. A step is one kick-drift-kick
+// leapfrog substep per weight, with the kicks between substeps merged, so it costs one force
+// evaluation per weight. Empty for the schemes that are not built this way.
+std::vector<float> symplectic_weights(const std::string &name);
+
+// One step of a symplectic scheme on bodies of any precision. acc has to hold the acceleration
+// at the current positions, and does again afterwards; force clears acc and accumulates the
+// acceleration at the new positions into it.
+template<typename Bodies, typename Force>
+void symplectic_step(Bodies &bodies, const std::vector<float> &weights, float dt, metrics *live,
+                     Force force)
+{
+    auto count = weights.size();
+    {
+        auto timer = metric_timer{live, metric_phase::integrate};
+        bodies.kick(0.5f * weights[0] * dt);
+    }
+    for (size_t k = 0; k < count; k++) {
+        {
+            auto timer = metric_timer{live, metric_phase::integrate};
+            bodies.drift(weights[k] * dt);
+        }
+        force();
+        auto next = k + 1 < count ? weights[k + 1] : 0.0f;
+        auto timer = metric_timer{live, metric_phase::integrate};
+        bodies.kick(0.5f * (weights[k] + next) * dt);
+    }
+}
+
+#endif  // GRAVITY_INTEGRATOR_H
@@ -3,30 +3,48 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
-#include <mutex>
+#include <memory>
 #include <random>
 #include <thread>
 #include <vector>
 
 #include "args.h"
+#include "block_timestep.h"
 #include "display.h"
+#include "initial_conditions.h"
+#include "integrator.h"
+#include "metrics.h"
 #include "physics_gl.h"
 #include "pobject.h"
+#include "profiler.h"
 #include "shader.h"
+#include "solver.h"
+#include "trajectory.h"
+#include "triple_buffer.h"
 
-static std::mutex mu;
+using position_frames = triple_buffer<std::vector<glm::vec3>>;
 
-static void do_physics(PBodies *b, float dt, bool *updated, bool *running)
+// Publishes the positions after every step for the render thread, which uploads the latest
+// complete frame. Neither thread ever waits for the other.
+static void do_physics(PBodies *b, gravity_solver *solver, integrator *scheme, float dt,
+                       trajectory_writer *recorder, int record_every, metrics *live,
+                       position_frames *frames, std::atomic<bool> *running)
 {
-    while (true) {
-        b->applyGravity(dt);
-        std::lock_guard<std::mutex> guard(mu);
-        *updated = true;  // Instance data needs updating... (in main thread)
-        if (!*running) {
+    PROFILE_THREAD_NAME("physics");
+    for (uint64_t step = 1;; step++) {
+        scheme->step(*b, *solver, dt, live);
+        if (live)
+            live->add_steps(1);
+        if (recorder && step % record_every == 0)
+            recorder->push(*b, step);
+        b->pack_positions(frames->write_buffer().data());
+        frames->publish();
+        if (!running->load(std::memory_order_relaxed))
             break;
-        }
     }
     std::cout << "physics thread finished" << std::endl;
 }
@@ -36,6 +54,16 @@ struct program_args {
     float dt;
     float camera_step;
     int point_size;
+    solver_options solver;
+    integrator_options integrator;
+    ic_options ic;
+    std::string record_path;
+    int record_every;
+    float quantum;
+    int keyframe_interval;
+    std::string trace_path;
+    std::string metrics_path;
+    float metrics_every;
 };
 
 static program_args parse_args(int argc, char *argv[])
@@ -46,6 +74,25 @@ static program_args parse_args(int argc, char *argv[])
     parser.add_arg({"-rot", "camera rotation speed", 1});
     parser.add_arg({"-h", "help", 0});
     parser.add_arg({"-ps", "particle point size", 1});
+    parser.add_arg({"-solver", "force solver: direct, simd, tiled, symmetric, bh, fmm", 1});
+    parser.add_arg({"-integrator", "time integrator: euler, leapfrog, yoshida4, hermite", 1});
+    parser.add_arg({"-eta", "hermite timestep accuracy parameter", 1});
+    parser.add_arg({"-levels", "most times a hermite block step may be halved, 0 for shared", 1});
+    parser.add_arg({"-theta", "Barnes-Hut opening angle / FMM separation criterion", 1});
+    parser.add_arg({"-leaf", "maximum bodies per octree leaf", 1});
+    parser.add_arg({"-order", "FMM expansion order", 1});
+    parser.add_arg({"-tile", "source bodies per cache tile (default from L2 size)", 1});
+    parser.add_arg({"-ic", "initial conditions: blocks, plummer, disk, collision", 1});
+    parser.add_arg({"-seed", "random seed for the initial conditions", 1});
+    parser.add_arg({"-record", "record a compressed trajectory of the positions here", 1});
+    parser.add_arg({"-record-every", "record a frame every this many steps", 1});
+    parser.add_arg({"-quantum", "trajectory position precision", 1});
+    parser.add_arg({"-keyframe", "trajectory frames between keyframes", 1});
+    parser.add_arg({"-metrics", "keep Prometheus metrics of the run up to date in this file", 1});
+    parser.add_arg({"-metrics-every", "seconds between rewrites of the -metrics file", 1});
+#ifdef GRAVITY_PROFILE
+    parser.add_arg({"-trace", "write a Chrome trace of the step phases here on exit", 1});
+#endif
 
     parser.parse(argc, argv);
 
@@ -60,6 +107,23 @@ static program_args parse_args(int argc, char *argv[])
     args.dt = parser.find("-dt").get(0.00005f);
     args.camera_step = parser.find("-rot").get(0.0f);
     args.point_size = parser.find("-ps").get(1);
+    args.solver.name = parser.find("-solver").get<std::string>("direct");
+    args.solver.theta = parser.find("-theta").get(0.5f);
+    args.solver.leaf_size = parser.find("-leaf").get(16);
+    args.solver.order = parser.find("-order").get(4);
+    args.solver.tile_size = parser.find("-tile").get(0);
+    args.integrator.name = parser.find("-integrator").get<std::string>("euler");
+    args.integrator.eta = parser.find("-eta").get(block_integrator::DEFAULT_ETA);
+    args.integrator.levels = parser.find("-levels").get(block_integrator::DEFAULT_LEVELS);
+    args.ic.name = parser.find("-ic").get<std::string>("blocks");
+    args.ic.seed = parser.find("-seed").get(1);
+    args.record_path = parser.find("-record").get<std::string>("");
+    args.record_every = std::max(1, parser.find("-record-every").get(10));
+    args.quantum = parser.find("-quantum").get(1e-4f);
+    args.keyframe_interval = parser.find("-keyframe").get(100);
+    args.trace_path = parser.find("-trace").get<std::string>("");
+    args.metrics_path = parser.find("-metrics").get<std::string>("");
+    args.metrics_every = parser.find("-metrics-every").get(10.0f);
 
     return args;
 }
@@ -67,11 +131,14 @@ static program_args parse_args(int argc, char *argv[])
 int main(int argc, char *argv[])
 {
     auto args = parse_args(argc, argv);
+    auto solver = make_solver(args.solver);
+    auto scheme = make_integrator(args.integrator, args.solver.name);
 
+    PROFILE_THREAD_NAME("render");
     auto disp = GLDisplay{1600, 900, "Gravity"};
     std::cout << "OpenGL version:" << glGetString(GL_VERSION) << "\n";
 
-    auto pgl = physics_gl{args.count, args.dt};
+    auto pgl = physics_gl{args.count, args.dt, args.ic};
     pgl.use_shader();
     pgl.bind();
 
@@ -84,9 +151,27 @@ int main(int argc, char *argv[])
     pgl.set_perspective(disp.aspect_ratio(), 0.1f, 100.0f);
 
     auto b = pgl.get_bodies();
-    auto updatedPosition = false;
-    auto running = true;
-    std::thread physics_thread{&do_physics, b, args.dt, &updatedPosition, &running};
+    auto recorder = std::unique_ptr<trajectory_writer>{};
+    if (!args.record_path.empty()) {
+        recorder = std::make_unique<trajectory_writer>(args.record_path, *b, args.quantum,
+                                                       args.keyframe_interval);
+        recorder->push(*b, 0);
+    }
+    auto live = std::unique_ptr<metrics>{};
+    if (!args.metrics_path.empty()) {
+        live = std::make_unique<metrics>(args.metrics_path, args.count, args.metrics_every);
+        if (recorder) {
+            live->add_gauge("gravity_trajectory_queue_depth",
+                            "Trajectory frames waiting to be written",
+                            [&recorder] { return recorder->queue_depth(); });
+        }
+    }
+
+    auto positions = position_frames{std::vector<glm::vec3>(args.count)};
+    std::atomic<bool> running{true};
+    std::thread physics_thread{&do_physics, b, solver.get(), scheme.get(), args.dt,
+                               recorder.get(), args.record_every, live.get(), &positions,
+                               &running};
     auto counter = 0.0f;
     auto frames = 1;
 
@@ -105,20 +190,19 @@ int main(int argc, char *argv[])
                         cameraTarget, up);
         pgl.set_view(view);
 
-        {
-            // We don't want the other thread messing with data when we're moving it to the GPU
-            std::lock_guard<std::mutex> guard(mu);
-            if (updatedPosition) {
-                pgl.update_positions();
-                updatedPosition = false;
-            }
+        // The physics thread never writes the frame being read, so no lock is needed
+        if (positions.update()) {
+            auto timer = metric_timer{live.get(), metric_phase::upload};
+            pgl.update_positions(positions.read_buffer().data());
         }
 
         // Draw the instanced particle data
-        glDrawArraysInstanced(GL_POINTS, 0, 3 * sizeof(glm::vec3), args.count);
+        pgl.draw();
 
         disp.update();
         frames++;
+        if (live)
+            live->add_frame();
         counter += args.camera_step;
 
         auto end = std::chrono::high_resolution_clock::now();
@@ -127,8 +211,16 @@ int main(int argc, char *argv[])
         std::this_thread::sleep_for(std::chrono::microseconds(16667 - elapsed_us));
     }
 
-    running = false;
+    running.store(false, std::memory_order_relaxed);
     physics_thread.join();
+    live.reset();
+    if (recorder) {
+        recorder->close();
+        recorder->print_stats();
+    }
+#ifdef GRAVITY_PROFILE
+    profiler::instance().finish(args.trace_path);
+#endif
 
     return 0;
 }
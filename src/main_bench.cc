@@ -0,0 +1,423 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "args.h"
+#include "initial_conditions.h"
+#include "pobject.h"
+#include "simd_gravity.h"
+#include "solver.h"
+
+#ifdef GRAVITY_HAVE_OPENCL
+#include "physics_cl.h"
+#endif
+
+// Conventional cost of one softened interaction: 3 subtractions, 3 multiply-adds for the squared
+// distance plus the softening, a reciprocal square root counted as 4, 3 multiplications for its
+// cube and the mass, and 3 multiply-adds into the sum
+static constexpr double FLOPS_PER_INTERACTION = 20.0;
+
+// x, y, z and mass of one source body
+static constexpr double BODY_BYTES = 4 * sizeof(float);
+
+struct program_args {
+    std::vector<int> counts;
+    std::vector<int> threads;
+    std::vector<std::string> solvers;
+    std::vector<std::string> kernels;
+    int steps;
+    int warmup;
+    float dt;
+    ic_options ic;
+    int tile_size;
+    bool use_opencl;
+    std::string preferred_platform;
+    std::string preferred_device;
+    int work_group_size;
+    std::string json_path;
+    std::string csv_path;
+};
+
+static std::vector<std::string> split_list(const std::string &list)
+{
+    auto items = std::vector<std::string>{};
+    auto stream = std::istringstream{list};
+    auto item = std::string{};
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+static std::vector<int> split_ints(const std::string &list)
+{
+    auto values = std::vector<int>{};
+    for (auto &item : split_list(list))
+        values.push_back(std::stoi(item));
+    return values;
+}
+
+static int max_threads()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Powers of two up to every hardware thread, and all of them
+static std::string default_threads()
+{
+    auto list = std::string{};
+    auto max = max_threads();
+    for (auto t = 1; t < max; t *= 2)
+        list += std::to_string(t) + ",";
+    return list + std::to_string(max);
+}
+
+static program_args parse_args(int argc, char *argv[])
+{
+    arg_parser parser{"gravity_bench"};
+    parser.add_arg({"-n", "comma separated numbers of bodies", 1});
+    parser.add_arg({"-threads", "comma separated OpenMP thread counts", 1});
+    parser.add_arg({"-solvers", "comma separated CPU solvers: direct, simd, tiled, symmetric", 1});
+    parser.add_arg({"-steps", "timed steps per configuration", 1});
+    parser.add_arg({"-warmup", "untimed steps before the timed ones", 1});
+    parser.add_arg({"-dt", "time step", 1});
+    parser.add_arg({"-ic", "initial conditions: blocks, plummer, disk, collision", 1});
+    parser.add_arg({"-seed", "random seed for the initial conditions", 1});
+    parser.add_arg({"-tile", "source bodies per cache tile (default from L2 size)", 1});
+#ifdef GRAVITY_HAVE_OPENCL
+    parser.add_arg({"-kernels", "comma separated OpenCL kernels: basic, tiled, float4, fused",
+                    1});
+    parser.add_arg({"-nocl", "only benchmark the CPU solvers", 0});
+    parser.add_arg({"-p", "preferred OpenCL platform", 1});
+    parser.add_arg({"-d", "preferred OpenCL device", 1});
+    parser.add_arg({"-wg", "work-group size for the tiled kernels", 1});
+#endif
+    parser.add_arg({"-json", "write the results as JSON here", 1});
+    parser.add_arg({"-csv", "write the results as CSV here", 1});
+    parser.add_arg({"-h", "help", 0});
+
+    parser.parse(argc, argv);
+
+    bool help = parser.find("-h").get(false);
+    if (help) {
+        parser.show_help();
+        exit(0);
+    }
+
+    program_args args;
+    args.counts = split_ints(parser.find("-n").get<std::string>("1024,4096"));
+    args.threads = split_ints(parser.find("-threads").get(default_threads()));
+    args.solvers =
+        split_list(parser.find("-solvers").get<std::string>("direct,simd,tiled,symmetric"));
+    args.kernels = split_list(parser.find("-kernels").get<std::string>("basic,tiled,float4,fused"));
+    args.steps = parser.find("-steps").get(20);
+    args.warmup = parser.find("-warmup").get(3);
+    args.dt = parser.find("-dt").get(0.00005f);
+    args.ic.name = parser.find("-ic").get<std::string>("blocks");
+    args.ic.seed = parser.find("-seed").get(1);
+    args.tile_size = parser.find("-tile").get(0);
+#ifdef GRAVITY_HAVE_OPENCL
+    args.use_opencl = !parser.find("-nocl").get(false);
+#else
+    args.use_opencl = false;
+#endif
+    args.preferred_platform = parser.find("-p").get<std::string>("");
+    args.preferred_device = parser.find("-d").get<std::string>("");
+    args.work_group_size = parser.find("-wg").get(0);
+    args.json_path = parser.find("-json").get<std::string>("");
+    args.csv_path = parser.find("-csv").get<std::string>("");
+
+    if (args.steps < 1)
+        throw std::runtime_error{"-steps must be at least 1"};
+    return args;
+}
+
+struct bench_result {
+    std::string backend;  // cpu or opencl
+    std::string kernel;
+    std::string platform, device;  // Empty for the host
+    int count;
+    int threads;  // 0 on OpenCL devices
+    double flops_per_interaction;
+    double bytes_per_interaction;
+    std::vector<double> latencies;  // Seconds per timed step, sorted
+
+    double seconds() const
+    {
+        auto total = 0.0;
+        for (auto t : latencies)
+            total += t;
+        return total;
+    }
+
+    double interactions_per_second() const
+    {
+        return static_cast<double>(count) * count * latencies.size() / seconds();
+    }
+
+    double gflops() const
+    {
+        return interactions_per_second() * flops_per_interaction * 1e-9;
+    }
+
+    // Nearest rank, in milliseconds
+    double percentile(double p) const
+    {
+        auto rank = static_cast<size_t>(std::ceil(p / 100.0 * latencies.size()));
+        return latencies[std::max<size_t>(rank, 1) - 1] * 1e3;
+    }
+};
+
+// Runs warmup untimed steps, then times each of steps steps on its own
+template<typename Step>
+static std::vector<double> time_steps(int warmup, int steps, Step step)
+{
+    for (auto i = 0; i < warmup; i++)
+        step();
+
+    auto latencies = std::vector<double>{};
+    latencies.reserve(steps);
+    for (auto i = 0; i < steps; i++) {
+        auto start = std::chrono::steady_clock::now();
+        step();
+        auto end = std::chrono::steady_clock::now();
+        latencies.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+// Flops executed per interaction. The symmetric sum evaluates each pair once for two
+// interactions, adding a multiplication by the other mass and 3 multiply-adds into the source.
+static double cpu_flops_per_interaction(const std::string &solver)
+{
+    if (solver == "symmetric")
+        return (FLOPS_PER_INTERACTION + 7) / 2;
+    return FLOPS_PER_INTERACTION;
+}
+
+// Source bytes loaded per interaction, before any caching: a block of targets held in registers
+// or a tile of sources in local memory shares each load. The symmetric sum also updates the
+// accumulator of the source, once for two interactions.
+static double cpu_bytes_per_interaction(const std::string &solver)
+{
+    if (solver == "simd" || solver == "tiled")
+        return BODY_BYTES / simd_gravity_block_width();
+    if (solver == "symmetric")
+        return (BODY_BYTES + 6 * sizeof(float)) / 2;
+    return BODY_BYTES;
+}
+
+static void print_header()
+{
+    std::cout << std::left << std::setw(8) << "backend" << std::setw(11) << "kernel"
+              << std::right << std::setw(8) << "n" << std::setw(8) << "threads" << std::setw(14)
+              << "inter/s" << std::setw(10) << "GFLOP/s" << std::setw(8) << "B/int"
+              << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms" << std::setw(10)
+              << "p99 ms" << "\n";
+}
+
+static void print_result(const bench_result &r)
+{
+    std::cout << std::left << std::setw(8) << r.backend << std::setw(11) << r.kernel
+              << std::right << std::setw(8) << r.count << std::setw(8) << r.threads
+              << std::setw(14) << std::setprecision(4) << r.interactions_per_second()
+              << std::setw(10) << r.gflops() << std::setw(8) << r.bytes_per_interaction
+              << std::setw(10) << r.percentile(50) << std::setw(10) << r.percentile(90)
+              << std::setw(10) << r.percentile(99) << std::endl;
+}
+
+static void run_cpu(const program_args &args, std::vector<bench_result> &results)
+{
+    auto options = solver_options{"", 0.5f, 16, 4, args.tile_size};
+    for (auto count : args.counts) {
+        for (auto &name : args.solvers) {
+            if (name == "bh" || name == "fmm")
+                throw std::runtime_error{"only direct sum solvers can be benchmarked: " + name};
+            for (auto threads : args.threads) {
+#ifdef _OPENMP
+                omp_set_num_threads(threads);
+#else
+                if (threads != 1)
+                    continue;
+#endif
+                // Every configuration starts from the same bodies
+                auto bodies = PBodies{count};
+                init_bodies(bodies, args.ic);
+                options.name = name;
+                auto solver = make_solver(options);
+
+                auto r = bench_result{"cpu", name, "", "", count, threads,
+                                      cpu_flops_per_interaction(name),
+                                      cpu_bytes_per_interaction(name), {}};
+                r.latencies = time_steps(args.warmup, args.steps, [&]() {
+                    solver->compute(bodies);
+                    bodies.integrate(args.dt);
+                });
+                print_result(r);
+                results.push_back(std::move(r));
+            }
+        }
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads());
+#endif
+}
+
+#ifdef GRAVITY_HAVE_OPENCL
+static void run_opencl(const program_args &args, std::vector<bench_result> &results)
+{
+    for (auto count : args.counts) {
+        for (auto &kernel : args.kernels) {
+            // A fresh context for every kernel, so each starts from the same bodies
+            auto bodies = PBodies{count};
+            init_bodies(bodies, args.ic);
+            auto pcl = physics_cl{bodies, args.dt, args.preferred_platform, args.preferred_device};
+            pcl.use_kernel(kernel, args.work_group_size);
+
+            auto tile = pcl.tile_size();
+            auto bytes = tile ? BODY_BYTES / tile : BODY_BYTES;
+            auto r = bench_result{"opencl", kernel, pcl.platform_name(), pcl.device_name(),
+                                  count, 0, FLOPS_PER_INTERACTION, bytes, {}};
+            r.latencies = time_steps(args.warmup, args.steps, [&]() {
+                pcl.step();
+                pcl.sync();
+            });
+            pcl.finish();
+            print_result(r);
+            results.push_back(std::move(r));
+        }
+    }
+}
+#endif
+
+// Results are only comparable between runs on the same machine
+static std::string host_name()
+{
+    char name[256] = {};
+    if (gethostname(name, sizeof(name) - 1) < 0)
+        return "";
+    return name;
+}
+
+// Device and host names are free text
+static std::string json_string(const std::string &text)
+{
+    auto out = std::string{"\""};
+    for (auto c : text) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static std::string csv_string(const std::string &text)
+{
+    auto out = std::string{"\""};
+    for (auto c : text) {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static void write_json(const program_args &args, const std::vector<bench_result> &results)
+{
+    auto out = std::ofstream{args.json_path};
+    out << std::setprecision(9);
+    out << "{\n  \"host\": " << json_string(host_name()) << ",\n  \"ic\": \"" << args.ic.name
+        << "\",\n  \"seed\": " << args.ic.seed << ",\n  \"steps\": " << args.steps
+        << ",\n  \"warmup\": " << args.warmup
+        << ",\n  \"dt\": " << args.dt << ",\n  \"simd_isa\": \"" << simd_gravity_isa()
+        << "\",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        auto &r = results[i];
+        out << (i ? "," : "") << "\n    {\"backend\": \"" << r.backend << "\", \"kernel\": \""
+            << r.kernel << "\", \"platform\": " << json_string(r.platform)
+            << ", \"device\": " << json_string(r.device) << ", \"n\": " << r.count
+            << ", \"threads\": " << r.threads << ", \"seconds\": " << r.seconds()
+            << ", \"interactions_per_s\": " << r.interactions_per_second()
+            << ", \"flops_per_interaction\": " << r.flops_per_interaction
+            << ", \"gflops\": " << r.gflops()
+            << ", \"bytes_per_interaction\": " << r.bytes_per_interaction
+            << ", \"latency_ms\": {\"min\": " << r.latencies.front() * 1e3
+            << ", \"p50\": " << r.percentile(50) << ", \"p90\": " << r.percentile(90)
+            << ", \"p99\": " << r.percentile(99) << ", \"max\": " << r.latencies.back() * 1e3
+            << "}}";
+    }
+    out << "\n  ]\n}\n";
+    if (!out)
+        throw std::runtime_error{"failed to write " + args.json_path};
+}
+
+static void write_csv(const program_args &args, const std::vector<bench_result> &results)
+{
+    auto out = std::ofstream{args.csv_path};
+    out << std::setprecision(9);
+    auto host = csv_string(host_name());
+    out << "host,backend,kernel,platform,device,n,threads,ic,seed,steps,warmup,seconds,"
+           "interactions_per_s,flops_per_interaction,gflops,bytes_per_interaction,min_ms,p50_ms,p90_ms,p99_ms,max_ms\n";
+    for (auto &r : results) {
+        out << host << "," << r.backend << "," << r.kernel << "," << csv_string(r.platform) << ","
+            << csv_string(r.device) << "," << r.count << "," << r.threads << ","
+            << args.ic.name << "," << args.ic.seed << "," << args.steps << "," << args.warmup
+            << "," << r.seconds() << "," << r.interactions_per_second() << ","
+            << r.flops_per_interaction << "," << r.gflops()
+            << "," << r.bytes_per_interaction << "," << r.latencies.front() * 1e3 << ","
+            << r.percentile(50) << "," << r.percentile(90) << "," << r.percentile(99) << ","
+            << r.latencies.back() * 1e3 << "\n";
+    }
+    if (!out)
+        throw std::runtime_error{"failed to write " + args.csv_path};
+}
+
+int main(int argc, char *argv[])
+{
+    try {
+        auto args = parse_args(argc, argv);
+        std::cout << "ic=" << args.ic.name << " seed=" << args.ic.seed << " steps=" << args.steps
+                  << " warmup=" << args.warmup << " simd=" << simd_gravity_isa() << "\n";
+        print_header();
+
+        auto results = std::vector<bench_result>{};
+        run_cpu(args, results);
+#ifdef GRAVITY_HAVE_OPENCL
+        // A machine without an OpenCL device still gets its CPU results written
+        if (args.use_opencl) {
+            try {
+                run_opencl(args, results);
+            } catch (std::exception &e) {
+                std::cerr << "OpenCL benchmarks stopped: " << e.what() << "\n";
+            }
+        }
+#endif
+
+        if (!args.json_path.empty())
+            write_json(args, results);
+        if (!args.csv_path.empty())
+            write_csv(args, results);
+    } catch (std::exception &e) {
+        std::cerr << "exception: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
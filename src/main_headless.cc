@@ -0,0 +1,509 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "args.h"
+#include "block_timestep.h"
+#include "initial_conditions.h"
+#include "integrator.h"
+#include "metrics.h"
+#include "pobject.h"
+#include "profiler.h"
+#include "simd_gravity.h"
+#include "snapshot.h"
+#include "solver.h"
+#include "trajectory.h"
+
+#ifdef GRAVITY_HAVE_OPENCL
+#include "multi_executor.h"
+#include "physics_cl.h"
+#endif
+
+struct program_args {
+    int count;
+    float dt;
+    int steps;
+    solver_options solver;
+    integrator_options integrator;
+    std::string precision;
+    ic_options ic;
+    bool use_opencl;
+    bool use_multi;
+    bool use_host;
+    bool copy_buffers;
+    std::string preferred_platform;
+    std::string preferred_device;
+    std::string kernel;
+    int work_group_size;
+    std::string load_path;
+    std::string save_path;
+    int save_every;
+    std::string record_path;
+    int record_every;
+    float quantum;
+    int keyframe_interval;
+    std::string trace_path;
+    std::string metrics_path;
+    float metrics_every;
+};
+
+static program_args parse_args(int argc, char *argv[])
+{
+    arg_parser parser{"gravity_headless"};
+    parser.add_arg({"-n", "number of objects", 1});
+    parser.add_arg({"-dt", "time step", 1});
+    parser.add_arg({"-steps", "number of steps to simulate", 1});
+    parser.add_arg({"-solver", "force solver: direct, simd, tiled, symmetric, bh, fmm", 1});
+    parser.add_arg({"-theta", "Barnes-Hut opening angle / FMM separation criterion", 1});
+    parser.add_arg({"-leaf", "maximum bodies per octree leaf", 1});
+    parser.add_arg({"-order", "FMM expansion order", 1});
+    parser.add_arg({"-tile", "source bodies per cache tile (default from L2 size)", 1});
+    parser.add_arg({"-integrator", "time integrator: euler, leapfrog, yoshida4, hermite", 1});
+    parser.add_arg({"-eta", "hermite timestep accuracy parameter", 1});
+    parser.add_arg({"-levels", "most times a hermite block step may be halved, 0 for shared", 1});
+    parser.add_arg({"-precision", "float, double, or mixed: float pair terms summed in double", 1});
+#ifdef GRAVITY_HAVE_OPENCL
+    parser.add_arg({"-cl", "simulate with OpenCL instead of OpenMP", 0});
+    parser.add_arg({"-p", "preferred OpenCL platform", 1});
+    parser.add_arg({"-d", "preferred OpenCL device", 1});
+    parser.add_arg({"-kernel", "OpenCL gravity kernel: basic, tiled, float4, fused", 1});
+    parser.add_arg({"-wg", "work-group size for the tiled kernels", 1});
+    parser.add_arg({"-multi", "split each step across all OpenCL devices and the host", 0});
+    parser.add_arg({"-nohost", "leave the host out of -multi", 0});
+    parser.add_arg({"-copy", "copy the bodies to the device even if it shares host memory", 0});
+#endif
+    parser.add_arg({"-ic", "initial conditions: blocks, plummer, disk, collision", 1});
+    parser.add_arg({"-seed", "random seed for the initial conditions", 1});
+    parser.add_arg({"-load", "restore the bodies from a snapshot instead of generating them", 1});
+    parser.add_arg({"-save", "write a snapshot here at the end, or when stopped by a signal", 1});
+    parser.add_arg({"-every", "also write the -save snapshot every this many steps", 1});
+    parser.add_arg({"-record", "record a compressed trajectory of the positions here", 1});
+    parser.add_arg({"-record-every", "record a frame every this many steps", 1});
+    parser.add_arg({"-quantum", "trajectory position precision", 1});
+    parser.add_arg({"-keyframe", "trajectory frames between keyframes", 1});
+    parser.add_arg({"-metrics", "keep Prometheus metrics of the run up to date in this file", 1});
+    parser.add_arg({"-metrics-every", "seconds between rewrites of the -metrics file", 1});
+#ifdef GRAVITY_PROFILE
+    parser.add_arg({"-trace", "write a Chrome trace of the step phases here at the end", 1});
+#endif
+    parser.add_arg({"-h", "help", 0});
+
+    parser.parse(argc, argv);
+
+    bool help = parser.find("-h").get(false);
+    if (help) {
+        parser.show_help();
+        exit(0);
+    }
+
+    program_args args;
+    args.count = parser.find("-n").get(1 << 12);
+    args.dt = parser.find("-dt").get(0.00005f);
+    args.steps = parser.find("-steps").get(100);
+    args.solver.name = parser.find("-solver").get<std::string>("direct");
+    args.solver.theta = parser.find("-theta").get(0.5f);
+    args.solver.leaf_size = parser.find("-leaf").get(16);
+    args.solver.order = parser.find("-order").get(4);
+    args.solver.tile_size = parser.find("-tile").get(0);
+    args.integrator.name = parser.find("-integrator").get<std::string>("euler");
+    args.integrator.eta = parser.find("-eta").get(block_integrator::DEFAULT_ETA);
+    args.integrator.levels = parser.find("-levels").get(block_integrator::DEFAULT_LEVELS);
+    args.precision = parser.find("-precision").get<std::string>("float");
+    args.use_opencl = parser.find("-cl").get(false);
+    args.use_multi = parser.find("-multi").get(false);
+    args.use_host = !parser.find("-nohost").get(false);
+    args.copy_buffers = parser.find("-copy").get(false);
+    args.preferred_platform = parser.find("-p").get<std::string>("");
+    args.preferred_device = parser.find("-d").get<std::string>("");
+    args.kernel = parser.find("-kernel").get<std::string>("basic");
+    args.work_group_size = parser.find("-wg").get(0);
+    args.ic.name = parser.find("-ic").get<std::string>("blocks");
+    args.ic.seed = parser.find("-seed").get(1);
+    args.load_path = parser.find("-load").get<std::string>("");
+    args.save_path = parser.find("-save").get<std::string>("");
+    args.save_every = parser.find("-every").get(0);
+    args.record_path = parser.find("-record").get<std::string>("");
+    args.record_every = parser.find("-record-every").get(10);
+    args.quantum = parser.find("-quantum").get(1e-4f);
+    args.keyframe_interval = parser.find("-keyframe").get(100);
+    args.trace_path = parser.find("-trace").get<std::string>("");
+    args.metrics_path = parser.find("-metrics").get<std::string>("");
+    args.metrics_every = parser.find("-metrics-every").get(10.0f);
+
+    return args;
+}
+
+// The interaction rate is n^2 per step, what a direct sum would evaluate. Tree solvers, multiple
+// force evaluations per step and block timesteps change the real count, so it is only a
+// comparable rate.
+static void print_throughput(int count, int steps, double seconds)
+{
+    auto interactions = static_cast<double>(count) * count * steps;
+    std::cout << steps << " steps in " << seconds << " s\n"
+              << "steps/s: " << steps / seconds << "\n"
+              << "n^2-equivalent interactions/s: " << interactions / seconds << "\n";
+}
+
+static volatile std::sig_atomic_t stop_requested = 0;
+
+static void request_stop(int)
+{
+    stop_requested = 1;
+}
+
+// Counts the steps of this run, writes the periodic snapshots and records the trajectory, and
+// keeps the live metrics up to date. The step number and time in a snapshot continue from the
+// snapshot the run was restored from.
+class run_progress
+{
+public:
+    run_progress(const program_args &args, PBodies &bodies, uint64_t first_step,
+                 double first_time)
+        : args{args}, first_step{first_step}, first_time{first_time}, steps_done{0}
+    {
+        if (!args.record_path.empty()) {
+            recorder = std::make_unique<trajectory_writer>(args.record_path, bodies, args.quantum,
+                                                           args.keyframe_interval);
+            recorder->push(bodies, first_step);
+        }
+        if (!args.metrics_path.empty()) {
+            live = std::make_unique<metrics>(args.metrics_path, args.count, args.metrics_every);
+            live->add_gauge("gravity_snapshot_queue_depth", "Snapshots being written",
+                            [this] { return writer.queue_depth(); });
+            if (recorder) {
+                live->add_gauge("gravity_trajectory_queue_depth",
+                                "Trajectory frames waiting to be written",
+                                [this] { return recorder->queue_depth(); });
+                live->add_gauge("gravity_trajectory_frames_dropped",
+                                "Trajectory frames dropped because the writer fell behind",
+                                [this] { return recorder->frames_dropped(); });
+            }
+        }
+    }
+
+    bool running() const
+    {
+        return steps_done < args.steps && !stop_requested;
+    }
+
+    // Live metrics need the step rate to stay current, and a run that saves on a signal has to
+    // notice the signal soon, so both wait for every short batch of queued steps
+    bool short_batches() const
+    {
+        return live || !args.save_path.empty();
+    }
+
+    // Steps to queue before the next snapshot or trajectory frame is due, or before the next
+    // look at the metrics and signals
+    int next_batch() const
+    {
+        auto batch = args.steps - steps_done;
+        if (short_batches())
+            batch = std::min(batch, SHORT_BATCH);
+        if (save_every() > 0)
+            batch = std::min(batch, save_every() - steps_done % save_every());
+        if (record_every() > 0)
+            batch = std::min(batch, record_every() - steps_done % record_every());
+        return batch;
+    }
+
+    // Returns true if a snapshot or trajectory frame is due, and the bodies should be brought up
+    // to date
+    bool advance(int steps)
+    {
+        steps_done += steps;
+        if (live)
+            live->add_steps(steps);
+        return snapshot_due() || record_due();
+    }
+
+    // Only snapshots need the velocities
+    bool snapshot_due() const
+    {
+        return save_every() > 0 && running() && steps_done % save_every() == 0;
+    }
+
+    bool record_due() const
+    {
+        return record_every() > 0 && steps_done % record_every() == 0;
+    }
+
+    // Writes whatever advance found due
+    void checkpoint(PBodies &bodies)
+    {
+        PROFILE_SCOPE("checkpoint");
+        auto timer = metric_timer{live.get(), metric_phase::checkpoint};
+        if (record_due())
+            recorder->push(bodies, first_step + steps_done);
+        if (snapshot_due())
+            save(bodies);
+    }
+
+    void save(PBodies &bodies)
+    {
+        writer.write(bodies, args.save_path, first_step + steps_done,
+                     first_time + steps_done * static_cast<double>(args.dt));
+    }
+
+    // Waits for the last snapshot to reach the disk and the trajectory to be written
+    void finish()
+    {
+        writer.wait();
+        if (recorder) {
+            recorder->close();
+            recorder->print_stats();
+        }
+    }
+
+    int steps() const
+    {
+        return steps_done;
+    }
+
+    // Null without -metrics
+    metrics *live_metrics()
+    {
+        return live.get();
+    }
+
+private:
+    const program_args &args;
+    uint64_t first_step;
+    double first_time;
+    int steps_done;
+    snapshot_writer writer;
+    std::unique_ptr<trajectory_writer> recorder;
+    // Last, so it stops reading the writers before they go away
+    std::unique_ptr<metrics> live;
+
+    static constexpr int SHORT_BATCH = 16;
+
+    int save_every() const
+    {
+        return args.save_path.empty() ? 0 : args.save_every;
+    }
+
+    int record_every() const
+    {
+        return recorder ? args.record_every : 0;
+    }
+};
+
+// The direct sum and the symplectic integrators on a double copy of the bodies, which are
+// rounded back into the float ones for trajectory frames and at the end. Mixed bodies can also
+// use the SIMD kernels.
+template<typename Bodies>
+static double run_precise(PBodies &bodies, const program_args &args, run_progress &progress)
+{
+    constexpr auto mixed = std::is_same_v<Bodies, mixed_bodies>;
+    auto simd = mixed && args.solver.name == "simd";
+    if (args.solver.name != "direct" && !simd)
+        throw std::runtime_error{"-precision " + args.precision + " needs the direct" +
+                                 (mixed ? " or simd" : "") + " solver"};
+    // Snapshots hold floats, so a restarted run would not continue the same double state
+    if (!args.save_path.empty())
+        throw std::runtime_error{"-save needs -precision float"};
+    auto weights = symplectic_weights(args.integrator.name);
+    if (weights.empty() && args.integrator.name != "euler")
+        throw std::runtime_error{"-precision " + args.precision +
+                                 " supports the euler, leapfrog and yoshida4 integrators"};
+    std::cout << "solver: " << (simd ? simd_gravity_isa() : "direct")
+              << ", integrator: " << args.integrator.name
+              << ", precision: " << args.precision << "\n";
+
+    auto precise = Bodies{bodies.size()};
+    precise.assign(bodies);
+    auto live = progress.live_metrics();
+    auto force = [&]() {
+        PROFILE_SCOPE("force");
+        auto timer = metric_timer{live, metric_phase::force};
+        std::fill(precise.acc.data.begin(), precise.acc.data.end(), 0.0);
+        if constexpr (mixed) {
+            if (simd) {
+                simd_gravity_mixed(precise);
+                return;
+            }
+        }
+        precise.computeGravity();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    if (!weights.empty())
+        force();
+    while (progress.running()) {
+        if (weights.empty()) {
+            force();
+            auto timer = metric_timer{live, metric_phase::integrate};
+            precise.integrate(args.dt);
+        } else {
+            symplectic_step(precise, weights, args.dt, live, force);
+        }
+        if (progress.advance(1)) {
+            bodies.assign(precise);
+            progress.checkpoint(bodies);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    bodies.assign(precise);
+    return std::chrono::duration<double>(end - start).count();
+}
+
+static double run_openmp(PBodies &bodies, const program_args &args, run_progress &progress)
+{
+    if (args.precision == "double")
+        return run_precise<double_bodies>(bodies, args, progress);
+    if (args.precision == "mixed")
+        return run_precise<mixed_bodies>(bodies, args, progress);
+    if (args.precision != "float")
+        throw std::runtime_error{"unknown precision: " + args.precision};
+
+    auto solver = make_solver(args.solver);
+    auto integrator = make_integrator(args.integrator, args.solver.name);
+    std::cout << "solver: " << solver->name() << ", integrator: " << integrator->name() << "\n";
+
+    auto live = progress.live_metrics();
+    auto start = std::chrono::steady_clock::now();
+    while (progress.running()) {
+        integrator->step(bodies, *solver, args.dt, live);
+        if (progress.advance(1))
+            progress.checkpoint(bodies);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    integrator->print_stats();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+#ifdef GRAVITY_HAVE_OPENCL
+static double run_opencl(PBodies &bodies, const program_args &args, run_progress &progress,
+                         const snapshot_file *snapshot)
+{
+    auto pcl = physics_cl{bodies, args.dt, args.preferred_platform, args.preferred_device, 0,
+                          !args.copy_buffers, args.precision};
+    pcl.use_kernel(args.kernel, args.work_group_size);
+    pcl.use_integrator(args.integrator.name);
+    if (snapshot)
+        pcl.load_snapshot(*snapshot);
+    auto live = progress.live_metrics();
+    if (live) {
+        live->add_info("gravity_opencl_device_info", "OpenCL platform and device in use",
+                       {{"platform", pcl.platform_name()}, {"device", pcl.device_name()}});
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    // Queue steps up to the next snapshot or trajectory frame at once, the device runs them back
+    // to back without host round-trips. Short batches are waited for, so the metrics count them
+    // and a signal stops the run within one batch.
+    while (progress.running()) {
+        auto batch = progress.next_batch();
+        {
+            auto timer = metric_timer{live, metric_phase::opencl};
+            pcl.step(batch);
+            if (progress.short_batches())
+                pcl.sync();
+        }
+        if (progress.advance(batch)) {
+            pcl.write_position_data();
+            if (progress.snapshot_due())
+                pcl.write_velocity_data();
+            progress.checkpoint(bodies);
+        }
+    }
+    pcl.finish();
+    auto end = std::chrono::steady_clock::now();
+
+    pcl.write_position_data();
+    pcl.write_velocity_data();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+static double run_multi(PBodies &bodies, const program_args &args, run_progress &progress)
+{
+    if (args.integrator.name != "euler" || args.precision != "float")
+        throw std::runtime_error{"-multi only supports the euler integrator in float"};
+    auto executor = multi_executor{bodies, args.dt, args.preferred_platform, args.use_host};
+
+    auto live = progress.live_metrics();
+    auto start = std::chrono::steady_clock::now();
+    while (progress.running()) {
+        {
+            auto timer = metric_timer{live, metric_phase::opencl};
+            executor.step();
+        }
+        if (progress.advance(1))
+            progress.checkpoint(bodies);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::cout << "final split:\n";
+    executor.print_split();
+    return std::chrono::duration<double>(end - start).count();
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    try {
+        auto args = parse_args(argc, argv);
+        PROFILE_THREAD_NAME("main");
+
+        // A restored run takes its body count from the snapshot
+        auto snapshot = std::unique_ptr<snapshot_file>{};
+        auto first_step = uint64_t{0};
+        auto first_time = 0.0;
+        if (!args.load_path.empty()) {
+            snapshot = std::make_unique<snapshot_file>(args.load_path);
+            args.count = snapshot->header().count;
+            first_step = snapshot->header().step;
+            first_time = snapshot->header().time;
+            std::cout << "restoring step " << first_step << " from " << args.load_path << "\n";
+        }
+        std::cout << "n=" << args.count << " dt=" << args.dt << " steps=" << args.steps << "\n";
+
+        // OpenCL uploads a snapshot straight from the mapped file, everything else runs on the
+        // host copy. A recorded trajectory starts from the host copy too.
+        auto bodies = PBodies{args.count};
+        auto device_only = args.use_opencl && !args.use_multi && args.record_path.empty();
+        if (!snapshot)
+            init_bodies(bodies, args.ic);
+        else if (!device_only)
+            snapshot->restore(bodies);
+
+        // Stop after the current step and save, so preempted jobs can be restarted with -load
+        std::signal(SIGTERM, request_stop);
+        std::signal(SIGINT, request_stop);
+
+        auto progress = run_progress{args, bodies, first_step, first_time};
+        auto seconds = 0.0;
+#ifdef GRAVITY_HAVE_OPENCL
+        if (args.use_multi)
+            seconds = run_multi(bodies, args, progress);
+        else if (args.use_opencl)
+            seconds = run_opencl(bodies, args, progress, snapshot.get());
+        else
+#endif
+            seconds = run_openmp(bodies, args, progress);
+
+        if (stop_requested)
+            std::cout << "stopped by signal after " << progress.steps() << " steps\n";
+        if (!args.save_path.empty())
+            progress.save(bodies);
+        progress.finish();
+        if (!args.save_path.empty())
+            std::cout << "saved snapshot to " << args.save_path << "\n";
+        print_throughput(args.count, progress.steps(), seconds);
+#ifdef GRAVITY_PROFILE
+        profiler::instance().finish(args.trace_path);
+#endif
+    } catch (std::exception &e) {
+        std::cerr << "exception: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -5,14 +5,17 @@
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "args.h"
+#include "metrics.h"
 #include "physics_cl.h"
 #include "physics_gl.h"
+#include "profiler.h"
 #include "simpleio.h"
 
 struct program_args {
@@ -21,7 +24,16 @@ struct program_args {
     float camera_step;
     std::string preferred_platform;
     std::string preferred_device;
+    std::string kernel;
+    std::string integrator;
+    std::string precision;
+    int work_group_size;
+    int substeps;
     int point_size;
+    ic_options ic;
+    std::string trace_path;
+    std::string metrics_path;
+    float metrics_every;
 };
 
 static program_args parse_args(int argc, char *argv[])
@@ -30,10 +42,22 @@ static program_args parse_args(int argc, char *argv[])
     parser.add_arg({"-n", "number of objects", 1});
     parser.add_arg({"-p", "preferred OpenCL platform", 1});
     parser.add_arg({"-d", "preferred OpenCL device", 1});
+    parser.add_arg({"-kernel", "OpenCL gravity kernel: basic, tiled, float4, fused", 1});
+    parser.add_arg({"-wg", "work-group size for the tiled kernels", 1});
+    parser.add_arg({"-integrator", "time integrator: euler, leapfrog, yoshida4, hermite", 1});
+    parser.add_arg({"-precision", "float, or mixed to sum forces in double", 1});
+    parser.add_arg({"-k", "physics steps per rendered frame", 1});
     parser.add_arg({"-dt", "time step", 1});
     parser.add_arg({"-rot", "camera rotation speed", 1});
     parser.add_arg({"-h", "help", 0});
     parser.add_arg({"-ps", "particle point size", 1});
+    parser.add_arg({"-ic", "initial conditions: blocks, plummer, disk, collision", 1});
+    parser.add_arg({"-seed", "random seed for the initial conditions", 1});
+    parser.add_arg({"-metrics", "keep Prometheus metrics of the run up to date in this file", 1});
+    parser.add_arg({"-metrics-every", "seconds between rewrites of the -metrics file", 1});
+#ifdef GRAVITY_PROFILE
+    parser.add_arg({"-trace", "write a Chrome trace of the step phases here on exit", 1});
+#endif
 
     parser.parse(argc, argv);
 
@@ -49,7 +73,17 @@ static program_args parse_args(int argc, char *argv[])
     args.camera_step = parser.find("-rot").get(0.0f);
     args.preferred_platform = parser.find("-p").get<std::string>("");
     args.preferred_device = parser.find("-d").get<std::string>("");
+    args.kernel = parser.find("-kernel").get<std::string>("basic");
+    args.work_group_size = parser.find("-wg").get(0);
+    args.integrator = parser.find("-integrator").get<std::string>("euler");
+    args.precision = parser.find("-precision").get<std::string>("float");
+    args.substeps = std::max(1, parser.find("-k").get(1));
     args.point_size = parser.find("-ps").get(1);
+    args.ic.name = parser.find("-ic").get<std::string>("blocks");
+    args.ic.seed = parser.find("-seed").get(1);
+    args.trace_path = parser.find("-trace").get<std::string>("");
+    args.metrics_path = parser.find("-metrics").get<std::string>("");
+    args.metrics_every = parser.find("-metrics-every").get(10.0f);
 
     return args;
 }
@@ -58,14 +92,26 @@ int main(int argc, char *argv[])
 {
     try {
         auto args = parse_args(argc, argv);
+        PROFILE_THREAD_NAME("render");
         std::cout << "n=" << args.count << " dt=" << args.dt << "\n";
 
         auto display = GLDisplay{1600, 900, "Gravity OpenCL"};
         std::cout << "OpenGL version: " << glGetString(GL_VERSION) << "\n";
 
-        auto pgl = physics_gl{args.count, args.dt};
-        auto pcl = physics_cl{pgl, args.preferred_platform, args.preferred_device};
+        auto pgl = physics_gl{args.count, args.dt, args.ic};
+        auto pcl = physics_cl{*pgl.get_bodies(), args.dt, args.preferred_platform,
+                              args.preferred_device, pgl.get_positions_vbo(), true,
+                              args.precision};
         pcl.print_platform_info();
+        pcl.use_kernel(args.kernel, args.work_group_size);
+        pcl.use_integrator(args.integrator);
+
+        auto live = std::unique_ptr<metrics>{};
+        if (!args.metrics_path.empty()) {
+            live = std::make_unique<metrics>(args.metrics_path, args.count, args.metrics_every);
+            live->add_info("gravity_opencl_device_info", "OpenCL platform and device in use",
+                           {{"platform", pcl.platform_name()}, {"device", pcl.device_name()}});
+        }
 
         // Bind shader and use VAO so OpenGL draws correctly
         pgl.use_shader();
@@ -93,23 +139,26 @@ int main(int argc, char *argv[])
                 glViewport(0, 0, display.width(), display.height());
             }
             if (pcl.is_gl_context()) {
+                auto timer = metric_timer{live.get(), metric_phase::opencl};
                 pcl.acquire_gl_object();
 
                 // Update the positions while OpenCL has acquired the OpenGL buffers
-                pcl.apply_gravity();
-                pcl.update_positions();
+                pcl.step(args.substeps);
 
                 pcl.release_gl_object();
+                pcl.finish();
             } else {
-                // Else context is not OpenGL shared buffer, we need to read the data back, then
-                // write it back to OpenGL to display the updated positions of the particles
-                pcl.apply_gravity();
-                pcl.update_positions();
-                pcl.write_position_data();
-
-                pgl.update_positions();
+                // Else context is not OpenGL shared buffer, so the positions are read back
+                // straight into the mapped vertex buffer. The next batch is queued before
+                // drawing so the device computes while we draw.
+                {
+                    PROFILE_SCOPE("gl_upload");
+                    auto timer = metric_timer{live.get(), metric_phase::upload};
+                    pcl.read_packed_positions(pgl.begin_positions_update());
+                    pgl.end_positions_update();
+                }
+                pcl.step(args.substeps);
             }
-            pcl.finish();
 
             // Update the camera
             counter += args.camera_step;
@@ -120,9 +169,17 @@ int main(int argc, char *argv[])
             pgl.set_view(view);
 
             // Finally, draw the particles to the screen, and update
-            glDrawArraysInstanced(GL_POINTS, 0, 3 * sizeof(glm::vec3), args.count);
+            pgl.draw();
             display.update();
+            if (live) {
+                live->add_steps(args.substeps);
+                live->add_frame();
+            }
         }
+        pcl.finish();
+#ifdef GRAVITY_PROFILE
+        profiler::instance().finish(args.trace_path);
+#endif
     } catch (std::exception &e) {
         std::cerr << "exception: " << e.what() << "\n";
     }
@@ -0,0 +1,190 @@
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "args.h"
+#include "display.h"
+#include "physics_gl.h"
+#include "replay.h"
+#include "trajectory.h"
+
+struct program_args {
+    std::string path;
+    float camera_step;
+    int point_size;
+    float rate;
+    int lookahead;
+};
+
+static program_args parse_args(int argc, char *argv[])
+{
+    arg_parser parser{"gravity_replay"};
+    parser.add_arg({"-f", "trajectory file recorded with -record", 1});
+    parser.add_arg({"-rot", "camera rotation speed", 1});
+    parser.add_arg({"-ps", "particle point size", 1});
+    parser.add_arg({"-rate", "trajectory frames shown per second", 1});
+    parser.add_arg({"-ahead", "frames to decode ahead of the display", 1});
+    parser.add_arg({"-h", "help", 0});
+
+    parser.parse(argc, argv);
+
+    bool help = parser.find("-h").get(false);
+    if (help) {
+        parser.show_help();
+        exit(0);
+    }
+
+    program_args args;
+    args.path = parser.find("-f").get<std::string>("");
+    args.camera_step = parser.find("-rot").get(0.0f);
+    args.point_size = parser.find("-ps").get(1);
+    args.rate = parser.find("-rate").get(60.0f);
+    args.lookahead = parser.find("-ahead").get(4);
+
+    if (args.path.empty()) {
+        parser.show_help();
+        exit(1);
+    }
+    return args;
+}
+
+static void print_position(const trajectory_file &file, int index, int stride, bool paused)
+{
+    std::cout << "frame " << index + 1 << "/" << file.frames() << " step " << file.step(index)
+              << " x" << stride << (paused ? " paused" : "") << std::endl;
+}
+
+// Space pauses, left/right seek by one keyframe interval and page up/down by ten, home and end
+// jump to the first and last frame, +/- change the fast-forward stride. Returns true if the
+// position or speed changed.
+static bool handle_keys(GLDisplay &disp, const trajectory_file &file, trajectory_player &player,
+                        int shown, bool &paused)
+{
+    auto changed = false;
+    auto interval = static_cast<int>(file.header().keyframe_interval);
+    SDL_Keycode key;
+    while (disp.next_key(key)) {
+        auto stride = player.stride();
+        switch (key) {
+        case SDLK_SPACE:
+            paused = !paused;
+            print_position(file, shown, stride, paused);
+            continue;
+        case SDLK_RIGHT:
+            player.seek(shown + interval);
+            break;
+        case SDLK_LEFT:
+            player.seek(shown - interval);
+            break;
+        case SDLK_PAGEUP:
+            player.seek(shown + 10 * interval);
+            break;
+        case SDLK_PAGEDOWN:
+            player.seek(shown - 10 * interval);
+            break;
+        case SDLK_HOME:
+            player.seek(0);
+            break;
+        case SDLK_END:
+            player.seek(file.frames() - 1);
+            break;
+        case SDLK_PLUS:
+        case SDLK_EQUALS:
+            player.set_stride(stride * 2);
+            break;
+        case SDLK_MINUS:
+            player.set_stride(stride / 2);
+            break;
+        default:
+            continue;
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+int main(int argc, char *argv[])
+{
+    auto args = parse_args(argc, argv);
+    auto file = trajectory_file{args.path};
+    auto count = static_cast<int>(file.header().count);
+    std::cout << "n=" << count << " frames=" << file.frames() << " steps " << file.step(0)
+              << " to " << file.step(file.frames() - 1) << "\n";
+
+    auto disp = GLDisplay{1600, 900, "Gravity replay"};
+    std::cout << "OpenGL version:" << glGetString(GL_VERSION) << "\n";
+
+    // Only the buffers are needed, the recording fills them
+    auto pgl = physics_gl{count};
+    pgl.use_shader();
+    pgl.bind();
+    pgl.update_colors(reinterpret_cast<const glm::vec3 *>(file.colors()));
+
+    glPointSize(args.point_size);
+
+    auto cameraTarget = glm::vec3(0.0f, 0.0f, 0.0f);
+    auto up = glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::mat4 view;
+
+    pgl.set_perspective(disp.aspect_ratio(), 0.1f, 100.0f);
+
+    auto player = trajectory_player{file, args.lookahead};
+    auto frame = replay_frame{0, 0, std::vector<glm::vec3>(count)};
+    auto shown = 0;
+    auto loaded = false;  // The position buffer holds nothing until the first frame arrives
+    auto paused = false;
+    auto report = false;
+    auto counter = 0.0f;
+
+    // Frames are taken from the player at the replay rate, independent of the display rate
+    auto frame_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(1.0 / std::max(args.rate, 1e-3f)));
+    auto due = std::chrono::steady_clock::now();
+
+    while (!disp.is_closed()) {
+        auto start = std::chrono::steady_clock::now();
+
+        if (handle_keys(disp, file, player, shown, paused))
+            report = true;
+        // While paused, only a seek brings up a new frame
+        if ((paused ? report : start >= due) && player.next(frame)) {
+            pgl.update_positions(frame.positions.data());
+            loaded = true;
+            shown = frame.index;
+            if (report)
+                print_position(file, shown, player.stride(), paused);
+            report = false;
+            due = std::max(due + frame_time, start - std::chrono::seconds{1});
+        }
+
+        disp.clear(0.0f, 0.0f, 0.0f, 1.0f);
+        if (disp.resized()) {
+            pgl.set_perspective(disp.aspect_ratio(), 0.1f, 100.f);
+            glViewport(0, 0, disp.width(), disp.height());
+        }
+        view =
+            glm::lookAt(glm::vec3(2 * sin(counter), 1.1f * sin(1.3 * counter) * cos(.33f * counter),
+                                  2 * cos(counter)),
+                        cameraTarget, up);
+        pgl.set_view(view);
+
+        if (loaded)
+            pgl.draw();
+
+        disp.update();
+        counter += args.camera_step;
+
+        auto end = std::chrono::steady_clock::now();
+        auto elapsed_us =
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        std::this_thread::sleep_for(std::chrono::microseconds(16667 - elapsed_us));
+    }
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "args.h"
+#include "initial_conditions.h"
+#include "ring_executor.h"
+#include "ring_transport.h"
+
+struct program_args {
+    int count;
+    float dt;
+    int steps;
+    ic_options ic;
+    std::string transport;
+    int ranks;
+    int rank;
+    int port;
+};
+
+static program_args parse_args(int argc, char *argv[])
+{
+    arg_parser parser{"gravity_ring"};
+    parser.add_arg({"-n", "number of objects", 1});
+    parser.add_arg({"-dt", "time step", 1});
+    parser.add_arg({"-steps", "number of steps to simulate", 1});
+    parser.add_arg({"-ic", "initial conditions: blocks, plummer, disk, collision", 1});
+    parser.add_arg({"-seed", "random seed for the initial conditions", 1});
+#ifdef GRAVITY_HAVE_MPI
+    parser.add_arg({"-transport", "mpi (default) or socket", 1});
+#endif
+    parser.add_arg({"-ranks", "socket transport: number of processes", 1});
+    parser.add_arg({"-rank", "socket transport: rank of this process, else start all ranks", 1});
+    parser.add_arg({"-port", "socket transport: port of rank 0, rank r uses port + r", 1});
+    parser.add_arg({"-h", "help", 0});
+
+    parser.parse(argc, argv);
+
+    bool help = parser.find("-h").get(false);
+    if (help) {
+        parser.show_help();
+        exit(0);
+    }
+
+    program_args args;
+    args.count = parser.find("-n").get(1 << 12);
+    args.dt = parser.find("-dt").get(0.00005f);
+    args.steps = parser.find("-steps").get(100);
+    args.ic.name = parser.find("-ic").get<std::string>("blocks");
+    args.ic.seed = parser.find("-seed").get(1);
+#ifdef GRAVITY_HAVE_MPI
+    args.transport = parser.find("-transport").get<std::string>("mpi");
+#else
+    args.transport = "socket";
+#endif
+    args.ranks = parser.find("-ranks").get(2);
+    args.rank = parser.find("-rank").get(-1);
+    args.port = parser.find("-port").get(47100);
+
+    return args;
+}
+
+// Start the other socket ranks as copies of this process. This has to happen before OpenMP
+// creates any threads. Returns the rank of the calling process.
+static int fork_ranks(int ranks, std::vector<pid_t> &children)
+{
+    for (int r = 1; r < ranks; r++) {
+        auto pid = fork();
+        if (pid < 0)
+            throw std::runtime_error{"fork failed"};
+        if (pid == 0) {
+            children.clear();
+            return r;
+        }
+        children.push_back(pid);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    auto children = std::vector<pid_t>{};
+    auto status = 0;
+    try {
+        auto args = parse_args(argc, argv);
+
+        auto transport = std::unique_ptr<ring_transport>{};
+#ifdef GRAVITY_HAVE_MPI
+        if (args.transport == "mpi")
+            transport = std::make_unique<mpi_transport>(&argc, &argv);
+#endif
+        if (!transport) {
+            if (args.transport != "socket")
+                throw std::runtime_error{"unknown transport: " + args.transport};
+            auto rank = args.rank >= 0 ? args.rank : fork_ranks(args.ranks, children);
+            transport = std::make_unique<socket_transport>(rank, args.ranks, args.port);
+        }
+
+        auto root = transport->rank() == 0;
+        if (root)
+            std::cout << "n=" << args.count << " dt=" << args.dt << " steps=" << args.steps
+                      << " ranks=" << transport->size() << " transport=" << args.transport
+                      << "\n";
+
+        auto ring = ring_executor{*transport, args.count, args.ic};
+        double before[4], after[4];
+        ring.totals(before);
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < args.steps; i++)
+            ring.step(args.dt);
+        auto end = std::chrono::steady_clock::now();
+        auto seconds = std::chrono::duration<double>(end - start).count();
+
+        // Direct summation conserves momentum up to rounding, so a drift here points at blocks
+        // going missing or being summed twice
+        ring.totals(after);
+        if (root) {
+            auto interactions = static_cast<double>(args.count) * args.count * args.steps;
+            std::cout << args.steps << " steps in " << seconds << " s\n"
+                      << "steps/s: " << args.steps / seconds << "\n"
+                      << "interactions/s: " << interactions / seconds << "\n";
+            std::printf("momentum/mass before: %.6e %.6e %.6e\n", before[0] / before[3],
+                        before[1] / before[3], before[2] / before[3]);
+            std::printf("momentum/mass after:  %.6e %.6e %.6e\n", after[0] / after[3],
+                        after[1] / after[3], after[2] / after[3]);
+        }
+    } catch (std::exception &e) {
+        std::cerr << "exception: " << e.what() << "\n";
+        status = 1;
+    }
+
+    for (auto pid : children) {
+        auto child_status = 0;
+        waitpid(pid, &child_status, 0);
+        if (!WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0)
+            status = 1;
+    }
+    return status;
+}
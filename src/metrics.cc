@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "metrics.h"
+
+static const char *PHASE_NAMES[METRIC_PHASES] = {"force", "integrate", "opencl", "upload",
+                                                 "checkpoint"};
+
+// Label values are quoted, with backslashes, quotes and newlines escaped
+static std::string escape_label(const std::string &value)
+{
+    auto escaped = std::string{};
+    for (auto c : value) {
+        if (c == '\\' || c == '"')
+            escaped += '\\';
+        if (c == '\n') {
+            escaped += "\\n";
+            continue;
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+static void write_header(std::ostream &out, const char *name, const char *help, const char *type)
+{
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+metrics::metrics(const std::string &path, int count, double interval)
+    : path{path},
+      count{count},
+      interval{std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(std::max(interval, 0.1)))},
+      steps_done{0},
+      frames{0},
+      phase_ns{},
+      stopping{false},
+      started{std::chrono::steady_clock::now()},
+      last_time{started},
+      last_steps{0},
+      last_frames{0},
+      last_phase_ns{}
+{
+    worker = std::thread{&metrics::run, this};
+}
+
+metrics::~metrics()
+{
+    {
+        std::lock_guard<std::mutex> guard(mu);
+        stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+void metrics::add_info(const std::string &name, const std::string &help,
+                       const std::vector<std::pair<std::string, std::string>> &labels)
+{
+    auto text = std::string{};
+    for (auto &label : labels) {
+        text += (text.empty() ? "" : ",") + label.first;
+        text += "=\"" + escape_label(label.second) + "\"";
+    }
+    std::lock_guard<std::mutex> guard(mu);
+    infos.push_back({name, help, text});
+}
+
+void metrics::add_gauge(const std::string &name, const std::string &help,
+                        std::function<double()> read)
+{
+    std::lock_guard<std::mutex> guard(mu);
+    gauges.push_back({name, help, std::move(read)});
+}
+
+void metrics::run()
+{
+    std::unique_lock<std::mutex> lock(mu);
+    while (!stopping) {
+        wake.wait_for(lock, interval, [this] { return stopping; });
+        // A metrics file that cannot be written must not stop the simulation
+        try {
+            write();
+        } catch (std::exception &e) {
+            std::cerr << "metrics: " << e.what() << "\n";
+        }
+    }
+}
+
+// Rates and per step averages cover the time since the previous write. Called with mu held.
+void metrics::write()
+{
+    auto now = std::chrono::steady_clock::now();
+    auto seconds = std::chrono::duration<double>(now - last_time).count();
+    auto steps = steps_done.load(std::memory_order_relaxed);
+    auto frame_count = frames.load(std::memory_order_relaxed);
+    auto new_steps = steps - last_steps;
+    auto rate = seconds > 0 ? new_steps / seconds : 0.0;
+    auto n = static_cast<double>(count);
+
+    auto out = std::ostringstream{};
+    out.precision(9);
+    write_header(out, "gravity_bodies", "Number of simulated bodies", "gauge");
+    out << "gravity_bodies " << count << "\n";
+    write_header(out, "gravity_uptime_seconds", "Time since the run started", "gauge");
+    out << "gravity_uptime_seconds " << std::chrono::duration<double>(now - started).count()
+        << "\n";
+    write_header(out, "gravity_steps_total", "Steps simulated", "counter");
+    out << "gravity_steps_total " << steps << "\n";
+    write_header(out, "gravity_steps_per_second", "Steps per second over the last interval",
+                 "gauge");
+    out << "gravity_steps_per_second " << rate << "\n";
+    // What a direct sum over every pair each step would evaluate. Tree solvers and block
+    // timesteps evaluate fewer pairs, so for them this is a comparable rate, not a count.
+    write_header(out, "gravity_interactions_per_second",
+                 "Steps per second times bodies squared over the last interval, the "
+                 "n^2-equivalent pairwise interaction rate",
+                 "gauge");
+    out << "gravity_interactions_per_second " << rate * n * n << "\n";
+
+    write_header(out, "gravity_phase_seconds_total", "Time spent in each phase of the step",
+                 "counter");
+    for (auto i = 0; i < METRIC_PHASES; i++) {
+        out << "gravity_phase_seconds_total{phase=\"" << PHASE_NAMES[i] << "\"} "
+            << phase_ns[i].load(std::memory_order_relaxed) * 1e-9 << "\n";
+    }
+    write_header(out, "gravity_phase_seconds_per_step",
+                 "Average time per step in each phase over the last interval", "gauge");
+    for (auto i = 0; i < METRIC_PHASES; i++) {
+        auto total = phase_ns[i].load(std::memory_order_relaxed);
+        auto per_step = new_steps > 0 ? (total - last_phase_ns[i]) * 1e-9 / new_steps : 0.0;
+        out << "gravity_phase_seconds_per_step{phase=\"" << PHASE_NAMES[i] << "\"} " << per_step
+            << "\n";
+        last_phase_ns[i] = total;
+    }
+
+    write_header(out, "gravity_frames_total", "Frames rendered", "counter");
+    out << "gravity_frames_total " << frame_count << "\n";
+    write_header(out, "gravity_render_fps", "Frames rendered per second over the last interval",
+                 "gauge");
+    out << "gravity_render_fps " << (seconds > 0 ? (frame_count - last_frames) / seconds : 0.0)
+        << "\n";
+
+    for (auto &g : gauges) {
+        write_header(out, g.name.c_str(), g.help.c_str(), "gauge");
+        out << g.name << " " << g.read() << "\n";
+    }
+    for (auto &i : infos) {
+        write_header(out, i.name.c_str(), i.help.c_str(), "gauge");
+        out << i.name << "{" << i.labels << "} 1\n";
+    }
+
+    last_time = now;
+    last_steps = steps;
+    last_frames = frame_count;
+
+    // Written under a temporary name and renamed, so a scrape never sees half a file
+    auto temp = path + ".tmp";
+    auto text = out.str();
+    auto file = std::fopen(temp.c_str(), "w");
+    if (!file)
+        throw std::runtime_error{"could not create " + temp + ": " + std::strerror(errno)};
+    auto written = std::fwrite(text.data(), 1, text.size(), file);
+    if (std::fclose(file) != 0 || written != text.size())
+        throw std::runtime_error{"could not write " + temp};
+    if (std::rename(temp.c_str(), path.c_str()) < 0)
+        throw std::runtime_error{"could not rename metrics to " + path + ": " +
+                                 std::strerror(errno)};
+}
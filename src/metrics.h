@@ -0,0 +1,119 @@
+#ifndef GRAVITY_METRICS_H
+#define GRAVITY_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Parts of a step whose average time is exported
+enum class metric_phase
+{
+    force,
+    integrate,
+    opencl,  // Whole batches on an OpenCL device, queueing to completion
+    upload,  // Positions handed to OpenGL
+    checkpoint,
+};
+
+constexpr int METRIC_PHASES = 5;
+
+// Live throughput of a long run, written in the Prometheus text format to a file that a
+// background thread rewrites every interval seconds, for the node exporter's textfile collector
+// or a plain cat. The simulation and render threads only touch relaxed atomic counters; rates
+// and averages are worked out by the writer thread.
+class metrics
+{
+public:
+    // count bodies, for the n^2-equivalent interaction rate
+    metrics(const std::string &path, int count, double interval);
+    // Writes the final values
+    ~metrics();
+    metrics(const metrics &) = delete;
+    metrics &operator=(const metrics &) = delete;
+
+    void add_steps(uint64_t steps)
+    {
+        steps_done.fetch_add(steps, std::memory_order_relaxed);
+    }
+
+    void add_phase(metric_phase phase, std::chrono::steady_clock::duration time)
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+        phase_ns[static_cast<int>(phase)].fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    void add_frame()
+    {
+        frames.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Constant labels exported as name{labels} 1, such as the OpenCL device in use
+    void add_info(const std::string &name, const std::string &help,
+                  const std::vector<std::pair<std::string, std::string>> &labels);
+    // A value read by the writer thread each time it writes, such as a writer queue depth.
+    // read must stay callable until the metrics are destroyed.
+    void add_gauge(const std::string &name, const std::string &help, std::function<double()> read);
+
+private:
+    struct info {
+        std::string name, help, labels;
+    };
+    struct gauge {
+        std::string name, help;
+        std::function<double()> read;
+    };
+
+    std::string path;
+    int count;
+    std::chrono::steady_clock::duration interval;
+    std::atomic<uint64_t> steps_done, frames;
+    std::atomic<int64_t> phase_ns[METRIC_PHASES];
+
+    // Everything below belongs to the writer thread, or is guarded by mu
+    std::mutex mu;
+    std::condition_variable wake;
+    bool stopping;
+    std::vector<info> infos;
+    std::vector<gauge> gauges;
+    std::chrono::steady_clock::time_point started, last_time;
+    uint64_t last_steps, last_frames;
+    int64_t last_phase_ns[METRIC_PHASES];
+    std::thread worker;
+
+    void run();
+    void write();
+};
+
+// Adds the time until it goes out of scope to a phase, if there are metrics to add to
+class metric_timer
+{
+public:
+    metric_timer(metrics *m, metric_phase phase)
+        : m{m}, phase{phase}, start{m ? std::chrono::steady_clock::now()
+                                      : std::chrono::steady_clock::time_point{}}
+    {
+    }
+
+    ~metric_timer()
+    {
+        if (m)
+            m->add_phase(phase, std::chrono::steady_clock::now() - start);
+    }
+
+    metric_timer(const metric_timer &) = delete;
+    metric_timer &operator=(const metric_timer &) = delete;
+
+private:
+    metrics *m;
+    metric_phase phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif  // GRAVITY_METRICS_H
@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <utility>
+
+#include "cl_common.h"
+#include "multi_executor.h"
+#include "simd_gravity.h"
+#include "simpleio.h"
+
+multi_executor::multi_executor(PBodies &b, float dt, const std::string &preferred_platform,
+                               bool use_host)
+    : bodies{b},
+      step_dt{dt},
+      context{nullptr},
+      program{nullptr},
+      packed(b.padded_size()),
+      device_acc(b.padded_size())
+{
+    auto platform = find_platform(preferred_platform);
+
+    auto device_count = 0U;
+    clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, nullptr, &device_count);
+    auto devices = std::vector<cl_device_id>(device_count);
+    clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, device_count, devices.data(), nullptr);
+    if (devices.empty() && !use_host)
+        throw std::runtime_error{"no OpenCL devices on " + get_platform_name(platform)};
+
+    auto error = 0;
+    auto n = bodies.padded_size();
+    if (!devices.empty()) {
+        context = clCreateContext(nullptr, devices.size(), devices.data(), nullptr, nullptr,
+                                  &error);
+        throw_error_info(error, "OpenCL context creation failed");
+
+        auto kernel_source = read_file("res/physics.cl");
+        program = make_program(kernel_source.c_str(), context, devices[0]);
+    }
+
+    auto bytes = n * sizeof(cl_float4);
+    for (auto device : devices) {
+        auto w = worker{};
+        w.name = get_device_name(device).c_str();
+        w.device = device;
+        w.queue = get_command_queue(context, device, true);
+        w.kernel = clCreateKernel(program, "apply_gravity_range", &error);
+        throw_error_info(error, "apply_gravity_range kernel creation");
+        w.positions = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, nullptr, &error);
+        throw_error_info(error, "gpu memory allocation failed");
+        w.acc = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytes, nullptr, &error);
+        throw_error_info(error, "gpu memory allocation failed");
+
+        auto max_size = size_t{0};
+        clGetKernelWorkGroupInfo(w.kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_size),
+                                 &max_size, nullptr);
+        w.work_group_size = std::max(size_t{1}, std::min(DEFAULT_WORK_GROUP_SIZE, max_size));
+
+        // offset and count are set every step when the split changes
+        clSetKernelArg(w.kernel, 0, sizeof(w.positions), &w.positions);
+        clSetKernelArg(w.kernel, 1, sizeof(w.acc), &w.acc);
+        clSetKernelArg(w.kernel, 2, w.work_group_size * sizeof(cl_float4), nullptr);
+        clSetKernelArg(w.kernel, 3, sizeof(n), &n);
+        workers.push_back(w);
+    }
+
+    if (use_host) {
+        auto w = worker{};
+        w.name = std::string{"host ("} + simd_gravity_isa() + ")";
+        workers.push_back(w);
+    }
+
+    for (auto &w : workers)
+        w.share = 1.0 / workers.size();
+    split();
+}
+
+multi_executor::~multi_executor()
+{
+    for (auto &w : workers) {
+        if (!w.device)
+            continue;
+        clReleaseMemObject(w.positions);
+        clReleaseMemObject(w.acc);
+        clReleaseKernel(w.kernel);
+        clReleaseCommandQueue(w.queue);
+    }
+    if (program)
+        clReleaseProgram(program);
+    if (context)
+        clReleaseContext(context);
+}
+
+// Turn the shares into contiguous ranges over the real bodies. Boundaries are kept on multiples
+// of SIMD_WIDTH so the host range starts on a block.
+void multi_executor::split()
+{
+    auto total = 0.0;
+    for (auto &w : workers)
+        total += w.share;
+
+    auto n = bodies.size();
+    auto cumulative = 0.0;
+    auto begin = 0;
+    for (auto &w : workers) {
+        cumulative += w.share;
+        auto end = static_cast<int>(cumulative / total * n + 0.5);
+        end = std::min(n, (end + SIMD_WIDTH / 2) / SIMD_WIDTH * SIMD_WIDTH);
+        if (&w == &workers.back())
+            end = n;
+        w.begin = begin;
+        w.end = std::max(begin, end);
+        begin = w.end;
+    }
+}
+
+// Move each share halfway towards the share its measured rate would give it, which damps the
+// noise of single step timings
+void multi_executor::rebalance()
+{
+    auto total_rate = 0.0;
+    for (auto &w : workers) {
+        auto count = w.end - w.begin;
+        if (count > 0 && w.seconds > 0.0)
+            w.rate = count / w.seconds;
+        total_rate += w.rate;
+    }
+    if (total_rate <= 0.0)
+        return;
+
+    for (auto &w : workers)
+        w.share = std::max(MIN_SHARE, 0.5 * w.share + 0.5 * w.rate / total_rate);
+    split();
+}
+
+void multi_executor::step()
+{
+    auto n = bodies.padded_size();
+    auto x = bodies.pos.x(), y = bodies.pos.y(), z = bodies.pos.z();
+    auto mass = bodies.mass.data();
+#pragma omp parallel for simd
+    for (int i = 0; i < n; i++)
+        packed[i] = cl_float4{{x[i], y[i], z[i], mass[i]}};
+
+    // Queue the broadcast, kernel and read back on every device before the host starts on its
+    // own range, so they all run at the same time
+    auto events = std::vector<std::pair<cl_event, cl_event>>(workers.size());
+    for (size_t k = 0; k < workers.size(); k++) {
+        auto &w = workers[k];
+        auto count = w.end - w.begin;
+        if (!w.device || count == 0)
+            continue;
+
+        auto error = clEnqueueWriteBuffer(w.queue, w.positions, CL_FALSE, 0,
+                                          n * sizeof(cl_float4), packed.data(), 0, nullptr,
+                                          &events[k].first);
+        throw_error_info(error, "failed to write to gpu memory");
+
+        clSetKernelArg(w.kernel, 4, sizeof(w.begin), &w.begin);
+        clSetKernelArg(w.kernel, 5, sizeof(count), &count);
+        auto global = (count + w.work_group_size - 1) / w.work_group_size * w.work_group_size;
+        error = clEnqueueNDRangeKernel(w.queue, w.kernel, 1, nullptr, &global,
+                                       &w.work_group_size, 0, nullptr, nullptr);
+        throw_error_info(error, "failed to enqueue apply_gravity_range");
+
+        error = clEnqueueReadBuffer(w.queue, w.acc, CL_FALSE, 0, count * sizeof(cl_float4),
+                                    device_acc.data() + w.begin, 0, nullptr, &events[k].second);
+        throw_error_info(error, "failed to read from gpu memory");
+        clFlush(w.queue);
+    }
+
+    auto ax = bodies.acc.x(), ay = bodies.acc.y(), az = bodies.acc.z();
+    for (size_t k = 0; k < workers.size(); k++) {
+        auto &w = workers[k];
+        if (w.device || w.begin == w.end)
+            continue;
+        auto start = std::chrono::steady_clock::now();
+        simd_gravity_range(x, y, z, mass, n, w.begin, w.end, ax, ay, az);
+        auto end = std::chrono::steady_clock::now();
+        w.seconds = std::chrono::duration<double>(end - start).count();
+    }
+
+    // A device's time runs from the start of its broadcast to the end of its read back
+    for (size_t k = 0; k < workers.size(); k++) {
+        auto &w = workers[k];
+        if (!w.device || w.begin == w.end)
+            continue;
+        clWaitForEvents(1, &events[k].second);
+        auto start = cl_ulong{0}, end = cl_ulong{0};
+        clGetEventProfilingInfo(events[k].first, CL_PROFILING_COMMAND_START, sizeof(start),
+                                &start, nullptr);
+        clGetEventProfilingInfo(events[k].second, CL_PROFILING_COMMAND_END, sizeof(end), &end,
+                                nullptr);
+        w.seconds = (end - start) * 1e-9;
+        clReleaseEvent(events[k].first);
+        clReleaseEvent(events[k].second);
+
+        auto first = w.begin, last = w.end;
+#pragma omp parallel for simd
+        for (int i = first; i < last; i++) {
+            ax[i] += device_acc[i].s[0];
+            ay[i] += device_acc[i].s[1];
+            az[i] += device_acc[i].s[2];
+        }
+    }
+
+    bodies.integrate(step_dt);
+    rebalance();
+}
+
+void multi_executor::print_split()
+{
+    for (auto &w : workers) {
+        std::printf("  %-40s bodies %8d - %8d (%5.1f%%)  %8.3f ms\n", w.name.c_str(), w.begin,
+                    w.end, 100.0 * (w.end - w.begin) / bodies.size(), w.seconds * 1e3);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef GRAVITY_MULTI_EXECUTOR_H
+#define GRAVITY_MULTI_EXECUTOR_H
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <string>
+#include <vector>
+
+#include "aligned_allocator.h"
+#include "pobject.h"
+
+// Direct summation split across every OpenCL device of a platform plus the host. Each step the
+// positions are broadcast to all devices, every worker computes the accelerations of its own
+// contiguous range of bodies, and the host integrates. After each step the ranges are resized in
+// proportion to the bodies per second each worker managed.
+class multi_executor
+{
+public:
+    multi_executor(PBodies &b, float dt, const std::string &preferred_platform, bool use_host);
+    ~multi_executor();
+    multi_executor(const multi_executor &) = delete;
+    multi_executor &operator=(const multi_executor &) = delete;
+
+    void step();
+
+    // Each worker's range and the time it took in the last step
+    void print_split();
+
+private:
+    struct worker {
+        std::string name;
+        // Null for the host, which runs simd_gravity_range instead
+        cl_device_id device;
+        cl_command_queue queue;
+        cl_kernel kernel;
+        cl_mem positions, acc;
+        size_t work_group_size;
+        int begin, end;
+        double share;
+        double seconds;
+        double rate;
+    };
+
+    PBodies &bodies;
+    float step_dt;
+    cl_context context;
+    cl_program program;
+    std::vector<worker> workers;
+    // Positions and masses as float4 for the broadcast, and the accelerations read back from the
+    // devices, both indexed by body
+    aligned_vector<cl_float4> packed, device_acc;
+
+    void split();
+    void rebalance();
+
+    static constexpr size_t DEFAULT_WORK_GROUP_SIZE = 256;
+    // Every worker still gets this share of the bodies, so slow workers keep being measured
+    static constexpr double MIN_SHARE = 0.01;
+};
+
+#endif  // GRAVITY_MULTI_EXECUTOR_H
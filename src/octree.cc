@@ -0,0 +1,193 @@
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "octree.h"
+
+static constexpr int SORT_CUTOFF = 1 << 14;  // Below this many keys just use std::sort
+static constexpr int TASK_CUTOFF = 1 << 12;  // Below this many bodies build subtrees serially
+
+// Spread the lower 21 bits of v so there are two zero bits between each of them
+static uint64_t spread_bits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+static int octant(uint64_t key, int level)
+{
+    return static_cast<int>((key >> (3 * (octree::MAX_LEVEL - 1 - level))) & 7);
+}
+
+template<typename It>
+static void parallel_merge_sort(It begin, It end, int depth)
+{
+    auto size = end - begin;
+    if (depth <= 0 || size < SORT_CUTOFF) {
+        std::sort(begin, end);
+        return;
+    }
+    auto middle = begin + size / 2;
+#pragma omp task
+    parallel_merge_sort(begin, middle, depth - 1);
+    parallel_merge_sort(middle, end, depth - 1);
+#pragma omp taskwait
+    std::inplace_merge(begin, middle, end);
+}
+
+octree::octree() : node_count{0}, root_size{0.0f}, max_leaf_size{1} {}
+
+void octree::build(PBodies &bodies, int leaf_size)
+{
+    auto n = bodies.size();
+    max_leaf_size = std::max(leaf_size, 1);
+    sort_bodies(bodies);
+    if (n == 0)
+        return;
+
+    // Every internal node has at least two children, so there are at most 2n - 1 nodes
+    if (nodes.size() < static_cast<size_t>(2 * n))
+        nodes.resize(2 * n);
+    node_count = 1;
+
+#pragma omp parallel
+#pragma omp single
+    build_node(0, 0, n, 0);
+}
+
+void octree::sort_bodies(PBodies &bodies)
+{
+    auto n = bodies.size();
+    auto bx = bodies.pos.x(), by = bodies.pos.y(), bz = bodies.pos.z();
+
+    auto min_x = std::numeric_limits<float>::max(), max_x = -min_x;
+    auto min_y = min_x, max_y = max_x;
+    auto min_z = min_x, max_z = max_x;
+#pragma omp parallel for reduction(min : min_x, min_y, min_z) reduction(max : max_x, max_y, max_z)
+    for (int i = 0; i < n; i++) {
+        min_x = std::min(min_x, bx[i]);
+        min_y = std::min(min_y, by[i]);
+        min_z = std::min(min_z, bz[i]);
+        max_x = std::max(max_x, bx[i]);
+        max_y = std::max(max_y, by[i]);
+        max_z = std::max(max_z, bz[i]);
+    }
+
+    // Slightly enlarge the cube so bodies on the far faces still get a key inside the grid
+    root_size = std::max({max_x - min_x, max_y - min_y, max_z - min_z, 1e-6f}) * 1.0001f;
+    auto scale = ((1 << MAX_LEVEL) - 1) / root_size;
+
+    auto sorted = std::vector<std::pair<uint64_t, int>>(n);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        auto x = static_cast<uint64_t>((bx[i] - min_x) * scale);
+        auto y = static_cast<uint64_t>((by[i] - min_y) * scale);
+        auto z = static_cast<uint64_t>((bz[i] - min_z) * scale);
+        sorted[i] = {spread_bits(x) << 2 | spread_bits(y) << 1 | spread_bits(z), i};
+    }
+
+    auto depth = 2;
+#ifdef _OPENMP
+    for (auto threads = omp_get_max_threads(); threads > 1; threads >>= 1)
+        depth++;
+#endif
+#pragma omp parallel
+#pragma omp single
+    parallel_merge_sort(sorted.begin(), sorted.end(), depth);
+
+    keys.resize(n);
+    order.resize(n);
+    pos.resize(n);
+    mass.resize(n);
+    auto sx = pos.x(), sy = pos.y(), sz = pos.z();
+#pragma omp parallel for
+    for (int k = 0; k < n; k++) {
+        auto i = sorted[k].second;
+        keys[k] = sorted[k].first;
+        order[k] = i;
+        sx[k] = bx[i];
+        sy[k] = by[i];
+        sz[k] = bz[i];
+        mass[k] = bodies.mass[i];
+    }
+}
+
+void octree::build_node(int index, int begin, int end, int level)
+{
+    auto &node = nodes[index];
+    node.begin = begin;
+    node.end = end;
+    node.first_child = 0;
+    node.child_count = 0;
+
+    // Keys are sorted, so the first and last key share every octant the whole range shares.
+    // The first differing octant is where this range actually splits.
+    auto diff = keys[begin] ^ keys[end - 1];
+    if (end - begin <= max_leaf_size || diff == 0) {
+        node.size = std::ldexp(root_size, -level);
+        auto m = 0.0f;
+        auto com = glm::vec3{0.0f, 0.0f, 0.0f};
+        for (int k = begin; k < end; k++) {
+            m += mass[k];
+            com += pos.get(k) * mass[k];
+        }
+        node.mass = m;
+        node.com = m > 0.0f ? com * (1.0f / m) : pos.get(begin);
+        return;
+    }
+
+    auto highest_bit = 63 - __builtin_clzll(diff);
+    auto split = MAX_LEVEL - 1 - highest_bit / 3;
+    node.size = std::ldexp(root_size, -split);
+
+    // Bodies are grouped by octant at the split level, find where each group starts
+    int bounds[9];
+    auto child_count = 0;
+    auto first = begin;
+    while (first < end) {
+        auto digit = octant(keys[first], split);
+        auto last = std::partition_point(keys.begin() + first, keys.begin() + end,
+                                         [=](uint64_t key) { return octant(key, split) == digit; });
+        bounds[child_count++] = first;
+        first = static_cast<int>(last - keys.begin());
+    }
+    bounds[child_count] = end;
+
+    auto first_child = node_count.fetch_add(child_count);
+    node.first_child = first_child;
+    node.child_count = child_count;
+
+    for (int c = 0; c < child_count; c++) {
+        auto child_begin = bounds[c];
+        auto child_end = bounds[c + 1];
+        if (child_end - child_begin > TASK_CUTOFF) {
+#pragma omp task
+            build_node(first_child + c, child_begin, child_end, split + 1);
+        } else {
+            build_node(first_child + c, child_begin, child_end, split + 1);
+        }
+    }
+#pragma omp taskwait
+
+    auto m = 0.0f;
+    auto com = glm::vec3{0.0f, 0.0f, 0.0f};
+    for (int c = first_child; c < first_child + child_count; c++) {
+        m += nodes[c].mass;
+        com += nodes[c].com * nodes[c].mass;
+    }
+    node.mass = m;
+    node.com = m > 0.0f ? com * (1.0f / m) : nodes[first_child].com;
+}
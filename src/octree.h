@@ -0,0 +1,54 @@
+#ifndef GRAVITY_OCTREE_H
+#define GRAVITY_OCTREE_H
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "pobject.h"
+
+struct octree_node {
+    glm::vec3 com;    // Center of mass
+    float mass;       // Total mass of the bodies in this cell
+    float size;       // Edge length of the cell
+    int first_child;  // Children are stored contiguously starting at nodes[first_child]
+    int child_count;  // 0 for leaves
+    int begin, end;   // Range of bodies in sorted order
+};
+
+// Octree over the bodies sorted along a Morton curve. Cells that would only have one occupied
+// child are collapsed, so every internal node has at least two children and a tree over n
+// bodies never has more than 2n nodes.
+class octree
+{
+public:
+    octree();
+
+    // Rebuild the tree for the current positions. Sorting and construction run in parallel.
+    void build(PBodies &bodies, int leaf_size);
+
+    inline int num_nodes()
+    {
+        return node_count;
+    }
+
+    std::vector<octree_node> nodes;  // nodes[0] is the root
+    std::vector<int> order;          // order[k] is the PBodies index of the kth sorted body
+    vec3_array pos;                  // Positions in sorted order
+    aligned_vector<float> mass;      // Masses in sorted order
+
+    static constexpr int MAX_LEVEL = 21;  // Bits per axis in a Morton key
+
+private:
+    std::vector<uint64_t> keys;
+    std::atomic<int> node_count;
+    float root_size;
+    int max_leaf_size;
+
+    void sort_bodies(PBodies &bodies);
+    void build_node(int node, int begin, int end, int level);
+};
+
+#endif  // GRAVITY_OCTREE_H
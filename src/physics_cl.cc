@@ -1,15 +1,20 @@
+#ifndef GRAVITY_NO_GL
 #include <GL/glew.h>
+#endif
 
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
 #include <OpenCL/cl_ext.h>
+#include <OpenCL/opencl.h>
+#ifndef GRAVITY_NO_GL
 #include <OpenCL/cl_gl.h>
 #include <OpenCL/cl_gl_ext.h>
-#include <OpenCL/opencl.h>
 #include <OpenGL/CGLContext.h>
 #include <OpenGL/OpenGL.h>
+#endif
 #else
 #include <CL/cl.h>
+#ifndef GRAVITY_NO_GL
 #include <CL/cl_gl.h>
 #include <CL/cl_gl_ext.h>
 #ifdef _WIN32
@@ -19,53 +24,31 @@
 #include <GL/glx.h>
 #endif
 #endif
+#endif
 
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <math.h>
 #include <string.h>
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <string>
 #include <utility>
 #include <vector>
 
+#include "cl_common.h"
+#include "integrator.h"
 #include "physics_cl.h"
-#include "physics_gl.h"
 #include "simpleio.h"
 
-static bool check_error(cl_int err, const char *message)
-{
-    if (err != CL_SUCCESS) {
-        std::cerr << "ERROR: " << message << " (" << err << ")" << std::endl;
-        return true;
-    }
-    return false;
-}
-
-#define throw_error_info(err, message)                                                            \
-    do {                                                                                          \
-        if ((err) != CL_SUCCESS) {                                                                \
-            std::stringstream ss;                                                                 \
-            ss << "error at " << __FILE__ << ":" << __LINE__ << " " << (message) << " (" << (err) \
-               << ')';                                                                            \
-            throw std::runtime_error{ss.str()};                                                   \
-        }                                                                                         \
-    } while (0);
-
-static std::string get_device_name(cl_device_id id)
-{
-    auto size = 0UL;
-    clGetDeviceInfo(id, CL_DEVICE_NAME, 0, nullptr, &size);
-    auto s = std::string(size + 1, '\0');
-    clGetDeviceInfo(id, CL_DEVICE_NAME, size, const_cast<char *>(s.data()), nullptr);
-    return s;
-}
-
 static cl_device_id get_best_device(cl_platform_id platform, const std::string &preferred_device)
 {
     auto max_compute_units = 0L;
@@ -94,15 +77,6 @@ static cl_device_id get_best_device(cl_platform_id platform, const std::string &
     return best_device;
 }
 
-static std::string get_platform_name(cl_platform_id id)
-{
-    auto size = 0UL;
-    clGetPlatformInfo(id, CL_PLATFORM_NAME, 0, nullptr, &size);
-    auto s = std::string(size + 1, '\0');
-    clGetPlatformInfo(id, CL_PLATFORM_NAME, size, const_cast<char *>(s.data()), nullptr);
-    return s;
-}
-
 static std::string get_device_extensions(cl_device_id device)
 {
     char buffer[1 << 13];
@@ -125,6 +99,7 @@ static bool is_extension_supported(const char *extension_name, cl_device_id id)
     return false;
 }
 
+#ifndef GRAVITY_NO_GL
 static int cl_gl_compatibility(cl_device_id id)
 {
 #ifdef __APPLE__
@@ -135,52 +110,9 @@ static int cl_gl_compatibility(cl_device_id id)
     return is_extension_supported(CL_GL_SHARING_EXT, id);
 }
 
-static void check_build_errors(cl_int error, cl_program program, cl_device_id device)
-{
-    if (error) {
-        auto len = 0UL;
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &len);
-        auto log = std::string(len, '\0');
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, len,
-                              const_cast<char *>(log.c_str()), nullptr);
-        std::cerr << "build error(" << error << "): " << log << "\n";
-    }
-}
-
-static cl_program make_program(const char *kernel_source, cl_context context, cl_device_id device)
-{
-    auto error = 0;
-    auto program = clCreateProgramWithSource(context, 1, &kernel_source, nullptr, nullptr);
-
-    error = clBuildProgram(program, 0, nullptr, nullptr, nullptr, nullptr);
-    check_build_errors(error, program, device);
-
-    return program;
-}
-
-static std::vector<cl_platform_id> get_platforms()
-{
-    auto platformIdCount = 0U;
-    clGetPlatformIDs(0, nullptr, &platformIdCount);
-
-    auto platforms = std::vector<cl_platform_id>(platformIdCount);
-    clGetPlatformIDs(platformIdCount, platforms.data(), nullptr);
-
-    return platforms;
-}
-
-static cl_command_queue get_command_queue(cl_context context, cl_device_id device)
-{
-    auto error = 0;
-#ifdef __APPLE__
-    auto ret = clCreateCommandQueue(context, device, 0, &error);
-#else
-    auto ret = clCreateCommandQueueWithProperties(context, device, nullptr, &error);
 #endif
-    check_error(error, "clCreateCommandQueueWithProperties");
-    return ret;
-}
 
+#ifndef GRAVITY_NO_GL
 // Help from: http://sa10.idav.ucdavis.edu/docs/sa10-dg-opencl-gl-interop.pdf
 // Create CL context properties, add handle & share-group enum
 static cl_context_properties *get_shared_gl_properties(cl_platform_id platform)
@@ -215,143 +147,801 @@ static cl_context get_shared_gl_context(cl_platform_id platform, cl_device_id *d
     auto properties = get_shared_gl_properties(platform);
     return clCreateContext(properties, 1, device, nullptr, nullptr, error);
 }
+#endif
 
 static cl_context get_context(cl_device_id *device, cl_int *error)
 {
     return clCreateContext(nullptr, 1, device, nullptr, nullptr, error);
 }
 
-physics_cl::physics_cl(physics_gl &p, const std::string &prefered_platform,
-                       const std::string &preferred_device)
-    : pgl{p}
+physics_cl::physics_cl(PBodies &b, float dt, const std::string &prefered_platform,
+                       const std::string &preferred_device, unsigned int gl_positions_vbo,
+                       bool allow_zero_copy, const std::string &precision)
+    : platform{nullptr},
+      gl_positions{nullptr},
+      packed_positions{nullptr},
+      bodies4{nullptr, nullptr},
+      current{0},
+      hermite_acc{nullptr},
+      jerk{nullptr},
+      pred_pos{nullptr},
+      pred_vel{nullptr},
+      next_acc{nullptr},
+      next_jerk{nullptr},
+      last_event{nullptr},
+      gl_context{false},
+      zero_copy{false},
+      mode{kernel_mode::basic},
+      scheme{integrator_mode::euler},
+      primed{false},
+      bodies{b},
+      step_dt{dt},
+      positions_vbo{gl_positions_vbo}
 {
-    auto platforms = get_platforms();
-    if (platforms.empty())
-        throw std::runtime_error{"No OpenCL platforms found"};
-
-    for (auto &platform : platforms) {
-        auto platform_name = get_platform_name(platform);
-        if (platform_name.find(prefered_platform) != std::string::npos) {
-            this->platform = platform;
-            break;
-        }
-    }
-
-    // Otherwise just pick the first platform if we couldn't find preferred one
-    if (!platform)
-        platform = platforms[0];
-
+    platform = find_platform(prefered_platform);
     device = get_best_device(platform, preferred_device);
 
     std::cout << "using " << get_device_name(device) << '\n';
 
     auto error = 0;
-    if (cl_gl_compatibility(device)) {
+#ifndef GRAVITY_NO_GL
+    if (positions_vbo != 0 && cl_gl_compatibility(device)) {
         context = get_shared_gl_context(platform, &device, &error);
         gl_context = !check_error(error, "failed to use shared OpenGL buffer");
     }
+#endif
 
     if (!gl_context) {
         context = get_context(&device, &error);
         throw_error_info(error, "OpenCL context creation failed");
     }
 
+#ifdef GRAVITY_PROFILE
+    queue = get_command_queue(context, device, true);
+#else
     queue = get_command_queue(context, device);
+#endif
+
+    auto options = std::string{};
+    if (precision == "mixed") {
+        if (!is_extension_supported("cl_khr_fp64", device))
+            throw std::runtime_error{"mixed precision needs a device with cl_khr_fp64"};
+        options = "-DACCUM_DOUBLE";
+        std::cout << "summing forces in double" << std::endl;
+    } else if (precision != "float") {
+        throw std::runtime_error{"OpenCL supports float and mixed precision, not " + precision};
+    }
 
     auto kernel_source = read_file("res/physics.cl");
-    program = make_program(kernel_source.c_str(), context, device);
+    program = make_program(kernel_source.c_str(), context, device, options.c_str());
 
     apply_gravity_kernel = clCreateKernel(program, "apply_gravity", &error);
     throw_error_info(error, "apply_gravity kernel creation");
+    tiled_kernel = clCreateKernel(program, "apply_gravity_tiled", &error);
+    throw_error_info(error, "apply_gravity_tiled kernel creation");
     update_kernel = clCreateKernel(program, "update_positions", &error);
     throw_error_info(error, "update_positions kernel creation");
+    gravity4_kernel = clCreateKernel(program, "apply_gravity4", &error);
+    throw_error_info(error, "apply_gravity4 kernel creation");
+    update4_kernel = clCreateKernel(program, "update_positions4", &error);
+    throw_error_info(error, "update_positions4 kernel creation");
+    for (auto &kernel : fused_kernels) {
+        kernel = clCreateKernel(program, "step_fused", &error);
+        throw_error_info(error, "step_fused kernel creation");
+    }
+    pack_bodies_kernel = clCreateKernel(program, "pack_bodies", &error);
+    throw_error_info(error, "pack_bodies kernel creation");
+    unpack_bodies_kernel = clCreateKernel(program, "unpack_bodies", &error);
+    throw_error_info(error, "unpack_bodies kernel creation");
+    pack_kernel = clCreateKernel(program, "pack_positions", &error);
+    throw_error_info(error, "pack_positions kernel creation");
+    pack4_kernel = clCreateKernel(program, "pack_positions4", &error);
+    throw_error_info(error, "pack_positions4 kernel creation");
+    kick_kernel = clCreateKernel(program, "kick", &error);
+    throw_error_info(error, "kick kernel creation");
+    drift_kernel = clCreateKernel(program, "drift", &error);
+    throw_error_info(error, "drift kernel creation");
+    kick4_kernel = clCreateKernel(program, "kick4", &error);
+    throw_error_info(error, "kick4 kernel creation");
+    drift4_kernel = clCreateKernel(program, "drift4", &error);
+    throw_error_info(error, "drift4 kernel creation");
+    for (auto &kernel : hermite_force_kernels) {
+        kernel = clCreateKernel(program, "hermite_force", &error);
+        throw_error_info(error, "hermite_force kernel creation");
+    }
+    for (auto &kernel : hermite_tiled_kernels) {
+        kernel = clCreateKernel(program, "hermite_force_tiled", &error);
+        throw_error_info(error, "hermite_force_tiled kernel creation");
+    }
+    hermite_predict_kernel = clCreateKernel(program, "hermite_predict", &error);
+    throw_error_info(error, "hermite_predict kernel creation");
+    hermite_correct_kernel = clCreateKernel(program, "hermite_correct", &error);
+    throw_error_info(error, "hermite_correct kernel creation");
 
+    zero_copy = allow_zero_copy && supports_zero_copy();
+    if (zero_copy)
+        std::cout << "using zero-copy buffers" << std::endl;
     make_buffers();
 
-    global_dimensions[0] = p.num_particles;
+    // Padding bodies have no mass, so it is cheaper to simulate them than to bounds check
+    global_dimensions[0] = bodies.padded_size();
     global_dimensions[1] = 0;
     global_dimensions[2] = 0;
+    packed_dimensions[0] = bodies.size();
+    packed_dimensions[1] = 0;
+    packed_dimensions[2] = 0;
+    local_dimensions[0] = 0;
+    bind_arguments();
 }
 
 physics_cl::~physics_cl()
 {
+    sync();
+    unmap_host();
+    clFinish(queue);
     clReleaseMemObject(input_pos);
     clReleaseMemObject(input_vel);
     clReleaseMemObject(input_acc);
     clReleaseMemObject(input_mass);
+    clReleaseMemObject(bodies4[0]);
+    clReleaseMemObject(bodies4[1]);
+    clReleaseMemObject(vel4);
+    clReleaseMemObject(acc4);
+    if (gl_positions)
+        clReleaseMemObject(gl_positions);
+    if (packed_positions)
+        clReleaseMemObject(packed_positions);
+    if (jerk) {
+        for (auto buffer : {hermite_acc, jerk, pred_pos, pred_vel, next_acc, next_jerk})
+            clReleaseMemObject(buffer);
+    }
     clReleaseProgram(program);
     clReleaseKernel(apply_gravity_kernel);
+    clReleaseKernel(tiled_kernel);
     clReleaseKernel(update_kernel);
+    clReleaseKernel(gravity4_kernel);
+    clReleaseKernel(update4_kernel);
+    for (auto &kernel : fused_kernels)
+        clReleaseKernel(kernel);
+    clReleaseKernel(pack_bodies_kernel);
+    clReleaseKernel(unpack_bodies_kernel);
+    clReleaseKernel(pack_kernel);
+    clReleaseKernel(pack4_kernel);
+    clReleaseKernel(kick_kernel);
+    clReleaseKernel(drift_kernel);
+    clReleaseKernel(kick4_kernel);
+    clReleaseKernel(drift4_kernel);
+    for (auto &kernel : hermite_force_kernels)
+        clReleaseKernel(kernel);
+    for (auto &kernel : hermite_tiled_kernels)
+        clReleaseKernel(kernel);
+    clReleaseKernel(hermite_predict_kernel);
+    clReleaseKernel(hermite_correct_kernel);
     clReleaseCommandQueue(queue);
     clReleaseContext(context);
 };
 
+// CPU devices, and GPUs sharing the host's memory, can work on the PBodies arrays in place as long
+// as those are aligned the way the device wants its buffers
+bool physics_cl::supports_zero_copy()
+{
+    auto type = cl_device_type{0};
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, nullptr);
+    auto unified = cl_bool{CL_FALSE};
+    clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, nullptr);
+    if (!(type & CL_DEVICE_TYPE_CPU) && !unified)
+        return false;
+
+    auto alignment_bits = cl_uint{0};
+    clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(alignment_bits),
+                    &alignment_bits, nullptr);
+    auto alignment = std::max<uintptr_t>(alignment_bits / 8, 1);
+    for (auto p : {bodies.pos.x(), bodies.vel.x(), bodies.acc.x(), bodies.mass.data()}) {
+        if (reinterpret_cast<uintptr_t>(p) % alignment != 0)
+            return false;
+    }
+    return true;
+}
+
 void physics_cl::make_buffers()
 {
-    auto size = pgl.num_particles;
     auto error = 0;
-    auto vec_size = sizeof(glm::vec3) * size;
+    auto vec_size = bodies.pos.data.size() * sizeof(float);
+    auto mass_size = bodies.mass.size() * sizeof(float);
+    // Zero-copy buffers wrap the PBodies arrays, so there is nothing to upload. The float4
+    // buffers have no host copy, but are still best kept in host memory.
+    auto host_flag = zero_copy ? CL_MEM_USE_HOST_PTR : 0;
+    auto scratch_flag = zero_copy ? CL_MEM_ALLOC_HOST_PTR : 0;
+    auto host_ptr = [this](void *p) { return zero_copy ? p : nullptr; };
+    if (zero_copy)
+        std::fill(bodies.acc.data.begin(), bodies.acc.data.end(), 0.0f);
+#ifndef GRAVITY_NO_GL
     // Map the OpenGL VBO memory to this OpenCL context if it is a GL context
     if (gl_context) {
-        input_pos = clCreateFromGLBuffer(context, CL_MEM_READ_ONLY, pgl.positions_vbo, &error);
+        gl_positions = clCreateFromGLBuffer(context, CL_MEM_WRITE_ONLY, positions_vbo, &error);
         throw_error_info(error, "failed to get OpenGL shared memory object");
         std::cout << "using shared OpenGL buffer" << std::endl;
-    } else {
-        // Need to update these positions each frame if its not shared by OpenGL
-        input_pos = clCreateBuffer(context, CL_MEM_READ_ONLY, vec_size, nullptr, &error);
-        throw_error_info(error, "gpu memory allocation failed");
-        clEnqueueWriteBuffer(queue, input_pos, CL_FALSE, 0, vec_size, pgl.bodies.pos.data(), 0,
-                             nullptr, nullptr);
     }
+#endif
 
-    input_vel = clCreateBuffer(context, CL_MEM_READ_ONLY, vec_size, nullptr, &error);
+    input_pos = clCreateBuffer(context, CL_MEM_READ_WRITE | host_flag, vec_size,
+                               host_ptr(bodies.pos.data.data()), &error);
     throw_error_info(error, "gpu memory allocation failed");
-    input_acc = clCreateBuffer(context, CL_MEM_READ_ONLY, vec_size, nullptr, &error);
+    input_vel = clCreateBuffer(context, CL_MEM_READ_WRITE | host_flag, vec_size,
+                               host_ptr(bodies.vel.data.data()), &error);
     throw_error_info(error, "gpu memory allocation failed");
-    input_mass = clCreateBuffer(context, CL_MEM_READ_ONLY, size * sizeof(float), nullptr, &error);
+    input_acc = clCreateBuffer(context, CL_MEM_READ_WRITE | host_flag, vec_size,
+                               host_ptr(bodies.acc.data.data()), &error);
     throw_error_info(error, "gpu memory allocation failed");
-    input_dt = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float), nullptr, &error);
+    input_mass = clCreateBuffer(context, CL_MEM_READ_ONLY | host_flag, mass_size,
+                                host_ptr(bodies.mass.data()), &error);
     throw_error_info(error, "gpu memory allocation failed");
 
-    error = clEnqueueWriteBuffer(queue, input_vel, CL_FALSE, 0, vec_size, pgl.bodies.vel.data(), 0,
-                                 nullptr, nullptr);
-    throw_error_info(error, "failed to write to gpu memory");
-    error = clEnqueueWriteBuffer(queue, input_acc, CL_FALSE, 0, vec_size, pgl.bodies.acc.data(), 0,
-                                 nullptr, nullptr);
+    auto float4_size = bodies.padded_size() * sizeof(cl_float4);
+    for (auto &buffer : bodies4) {
+        buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | scratch_flag, float4_size, nullptr,
+                                &error);
+        throw_error_info(error, "gpu memory allocation failed");
+    }
+    vel4 = clCreateBuffer(context, CL_MEM_READ_WRITE | scratch_flag, float4_size, nullptr,
+                          &error);
+    throw_error_info(error, "gpu memory allocation failed");
+    acc4 = clCreateBuffer(context, CL_MEM_READ_WRITE | scratch_flag, float4_size, nullptr,
+                          &error);
+    throw_error_info(error, "gpu memory allocation failed");
+
+    if (!zero_copy)
+        upload(bodies.pos.data.data(), bodies.vel.data.data(), bodies.mass.data());
+}
+
+// Zero-copy buffers are handed to the host by mapping them, which on shared memory devices
+// returns the PBodies arrays themselves without copying. They stay mapped until the next
+// command that needs them is queued.
+void *physics_cl::map_for_host(cl_mem buffer, cl_map_flags flags, size_t bytes)
+{
+    auto error = 0;
+    auto p = clEnqueueMapBuffer(queue, buffer, CL_TRUE, flags, 0, bytes, 0, nullptr, nullptr,
+                                &error);
+    throw_error_info(error, "failed to map buffer");
+    host_mappings.emplace_back(buffer, p);
+    return p;
+}
+
+void physics_cl::unmap_host()
+{
+    for (auto &mapping : host_mappings) {
+        auto error = clEnqueueUnmapMemObject(queue, mapping.first, mapping.second, 0, nullptr,
+                                             nullptr);
+        check_error(error, "failed to unmap buffer");
+    }
+    host_mappings.clear();
+}
+
+// The SoA arrays are uploaded as they are, one copy per field, and the accelerations cleared
+void physics_cl::upload(const float *pos, const float *vel, const float *mass)
+{
+    auto error = 0;
+    auto vec_size = bodies.pos.data.size() * sizeof(float);
+    auto mass_size = bodies.mass.size() * sizeof(float);
+    if (zero_copy) {
+        std::memcpy(map_for_host(input_pos, CL_MAP_WRITE_INVALIDATE_REGION, vec_size), pos,
+                    vec_size);
+        std::memcpy(map_for_host(input_vel, CL_MAP_WRITE_INVALIDATE_REGION, vec_size), vel,
+                    vec_size);
+        std::memcpy(map_for_host(input_mass, CL_MAP_WRITE_INVALIDATE_REGION, mass_size), mass,
+                    mass_size);
+        std::memset(map_for_host(input_acc, CL_MAP_WRITE_INVALIDATE_REGION, vec_size), 0,
+                    vec_size);
+        unmap_host();
+        clFinish(queue);
+        return;
+    }
+    error = clEnqueueWriteBuffer(queue, input_pos, CL_FALSE, 0, vec_size, pos, 0, nullptr,
+                                 nullptr);
     throw_error_info(error, "failed to write to gpu memory");
-    error = clEnqueueWriteBuffer(queue, input_mass, CL_FALSE, 0, size * sizeof(float),
-                                 pgl.bodies.mass.data(), 0, nullptr, nullptr);
+    error = clEnqueueWriteBuffer(queue, input_vel, CL_FALSE, 0, vec_size, vel, 0, nullptr,
+                                 nullptr);
     throw_error_info(error, "failed to write to gpu memory");
-    error = clEnqueueWriteBuffer(queue, input_dt, CL_FALSE, 0, sizeof(float), &pgl.step_dt, 0,
-                                 nullptr, nullptr);
+    error = clEnqueueWriteBuffer(queue, input_mass, CL_FALSE, 0, mass_size, mass, 0, nullptr,
+                                 nullptr);
     throw_error_info(error, "failed to write to gpu memory");
+    auto zero = 0.0f;
+    error = clEnqueueFillBuffer(queue, input_acc, &zero, sizeof(zero), 0, vec_size, 0, nullptr,
+                                nullptr);
+    throw_error_info(error, "failed to clear gpu memory");
     clFinish(queue);
 }
 
-void physics_cl::apply_gravity()
+void physics_cl::load_snapshot(const snapshot_file &file)
+{
+    auto &header = file.header();
+    if (header.count != static_cast<uint64_t>(bodies.size()) ||
+        header.stride != static_cast<uint64_t>(bodies.padded_size()))
+        throw std::runtime_error{"snapshot holds " + std::to_string(header.count) +
+                                 " bodies, not " + std::to_string(bodies.size())};
+
+    // Straight from the mapped file to the device. Positions and velocities reach the host copy
+    // through write_position_data and write_velocity_data as usual, and are already there with
+    // zero-copy buffers. Masses and colors never change, so the host gets them right away.
+    sync();
+    upload(file.positions(), file.velocities(), file.masses());
+    if (!zero_copy)
+        std::memcpy(bodies.mass.data(), file.masses(), bodies.mass.size() * sizeof(float));
+    std::memcpy(static_cast<void *>(bodies.color.data()), file.colors(),
+                bodies.color.size() * sizeof(glm::vec3));
+    primed = false;
+    if (uses_float4()) {
+        pack_float4();
+        sync();
+    }
+}
+
+void physics_cl::use_kernel(const std::string &name, size_t work_group_size)
+{
+    auto next = kernel_mode::basic;
+    auto sizing_kernel = tiled_kernel;
+    if (name == "tiled") {
+        next = kernel_mode::tiled;
+    } else if (name == "float4") {
+        next = kernel_mode::float4;
+        sizing_kernel = gravity4_kernel;
+    } else if (name == "fused") {
+        next = kernel_mode::fused;
+        sizing_kernel = fused_kernels[0];
+    } else if (name != "basic") {
+        throw std::runtime_error{"unknown OpenCL kernel: " + name};
+    }
+    check_integrator(next, scheme);
+
+    // Move the current state over to the layout the new kernels work on
+    if (uses_float4())
+        unpack_float4();
+    mode = next;
+    current = 0;
+    primed = false;
+    if (uses_float4())
+        pack_float4();
+    sync();
+    if (mode == kernel_mode::basic)
+        return;
+
+    auto max_size = size_t{0};
+    clGetKernelWorkGroupInfo(sizing_kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_size),
+                             &max_size, nullptr);
+    // The tiled Hermite force shares the work-group size, whichever integrator runs later
+    if (next == kernel_mode::tiled) {
+        auto hermite_size = size_t{0};
+        clGetKernelWorkGroupInfo(hermite_tiled_kernels[0], device, CL_KERNEL_WORK_GROUP_SIZE,
+                                 sizeof(hermite_size), &hermite_size, nullptr);
+        max_size = std::min(max_size, hermite_size);
+    }
+    if (work_group_size == 0)
+        work_group_size = std::min(DEFAULT_WORK_GROUP_SIZE, max_size);
+    if (work_group_size > max_size)
+        throw std::runtime_error{"work-group size larger than the device maximum of " +
+                                 std::to_string(max_size)};
+
+    // Every work-item has to take part in loading tiles, so round the global size up and let
+    // the kernel ignore the extra items
+    auto padded = static_cast<size_t>(bodies.padded_size());
+    tiled_dimensions[0] = (padded + work_group_size - 1) / work_group_size * work_group_size;
+    tiled_dimensions[1] = 0;
+    tiled_dimensions[2] = 0;
+    local_dimensions[0] = work_group_size;
+    local_dimensions[1] = 0;
+    local_dimensions[2] = 0;
+    bind_arguments();
+    std::cout << "using " << name << " kernel, work-group size " << work_group_size << '\n';
+}
+
+void physics_cl::use_integrator(const std::string &name)
+{
+    auto next = integrator_mode::euler;
+    auto next_weights = symplectic_weights(name);
+    if (name == "hermite")
+        next = integrator_mode::hermite;
+    else if (!next_weights.empty())
+        next = integrator_mode::symplectic;
+    else if (name != "euler")
+        throw std::runtime_error{"unknown integrator: " + name};
+    check_integrator(mode, next);
+
+    scheme = next;
+    weights = std::move(next_weights);
+    primed = false;
+    if (scheme == integrator_mode::hermite)
+        make_hermite_buffers();
+    // A symplectic step leaves its last acceleration in the planar acc, which apply_gravity
+    // would add to
+    if (!uses_float4())
+        enqueue_kick(0.0f, true);
+    sync();
+    std::cout << "using " << name << " integrator\n";
+}
+
+void physics_cl::check_integrator(kernel_mode kernels, integrator_mode integration)
+{
+    if (kernels == kernel_mode::fused && integration != integrator_mode::euler)
+        throw std::runtime_error{"the fused kernel only supports the euler integrator"};
+    if (integration == integrator_mode::hermite &&
+        (kernels == kernel_mode::float4 || kernels == kernel_mode::fused))
+        throw std::runtime_error{"the hermite integrator needs the basic or tiled kernel"};
+}
+
+void physics_cl::make_hermite_buffers()
+{
+    if (jerk)
+        return;
+    auto error = 0;
+    auto vec_size = bodies.pos.data.size() * sizeof(float);
+    auto scratch_flag = zero_copy ? CL_MEM_ALLOC_HOST_PTR : 0;
+    for (auto buffer : {&hermite_acc, &jerk, &pred_pos, &pred_vel, &next_acc, &next_jerk}) {
+        *buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | scratch_flag, vec_size, nullptr,
+                                 &error);
+        throw_error_info(error, "gpu memory allocation failed");
+    }
+    bind_arguments();
+}
+
+// Kernel arguments are captured when a kernel is enqueued, so everything the step kernels use is
+// set here once. float4 mode always runs on bodies4[0]; fused mode alternates between the two
+// step_fused kernels, each bound to read one body buffer and write the other.
+void physics_cl::bind_arguments()
 {
+    auto n = bodies.padded_size();
     clSetKernelArg(apply_gravity_kernel, 0, sizeof(input_pos), &input_pos);
     clSetKernelArg(apply_gravity_kernel, 1, sizeof(input_vel), &input_vel);
     clSetKernelArg(apply_gravity_kernel, 2, sizeof(input_acc), &input_acc);
     clSetKernelArg(apply_gravity_kernel, 3, sizeof(input_mass), &input_mass);
 
-    // Enqueue our problem to actually be executed by the device
-    clEnqueueNDRangeKernel(queue, apply_gravity_kernel, 1, nullptr, global_dimensions, nullptr, 0,
-                           nullptr, nullptr);
-    clFinish(queue);
+    clSetKernelArg(update_kernel, 0, sizeof(input_pos), &input_pos);
+    clSetKernelArg(update_kernel, 1, sizeof(input_vel), &input_vel);
+    clSetKernelArg(update_kernel, 2, sizeof(input_acc), &input_acc);
+    clSetKernelArg(update_kernel, 3, sizeof(step_dt), &step_dt);
+
+    clSetKernelArg(update4_kernel, 0, sizeof(cl_mem), &bodies4[0]);
+    clSetKernelArg(update4_kernel, 1, sizeof(vel4), &vel4);
+    clSetKernelArg(update4_kernel, 2, sizeof(acc4), &acc4);
+    clSetKernelArg(update4_kernel, 3, sizeof(step_dt), &step_dt);
+
+    auto packed = gl_context ? gl_positions : packed_positions;
+    if (packed) {
+        clSetKernelArg(pack_kernel, 0, sizeof(input_pos), &input_pos);
+        clSetKernelArg(pack_kernel, 1, sizeof(packed), &packed);
+        clSetKernelArg(pack_kernel, 2, sizeof(n), &n);
+        clSetKernelArg(pack4_kernel, 1, sizeof(packed), &packed);
+    }
+
+    // The step lengths of kick and drift are set per launch
+    clSetKernelArg(kick_kernel, 0, sizeof(input_vel), &input_vel);
+    clSetKernelArg(kick_kernel, 1, sizeof(input_acc), &input_acc);
+    clSetKernelArg(drift_kernel, 0, sizeof(input_pos), &input_pos);
+    clSetKernelArg(drift_kernel, 1, sizeof(input_vel), &input_vel);
+    clSetKernelArg(kick4_kernel, 0, sizeof(vel4), &vel4);
+    clSetKernelArg(kick4_kernel, 1, sizeof(acc4), &acc4);
+    clSetKernelArg(drift4_kernel, 0, sizeof(cl_mem), &bodies4[0]);
+    clSetKernelArg(drift4_kernel, 1, sizeof(vel4), &vel4);
+
+    if (jerk) {
+        cl_mem force_args[2][5] = {{input_pos, input_vel, input_mass, hermite_acc, jerk},
+                                   {pred_pos, pred_vel, input_mass, next_acc, next_jerk}};
+        for (auto i = 0; i < 2; i++) {
+            for (auto arg = 0; arg < 5; arg++)
+                clSetKernelArg(hermite_force_kernels[i], arg, sizeof(cl_mem), &force_args[i][arg]);
+        }
+        // hermite_predict takes the first six of hermite_correct's buffers
+        cl_mem correct_args[] = {input_pos, input_vel, hermite_acc, jerk,
+                                 pred_pos,  pred_vel,  next_acc,    next_jerk};
+        for (auto arg = 0; arg < 6; arg++)
+            clSetKernelArg(hermite_predict_kernel, arg, sizeof(cl_mem), &correct_args[arg]);
+        clSetKernelArg(hermite_predict_kernel, 6, sizeof(step_dt), &step_dt);
+        for (auto arg = 0; arg < 8; arg++)
+            clSetKernelArg(hermite_correct_kernel, arg, sizeof(cl_mem), &correct_args[arg]);
+        clSetKernelArg(hermite_correct_kernel, 8, sizeof(step_dt), &step_dt);
+    }
+
+    clSetKernelArg(pack_bodies_kernel, 0, sizeof(input_pos), &input_pos);
+    clSetKernelArg(pack_bodies_kernel, 1, sizeof(input_vel), &input_vel);
+    clSetKernelArg(pack_bodies_kernel, 2, sizeof(input_mass), &input_mass);
+    clSetKernelArg(pack_bodies_kernel, 4, sizeof(vel4), &vel4);
+    clSetKernelArg(unpack_bodies_kernel, 1, sizeof(vel4), &vel4);
+    clSetKernelArg(unpack_bodies_kernel, 2, sizeof(input_pos), &input_pos);
+    clSetKernelArg(unpack_bodies_kernel, 3, sizeof(input_vel), &input_vel);
+
+    // The local memory tiles depend on the work-group size, which use_kernel picks
+    if (local_dimensions[0] == 0)
+        return;
+    auto tile_bytes = local_dimensions[0] * sizeof(cl_float4);
+
+    clSetKernelArg(tiled_kernel, 0, sizeof(input_pos), &input_pos);
+    clSetKernelArg(tiled_kernel, 1, sizeof(input_acc), &input_acc);
+    clSetKernelArg(tiled_kernel, 2, sizeof(input_mass), &input_mass);
+    clSetKernelArg(tiled_kernel, 3, tile_bytes, nullptr);
+    clSetKernelArg(tiled_kernel, 4, sizeof(n), &n);
+
+    clSetKernelArg(gravity4_kernel, 0, sizeof(cl_mem), &bodies4[0]);
+    clSetKernelArg(gravity4_kernel, 1, sizeof(acc4), &acc4);
+    clSetKernelArg(gravity4_kernel, 2, tile_bytes, nullptr);
+    clSetKernelArg(gravity4_kernel, 3, sizeof(n), &n);
+
+    if (jerk) {
+        cl_mem force_args[2][5] = {{input_pos, input_vel, input_mass, hermite_acc, jerk},
+                                   {pred_pos, pred_vel, input_mass, next_acc, next_jerk}};
+        for (auto i = 0; i < 2; i++) {
+            auto kernel = hermite_tiled_kernels[i];
+            for (auto arg = 0; arg < 5; arg++)
+                clSetKernelArg(kernel, arg, sizeof(cl_mem), &force_args[i][arg]);
+            clSetKernelArg(kernel, 5, tile_bytes, nullptr);
+            clSetKernelArg(kernel, 6, tile_bytes, nullptr);
+            clSetKernelArg(kernel, 7, sizeof(n), &n);
+        }
+    }
+
+    for (auto i = 0; i < 2; i++) {
+        auto kernel = fused_kernels[i];
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), &bodies4[i]);
+        clSetKernelArg(kernel, 1, sizeof(cl_mem), &bodies4[1 - i]);
+        clSetKernelArg(kernel, 2, sizeof(vel4), &vel4);
+        clSetKernelArg(kernel, 3, tile_bytes, nullptr);
+        clSetKernelArg(kernel, 4, sizeof(step_dt), &step_dt);
+        clSetKernelArg(kernel, 5, sizeof(n), &n);
+    }
 }
 
-void physics_cl::update_positions()
+bool physics_cl::uses_float4() const
 {
-    clSetKernelArg(update_kernel, 0, sizeof(float *), &input_pos);
-    clSetKernelArg(update_kernel, 1, sizeof(float *), &input_vel);
-    clSetKernelArg(update_kernel, 2, sizeof(float *), &input_acc);
-    clSetKernelArg(update_kernel, 3, sizeof(float *), &input_dt);
+    return mode == kernel_mode::float4 || mode == kernel_mode::fused;
+}
 
-    // Enqueue our problem to actually be executed by the device
-    clEnqueueNDRangeKernel(queue, update_kernel, 1, nullptr, global_dimensions, nullptr, 0, nullptr,
-                           nullptr);
-    clFinish(queue);
+// Each launch waits on the one before it and becomes the new last_event, so a whole batch of
+// steps is queued without the host waiting in between
+void physics_cl::enqueue(cl_kernel kernel, const size_t *global, const size_t *local)
+{
+    unmap_host();
+    auto event = cl_event{nullptr};
+    auto wait_count = last_event ? 1U : 0U;
+    auto error = clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, global, local, wait_count,
+                                        last_event ? &last_event : nullptr, &event);
+    throw_error_info(error, "failed to enqueue kernel");
+    if (last_event)
+        clReleaseEvent(last_event);
+    last_event = event;
+#ifdef GRAVITY_PROFILE
+    clRetainEvent(event);
+    launches.push_back({kernel, event, profiler::now()});
+    if (launches.size() >= MAX_PROFILED_LAUNCHES)
+        collect_profile(MAX_PROFILED_LAUNCHES / 2);
+#endif
+}
+
+#ifdef GRAVITY_PROFILE
+// Device timestamps run on their own clock. A launch is queued on the device when the host
+// enqueues it, which gives the offset that lines the device track up with the host's. The last
+// keep launches are left pending so the device does not run out of work.
+void physics_cl::collect_profile(size_t keep)
+{
+    if (launches.size() <= keep)
+        return;
+    auto count = launches.size() - keep;
+    clWaitForEvents(1, &launches[count - 1].event);
+
+    for (size_t i = 0; i < count; i++) {
+        auto &launch = launches[i];
+        cl_ulong queued = 0, start = 0, end = 0;
+        clGetEventProfilingInfo(launch.event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued),
+                                &queued, nullptr);
+        clGetEventProfilingInfo(launch.event, CL_PROFILING_COMMAND_START, sizeof(start), &start,
+                                nullptr);
+        clGetEventProfilingInfo(launch.event, CL_PROFILING_COMMAND_END, sizeof(end), &end,
+                                nullptr);
+        auto offset = launch.enqueued - static_cast<int64_t>(queued);
+        profiler::instance().record_device(kernel_name(launch.kernel),
+                                           static_cast<int64_t>(start) + offset,
+                                           static_cast<int64_t>(end) + offset);
+        clReleaseEvent(launch.event);
+    }
+    launches.erase(launches.begin(), launches.begin() + count);
+}
+
+const char *physics_cl::kernel_name(cl_kernel kernel)
+{
+    auto found = kernel_names.find(kernel);
+    if (found != kernel_names.end())
+        return found->second;
+
+    char name[256] = {};
+    clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name) - 1, name, nullptr);
+    auto interned = profiler::instance().intern(name);
+    kernel_names[kernel] = interned;
+    return interned;
+}
+#endif
+
+// The conversion kernels run rarely, so their body buffer is set per call rather than bound
+void physics_cl::pack_float4()
+{
+    clSetKernelArg(pack_bodies_kernel, 3, sizeof(cl_mem), &bodies4[current]);
+    enqueue(pack_bodies_kernel, global_dimensions, nullptr);
+}
+
+void physics_cl::unpack_float4()
+{
+    clSetKernelArg(unpack_bodies_kernel, 0, sizeof(cl_mem), &bodies4[current]);
+    enqueue(unpack_bodies_kernel, global_dimensions, nullptr);
+}
+
+void physics_cl::step(int substeps)
+{
+    PROFILE_SCOPE("cl_enqueue_step");
+    for (auto i = 0; i < substeps; i++) {
+        switch (scheme) {
+        case integrator_mode::euler:
+            step_euler();
+            break;
+        case integrator_mode::symplectic:
+            step_symplectic();
+            break;
+        case integrator_mode::hermite:
+            step_hermite();
+            break;
+        }
+    }
+
+    // OpenGL wants interleaved positions, write them straight into the shared VBO. Only the
+    // last substep is displayed, so this runs once per batch.
+    if (gl_context)
+        enqueue_pack();
+
+    // Start the device on the batch without waiting for it
+    clFlush(queue);
+}
+
+// Planar accelerations are accumulated, so they are cleared by the kick before, while the
+// float4 kernel overwrites them
+void physics_cl::enqueue_force()
+{
+    switch (mode) {
+    case kernel_mode::basic:
+        enqueue(apply_gravity_kernel, global_dimensions, nullptr);
+        break;
+    case kernel_mode::tiled:
+        enqueue(tiled_kernel, tiled_dimensions, local_dimensions);
+        break;
+    case kernel_mode::float4:
+    case kernel_mode::fused:
+        enqueue(gravity4_kernel, tiled_dimensions, local_dimensions);
+        break;
+    }
+}
+
+void physics_cl::enqueue_kick(float dt, bool clear)
+{
+    if (uses_float4()) {
+        clSetKernelArg(kick4_kernel, 2, sizeof(dt), &dt);
+        enqueue(kick4_kernel, global_dimensions, nullptr);
+        return;
+    }
+    auto clear_flag = cl_int{clear};
+    clSetKernelArg(kick_kernel, 2, sizeof(dt), &dt);
+    clSetKernelArg(kick_kernel, 3, sizeof(clear_flag), &clear_flag);
+    enqueue(kick_kernel, global_dimensions, nullptr);
+}
+
+void physics_cl::enqueue_drift(float dt)
+{
+    auto kernel = uses_float4() ? drift4_kernel : drift_kernel;
+    clSetKernelArg(kernel, 2, sizeof(dt), &dt);
+    enqueue(kernel, global_dimensions, nullptr);
+}
+
+void physics_cl::step_euler()
+{
+    switch (mode) {
+    case kernel_mode::basic:
+    case kernel_mode::tiled:
+        enqueue_force();
+        enqueue(update_kernel, global_dimensions, nullptr);
+        break;
+    case kernel_mode::float4:
+        enqueue_force();
+        enqueue(update4_kernel, global_dimensions, nullptr);
+        break;
+    case kernel_mode::fused:
+        enqueue(fused_kernels[current], tiled_dimensions, local_dimensions);
+        current = 1 - current;
+        break;
+    }
+}
+
+// The same composition as symplectic_integrator: the last kick keeps its acceleration for the
+// first kick of the next step
+void physics_cl::step_symplectic()
+{
+    if (!primed) {
+        enqueue_kick(0.0f, true);
+        enqueue_force();
+        primed = true;
+    }
+    auto count = weights.size();
+    enqueue_kick(0.5f * weights[0] * step_dt, true);
+    for (size_t k = 0; k < count; k++) {
+        enqueue_drift(weights[k] * step_dt);
+        enqueue_force();
+        auto last = k + 1 == count;
+        auto next = last ? 0.0f : weights[k + 1];
+        enqueue_kick(0.5f * (weights[k] + next) * step_dt, !last);
+    }
+}
+
+void physics_cl::step_hermite()
+{
+    auto force = [this](int state) {
+        if (mode == kernel_mode::tiled)
+            enqueue(hermite_tiled_kernels[state], tiled_dimensions, local_dimensions);
+        else
+            enqueue(hermite_force_kernels[state], global_dimensions, nullptr);
+    };
+    if (!primed) {
+        force(0);
+        primed = true;
+    }
+    enqueue(hermite_predict_kernel, global_dimensions, nullptr);
+    force(1);
+    enqueue(hermite_correct_kernel, global_dimensions, nullptr);
+}
+
+void physics_cl::enqueue_pack()
+{
+    if (uses_float4()) {
+        clSetKernelArg(pack4_kernel, 0, sizeof(cl_mem), &bodies4[current]);
+        enqueue(pack4_kernel, packed_dimensions, nullptr);
+    } else {
+        enqueue(pack_kernel, packed_dimensions, nullptr);
+    }
+}
+
+// One copy from the device into the caller's memory, instead of reading the planar positions
+// back and interleaving them on the host before handing them to OpenGL
+void physics_cl::read_packed_positions(glm::vec3 *out)
+{
+    PROFILE_SCOPE("cl_read_positions");
+    auto bytes = bodies.size() * sizeof(glm::vec3);
+    auto error = 0;
+    if (!packed_positions) {
+        packed_positions = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytes, nullptr, &error);
+        throw_error_info(error, "gpu memory allocation failed");
+        bind_arguments();
+    }
+    enqueue_pack();
+    sync();
+    error = clEnqueueReadBuffer(queue, packed_positions, CL_TRUE, 0, bytes, out, 0, nullptr,
+                                nullptr);
+    throw_error_info(error, "failed to read positions");
+}
+
+void physics_cl::sync()
+{
+    if (!last_event)
+        return;
+    {
+        PROFILE_SCOPE("cl_wait");
+        clWaitForEvents(1, &last_event);
+    }
+    clReleaseEvent(last_event);
+    last_event = nullptr;
+#ifdef GRAVITY_PROFILE
+    collect_profile(0);
+#endif
+}
+
+std::string physics_cl::platform_name()
+{
+    return get_platform_name(platform);
+}
+
+std::string physics_cl::device_name()
+{
+    return get_device_name(device);
 }
 
 // http://dhruba.name/2012/08/14/opencl-cookbook-listing-all-devices-and-their-critical-attributes/
@@ -405,25 +995,54 @@ void physics_cl::print_platform_info()
 
 void physics_cl::acquire_gl_object()
 {
+    PROFILE_SCOPE("acquire_gl_object");
+#ifndef GRAVITY_NO_GL
     glFlush();
-    auto err = clEnqueueAcquireGLObjects(queue, 1, &input_pos, 0, nullptr, nullptr);
+    auto err = clEnqueueAcquireGLObjects(queue, 1, &gl_positions, 0, nullptr, nullptr);
     throw_error_info(err, "clEnqueueAcquireGLObjects");
+#endif
 }
 
 void physics_cl::release_gl_object()
 {
-    auto err = clEnqueueReleaseGLObjects(queue, 1, &input_pos, 0, nullptr, nullptr);
+    PROFILE_SCOPE("release_gl_object");
+#ifndef GRAVITY_NO_GL
+    auto err = clEnqueueReleaseGLObjects(queue, 1, &gl_positions, 0, nullptr, nullptr);
     throw_error_info(err, "releasing GL objects");
+#endif
 }
 
 void physics_cl::finish()
 {
+    sync();
     clFinish(queue);
 }
 
+void physics_cl::write_velocity_data()
+{
+    if (uses_float4())
+        unpack_float4();
+    sync();
+    auto bytes = bodies.vel.data.size() * sizeof(float);
+    if (zero_copy) {
+        map_for_host(input_vel, CL_MAP_READ, bytes);
+        return;
+    }
+    auto data = bodies.vel.data.data();
+    clEnqueueReadBuffer(queue, input_vel, CL_TRUE, 0, bytes, data, 0, nullptr, nullptr);
+}
+
 void physics_cl::write_position_data()
 {
-    auto bytes = pgl.num_particles * sizeof(glm::vec3);
-    auto data = pgl.bodies.pos.data();
+    PROFILE_SCOPE("cl_read_positions");
+    if (uses_float4())
+        unpack_float4();
+    sync();
+    auto bytes = bodies.pos.data.size() * sizeof(float);
+    if (zero_copy) {
+        map_for_host(input_pos, CL_MAP_READ, bytes);
+        return;
+    }
+    auto data = bodies.pos.data.data();
     clEnqueueReadBuffer(queue, input_pos, CL_TRUE, 0, bytes, data, 0, nullptr, nullptr);
 }
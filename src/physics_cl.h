@@ -11,15 +11,27 @@
 #include <CL/cl.h>
 #endif
 
+#include <cstdint>
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
-#include "physics_gl.h"
+#include "pobject.h"
+#include "profiler.h"
+#include "snapshot.h"
 
 class physics_cl
 {
 public:
-    physics_cl(physics_gl &p, const std::string &prefered_platform,
-               const std::string &preferred_device);
+    // Pass the positions VBO of a physics_gl to share it with OpenCL when the device supports
+    // GL interop, or 0 to keep all buffers on the OpenCL side. On devices that share memory with
+    // the host the buffers are the PBodies arrays themselves, unless allow_zero_copy is false.
+    // precision "mixed" builds the kernels with ACCUM_DOUBLE, summing the forces on each body in
+    // double on devices with cl_khr_fp64; the bodies themselves stay float.
+    physics_cl(PBodies &b, float dt, const std::string &prefered_platform,
+               const std::string &preferred_device, unsigned int gl_positions_vbo = 0,
+               bool allow_zero_copy = true, const std::string &precision = "float");
     ~physics_cl();
 
     inline bool is_gl_context()
@@ -27,32 +39,155 @@ public:
         return gl_context;
     }
 
-    void apply_gravity();
-    void update_positions();
+    inline bool is_zero_copy()
+    {
+        return zero_copy;
+    }
+
+    // Bodies each work-group shares through local memory, 0 for the basic kernel
+    inline size_t tile_size()
+    {
+        return mode == kernel_mode::basic ? 0 : local_dimensions[0];
+    }
+
+    // Select the kernels used by step: "basic" reads every body from global memory, "tiled"
+    // stages tiles of work_group_size bodies in local memory. "float4" does the same on bodies
+    // packed as (x, y, z, mass), and "fused" also integrates in the same launch. 0 picks the
+    // largest work-group size the device allows, up to DEFAULT_WORK_GROUP_SIZE.
+    void use_kernel(const std::string &name, size_t work_group_size);
+
+    // Select how step advances the bodies: "euler" is the update after every force kernel,
+    // "leapfrog" and "yoshida4" compose kick and drift kernels around the force kernels, and
+    // "hermite" is a shared step 4th order Hermite scheme with its own force and jerk kernels,
+    // tiled through local memory when the tiled kernel is selected.
+    // The fused kernel only supports euler, hermite only the planar basic and tiled kernels.
+    void use_integrator(const std::string &name);
+
+    // Queue substeps steps of dt, then an update of the shared VBO when there is one. Returns
+    // as soon as the work is queued; call sync, finish or write_position_data to wait for it.
+    void step(int substeps = 1);
+    void sync();
+    // Read the positions back into the PBodies, waiting for any queued steps first. With zero-copy
+    // buffers this maps them instead, and the PBodies arrays must not be used once the next step
+    // is queued.
     void write_position_data();
+    // Same for the velocities, which only snapshots need
+    void write_velocity_data();
+    // Without GL sharing: interleave the positions on the device and read them into out, which
+    // holds size() vec3s, typically the mapped region from physics_gl::begin_positions_update
+    void read_packed_positions(glm::vec3 *out);
+    // Replace the state on the device with a snapshot of the same number of bodies
+    void load_snapshot(const snapshot_file &file);
     void finish();
     void acquire_gl_object();
     void release_gl_object();
     void print_platform_info();
-
-    friend class physics_gl;
+    std::string platform_name();
+    std::string device_name();
 
 private:
+    enum class kernel_mode
+    {
+        basic,
+        tiled,
+        float4,
+        fused
+    };
+
+    enum class integrator_mode
+    {
+        euler,
+        symplectic,
+        hermite
+    };
+
     cl_platform_id platform;
     cl_context context;
     cl_command_queue queue;
     cl_device_id device;
     cl_program program;
-    cl_mem input_pos, input_vel, input_acc, input_mass, input_dt;
-    cl_kernel apply_gravity_kernel, update_kernel;
-    size_t global_dimensions[3];
+    // Positions, velocities and accelerations use the PBodies layout: x, y and z planes of
+    // padded_size floats each. gl_positions is the interleaved OpenGL VBO when sharing with GL.
+    cl_mem input_pos, input_vel, input_acc, input_mass, gl_positions;
+    // Interleaved positions for read_packed_positions, made on its first call
+    cl_mem packed_positions;
+    // float4 copies of the bodies for the float4 and fused kernels. The planar buffers are only
+    // brought up to date when positions are read back. step_fused ping-pongs between
+    // bodies4[current] and bodies4[1 - current].
+    cl_mem bodies4[2], vel4, acc4;
+    int current;
+    // Hermite state, made when the integrator is first selected: acceleration and jerk (with G)
+    // at the start of the step, the predicted positions and velocities, and the acceleration
+    // and jerk evaluated there
+    cl_mem hermite_acc, jerk, pred_pos, pred_vel, next_acc, next_jerk;
+    // The most recently queued command, which every new command waits on
+    cl_event last_event;
+    // Zero-copy buffers currently mapped for the host, unmapped before the next kernel runs
+    std::vector<std::pair<cl_mem, void *>> host_mappings;
+#ifdef GRAVITY_PROFILE
+    // Launches whose device times have not been collected yet, with the host time they were
+    // enqueued at
+    struct profiled_launch {
+        cl_kernel kernel;
+        cl_event event;
+        int64_t enqueued;
+    };
+    std::vector<profiled_launch> launches;
+    std::map<cl_kernel, const char *> kernel_names;
+#endif
+    cl_kernel apply_gravity_kernel, tiled_kernel, update_kernel, pack_kernel;
+    cl_kernel gravity4_kernel, update4_kernel, fused_kernels[2], pack_bodies_kernel,
+        unpack_bodies_kernel, pack4_kernel;
+    cl_kernel kick_kernel, drift_kernel, kick4_kernel, drift4_kernel;
+    // hermite_force_kernels[0] evaluates the current state, [1] the predicted one, and the same
+    // for the local memory hermite_tiled_kernels
+    cl_kernel hermite_force_kernels[2], hermite_tiled_kernels[2], hermite_predict_kernel,
+        hermite_correct_kernel;
+    size_t global_dimensions[3], packed_dimensions[3];
+    size_t tiled_dimensions[3], local_dimensions[3];
     bool gl_context;
-    physics_gl &pgl;
+    bool zero_copy;
+    kernel_mode mode;
+    integrator_mode scheme;
+    // Drift weights of the symplectic scheme, see symplectic_weights
+    std::vector<float> weights;
+    // The symplectic or Hermite acceleration at the current positions is on the device
+    bool primed;
+    PBodies &bodies;
+    float step_dt;
+    unsigned int positions_vbo;
 
     void print_device_name(cl_device_id id);
     void print_platform_name(cl_platform_id id);
     void check_build_errors(cl_int error, cl_program program, cl_device_id deviceID);
+    bool supports_zero_copy();
     void make_buffers();
+    void *map_for_host(cl_mem buffer, cl_map_flags flags, size_t bytes);
+    void unmap_host();
+    void upload(const float *pos, const float *vel, const float *mass);
+    void bind_arguments();
+    void enqueue(cl_kernel kernel, const size_t *global, const size_t *local);
+    void enqueue_pack();
+    void pack_float4();
+    void unpack_float4();
+    bool uses_float4() const;
+    static void check_integrator(kernel_mode kernels, integrator_mode integration);
+    void make_hermite_buffers();
+    void enqueue_force();
+    void enqueue_kick(float dt, bool clear);
+    void enqueue_drift(float dt);
+    void step_euler();
+    void step_symplectic();
+    void step_hermite();
+#ifdef GRAVITY_PROFILE
+    void collect_profile(size_t keep);
+    const char *kernel_name(cl_kernel kernel);
+
+    // Long batches are collected in halves once this many launches are pending
+    static constexpr size_t MAX_PROFILED_LAUNCHES = 1024;
+#endif
+
+    static constexpr size_t DEFAULT_WORK_GROUP_SIZE = 256;
 };
 
 #endif  // GRAVITY_OPENCL_H
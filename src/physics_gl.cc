@@ -4,24 +4,55 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
-#include <random>
 
+#include <algorithm>
+
+#include "initial_conditions.h"
 #include "physics_gl.h"
+#include "profiler.h"
+
+physics_gl::physics_gl(int num_bodies, float dt, const ic_options &ic)
+    : ring_vbo{0},
+      ring{nullptr},
+      ring_fences{},
+      ring_write{0},
+      ring_draw{0},
+      ring_tried{false},
+      shader("res/simple_mesh.vs", "res/simple_mesh.fs"),
+      bodies(num_bodies)
+{
+    num_particles = num_bodies;
+    init_bodies(bodies, ic);
 
-physics_gl::physics_gl(int num_bodies, float dt)
-    : shader("res/simple_mesh.vs", "res/simple_mesh.fs"), bodies(num_bodies)
+    find_shader_inputs();
+    make_gl_buffers(bodies.packed_positions(), bodies.color.data());
+    step_dt = dt;
+    step_camera = DEFAULT_STEP_CAMERA;  // Just something for now
+}
+
+physics_gl::physics_gl(int num_bodies)
+    : ring_vbo{0},
+      ring{nullptr},
+      ring_fences{},
+      ring_write{0},
+      ring_draw{0},
+      ring_tried{false},
+      shader("res/simple_mesh.vs", "res/simple_mesh.fs"),
+      bodies(0)
 {
     num_particles = num_bodies;
-    init_bodies();
+    find_shader_inputs();
+    make_gl_buffers(nullptr, nullptr);
+    step_dt = 0.0f;
+    step_camera = DEFAULT_STEP_CAMERA;
+}
 
+void physics_gl::find_shader_inputs()
+{
     positions_attrib = shader.getAttribLocation("position");
     colors_attrib = shader.getAttribLocation("inColor");
     view_uniform = shader.getUniformLocation("view");
     project_uniform = shader.getUniformLocation("projection");
-
-    make_gl_buffers();
-    step_dt = dt;
-    step_camera = DEFAULT_STEP_CAMERA;  // Just something for now
 }
 
 physics_gl::~physics_gl()
@@ -50,7 +81,8 @@ void physics_gl::set_perspective(float aspect_ratio, float near, float far)
     glUniformMatrix4fv(project_uniform, 1, GL_FALSE, glm::value_ptr(perspective_matrix));
 }
 
-void physics_gl::make_gl_buffers()
+// Null data leaves a buffer's contents undefined until it is first written
+void physics_gl::make_gl_buffers(const glm::vec3 *positions, const glm::vec3 *colors)
 {
     glGenVertexArrays(1, &vao);  // Generate vao, stores info about layout
     glGenBuffers(1, &positions_vbo);
@@ -60,15 +92,13 @@ void physics_gl::make_gl_buffers()
 
     // Set up color of circles
     glBindBuffer(GL_ARRAY_BUFFER, colors_vbo);
-    glBufferData(GL_ARRAY_BUFFER, bodies.size() * sizeof(glm::vec3), bodies.color.data(),
-                 GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, num_particles * sizeof(glm::vec3), colors, GL_STATIC_DRAW);
     glVertexAttribPointer(colors_attrib, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), NULL);
     glEnableVertexAttribArray(colors_attrib);
 
     // Set up offsets (positions of circles), needs to be updated every iteration
     glBindBuffer(GL_ARRAY_BUFFER, positions_vbo);
-    glBufferData(GL_ARRAY_BUFFER, bodies.size() * sizeof(glm::vec3), bodies.pos.data(),
-                 GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, num_particles * sizeof(glm::vec3), positions, GL_DYNAMIC_DRAW);
     glVertexAttribPointer(positions_attrib, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), NULL);
     glEnableVertexAttribArray(positions_attrib);
 
@@ -79,66 +109,101 @@ void physics_gl::make_gl_buffers()
     glVertexAttribDivisor(positions_attrib, 1);
 }
 
-void physics_gl::init_bodies()
-{
-    auto count = bodies.size();
-    auto range = 0.2f;
-    std::random_device rd;
-    auto gen = std::mt19937(rd());
-    auto dist = std::uniform_real_distribution<float>(-range, range);
-    for (int i = 0; i < count - 1; i++) {
-        auto randX = dist(gen);
-        auto randY = dist(gen);
-        auto randZ = dist(gen);
-
-#define FOUR_BLOCKS
-
-#if defined(TWO_BLOCKS)
-        if (i < count / 2) {  // block 1
-            bodies.pos[i] = {randX - 1.3f, randY, randZ};
-            // bodies.vel[i] = { 0.0f, 110.0f, 0.0f }; // Good looping
-            bodies.vel[i] = {0.0f, 160.0f, 0.0f};  // Good mixing
-            bodies.color[i] = {0.0f, 1.0f, 0.0f};
-        } else if (i < count) {  // block 2
-            bodies.pos[i] = {randX + 1.3f, randY, randZ};
-            // bodies.vel[i] = { 0.0f, -110.0f, 0.0f };
-            bodies.vel[i] = {0.0f, -160.0f, 0.0f};
-            bodies.color[i] = {1.0f, 0.0f, 1.0f};
-        }
-#elif defined(FOUR_BLOCKS)
-        if (i < (1.0f / 4.0f) * count) {  // block 1
-            bodies.pos[i] = {randX - 1.3f, randY, randZ};
-            bodies.vel[i] = {0.0f, 110.0f, 0.0f};  // Good looping
-            // bodies.vel[i] = { 0.0f, 160.0f, 0.0f }; // Good mixing
-            bodies.color[i] = {0.0f, 1.0f, 0.0f};
-        } else if (i < (2.0f / 3.0f) * count) {  // block 2
-            bodies.pos[i] = {randX + 1.3f, randY, randZ};
-            bodies.vel[i] = {0.0f, -110.0f, 0.0f};
-            //	bodies.vel[i] = { 0.0f, -160.0f, 0.0f };
-            bodies.color[i] = {1.0f, 0.0f, 1.0f};
-        } else if (i < (3.0f / 4.0f) * count) {  // block 3
-            bodies.pos[i] = {randX, randY + 1.3, randZ};
-            bodies.vel[i] = {0.0f, 0.0f, 110.0f};
-            //	bodies.vel[i] = { 0.0f, -160.0f, 0.0f };
-            bodies.color[i] = {1.0f, 1.0f, 1.0f};
-        } else {  // block 4
-            bodies.pos[i] = {randX, randY - 1.3f, randZ};
-            bodies.vel[i] = {0.0f, 0.0f, -110.0f};
-            //	bodies.vel[i] = { 0.0f, -160.0f, 0.0f };
-            bodies.color[i] = {1.0f, 0.0f, 0.0f};
+void physics_gl::update_positions()
+{
+    PROFILE_SCOPE("gl_upload");
+    bodies.pack_positions(begin_positions_update());
+    end_positions_update();
+}
+
+void physics_gl::update_positions(const glm::vec3 *positions)
+{
+    PROFILE_SCOPE("gl_upload");
+    if (!ring_tried)
+        make_ring();
+    // Without the ring the caller's array is uploaded as it is, staging would only add a copy
+    if (!ring) {
+        glBindBuffer(GL_ARRAY_BUFFER, positions_vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, num_particles * sizeof(glm::vec3), positions);
+        return;
+    }
+    std::copy_n(positions, num_particles, begin_positions_update());
+    end_positions_update();
+}
+
+void physics_gl::update_colors(const glm::vec3 *colors)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, colors_vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, num_particles * sizeof(glm::vec3), colors);
+}
+
+// The mapping is coherent, so writes through it reach the GPU without flushes, and it stays
+// mapped for the lifetime of the buffer
+void physics_gl::make_ring()
+{
+    ring_tried = true;
+    if (!GLEW_ARB_buffer_storage)
+        return;
+
+    auto flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    auto bytes = RING_SIZE * num_particles * sizeof(glm::vec3);
+    glGenBuffers(1, &ring_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, ring_vbo);
+    glBufferStorage(GL_ARRAY_BUFFER, bytes, nullptr, flags);
+    ring = static_cast<glm::vec3 *>(glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (!ring) {
+        glDeleteBuffers(1, &ring_vbo);
+        ring_vbo = 0;
+    }
+}
+
+glm::vec3 *physics_gl::begin_positions_update()
+{
+    if (!ring_tried)
+        make_ring();
+    if (!ring) {
+        staging.resize(num_particles);
+        return staging.data();
+    }
+
+    ring_write = (ring_draw + 1) % RING_SIZE;
+    auto &fence = ring_fences[ring_write];
+    if (fence) {
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) ==
+               GL_TIMEOUT_EXPIRED) {
         }
-#endif
-        bodies.mass[i] = static_cast<float>(fabs(dist(gen) * 9.5e9f));
-        bodies.acc[i] = {0, 0, 0};
-        // bodies.color[i] = { fabs(dist(gen)), fabs(dist(gen)), fabs(dist(gen)) };
+        glDeleteSync(fence);
+        fence = nullptr;
     }
-    bodies.pos[count - 1] = {0.0f, 0.0f, 0.0f};
-    bodies.mass[count - 1] = 5e14f;
-    bodies.color[count - 1] = {1.0f, 1.0f, 1.0f};
+    return ring + ring_write * num_particles;
 }
 
-void physics_gl::update_positions()
+void physics_gl::end_positions_update()
 {
-    glBindBuffer(GL_ARRAY_BUFFER, positions_vbo);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, num_particles * sizeof(glm::vec3), bodies.pos.data());
+    if (!ring) {
+        glBindBuffer(GL_ARRAY_BUFFER, positions_vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, num_particles * sizeof(glm::vec3), staging.data());
+        return;
+    }
+
+    // Point the instanced positions at the region just written
+    ring_draw = ring_write;
+    auto offset = static_cast<size_t>(ring_draw) * num_particles * sizeof(glm::vec3);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, ring_vbo);
+    glVertexAttribPointer(positions_attrib, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3),
+                          reinterpret_cast<const void *>(offset));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void physics_gl::draw()
+{
+    glDrawArraysInstanced(GL_POINTS, 0, 3 * sizeof(glm::vec3), num_particles);
+    if (ring) {
+        auto &fence = ring_fences[ring_draw];
+        if (fence)
+            glDeleteSync(fence);
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
 }
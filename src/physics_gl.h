@@ -9,17 +9,33 @@
 #include <glm/glm.hpp>
 
 #include <mutex>
+#include <vector>
 
 #include "display.h"
+#include "initial_conditions.h"
 #include "pobject.h"
 #include "shader.h"
 
 class physics_gl
 {
 public:
-    physics_gl(int num_bodies, float dt);
+    physics_gl(int num_bodies, float dt, const ic_options &ic);
+    // Only the position and color buffers for num_bodies, left empty for update_positions and
+    // update_colors to fill. There are no bodies to simulate, get_bodies() holds none.
+    explicit physics_gl(int num_bodies);
     ~physics_gl();
     void update_positions();
+    // Upload positions and colors that do not come from the bodies, count of each
+    void update_positions(const glm::vec3 *positions);
+    void update_colors(const glm::vec3 *colors);
+
+    // Storage for the next frame's positions, count packed vec3s. With ARB_buffer_storage this is
+    // a region of a persistently mapped ring the GPU draws from directly, waiting first if the
+    // GPU is still drawing the frame that was last in it. end_positions_update displays it.
+    glm::vec3 *begin_positions_update();
+    void end_positions_update();
+    // Draw the bodies, then fence the region drawn from so it is not overwritten too early
+    void draw();
     void bind();
     void use_shader();
     void set_view(const glm::mat4 &view);
@@ -30,12 +46,26 @@ public:
         return &bodies;
     }
 
-    friend class physics_cl;
+    inline GLuint get_positions_vbo()
+    {
+        return positions_vbo;
+    }
 
 private:
+    static constexpr int RING_SIZE = 3;
+
     GLint view_uniform, project_uniform;
     GLint positions_attrib, colors_attrib;
     GLuint positions_vbo, colors_vbo, vao;
+    // Positions ring, made on the first begin_positions_update so a positions_vbo shared with
+    // OpenCL keeps its plain storage. ring is null without ARB_buffer_storage, and staging plus
+    // glBufferSubData is used instead.
+    GLuint ring_vbo;
+    glm::vec3 *ring;
+    GLsync ring_fences[RING_SIZE];
+    int ring_write, ring_draw;
+    bool ring_tried;
+    std::vector<glm::vec3> staging;
     glm::mat4 perspective_matrix;
     std::mutex mutex;
     float step_dt, step_camera;
@@ -44,8 +74,9 @@ private:
     GLShader shader;
     PBodies bodies;
 
-    void make_gl_buffers();
-    void init_bodies();
+    void make_gl_buffers(const glm::vec3 *positions, const glm::vec3 *colors);
+    void find_shader_inputs();
+    void make_ring();
 
     static constexpr int DEFAULT_BODIES_COUNT = 1000;
     static constexpr float DEFAULT_STEP_DT = 0.001f;
@@ -1,82 +1,218 @@
 #include <glm/glm.hpp>
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <type_traits>
 #include <vector>
 
 #include "pobject.h"
+#include "profiler.h"
 
-PBodies::PBodies(int size)
+template<typename T>
+void basic_vec3_array<T>::resize(int padded_size)
+{
+    stride = padded_size;
+    data.assign(3 * static_cast<size_t>(padded_size), T{0});
+}
+
+template<typename T, typename Pair>
+basic_bodies<T, Pair>::basic_bodies(int size)
 {
     count = size;
-    pos.resize(size);
-    vel.resize(size);
-    acc.resize(size);
+    stride = (size + PADDING - 1) / PADDING * PADDING;
+    pos.resize(stride);
+    vel.resize(stride);
+    acc.resize(stride);
+    mass.assign(stride, Pair{0});
     color.resize(size);
-    mass.resize(size);
 }
 
-void PBodies::applyGravity(float dt)
+template<typename T, typename Pair>
+void basic_bodies<T, Pair>::applyGravity(float dt)
+{
+    computeGravity();
+    integrate(dt);
+}
+
+// Narrower pair terms are evaluated on a copy of the positions in Pair, taken relative to their
+// mean, so the copy keeps as many digits as the spread of the bodies allows however far from the
+// origin they are
+template<typename T, typename Pair>
+const basic_vec3_array<Pair> &basic_bodies<T, Pair>::narrowed_positions()
 {
-    static const float G_CONSTANT = 6.67408E-11f;
-    static const float EPS = 1e-6f;
+    int n = this->count;
+    if (narrow.data.size() != pos.data.size())
+        narrow.resize(stride);
+
+    for (auto c = 0; c < 3; c++) {
+        const T *from = pos.data.data() + c * stride;
+        Pair *to = narrow.data.data() + c * stride;
+        T sum = 0;
+#pragma omp parallel for simd reduction(+ : sum)
+        for (int i = 0; i < n; i++)
+            sum += from[i];
+        T mean = n ? sum / n : T{0};
+
+#pragma omp parallel for simd
+        for (int i = 0; i < n; i++)
+            to[i] = static_cast<Pair>(from[i] - mean);
+    }
+    return narrow;
+}
 
+template<typename T, typename Pair>
+void basic_bodies<T, Pair>::computeGravity()
+{
     int n = this->count;
-    glm::vec3 *pos = this->pos.data();
-    glm::vec3 *vel = this->vel.data();
-    glm::vec3 *acc = this->acc.data();
-    float *mass = this->mass.data();
+    const Pair *px, *py, *pz;
+    if constexpr (std::is_same_v<T, Pair>) {
+        px = pos.x(), py = pos.y(), pz = pos.z();
+    } else {
+        auto &narrowed = narrowed_positions();
+        px = narrowed.x(), py = narrowed.y(), pz = narrowed.z();
+    }
+    T *ax = acc.x(), *ay = acc.y(), *az = acc.z();
+    const Pair *mass = this->mass.data();
+    // Sources are summed in Pair a block at a time, and the blocks in T
+    int block = std::is_same_v<T, Pair> ? std::max(n, 1) : SUM_BLOCK;
 
 #pragma omp parallel for
     for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            //			if (j == i) continue;
-            // Direction x,y,z vectors
-            float dx = pos[j].x - pos[i].x;
-            float dy = pos[j].y - pos[i].y;
-            float dz = pos[j].z - pos[i].z;
+        T sum_x = 0, sum_y = 0, sum_z = 0;
+        for (int start = 0; start < n; start += block) {
+            int end = std::min(n, start + block);
+            // Accumulate in registers, the SoA arrays may alias as far as the compiler knows
+            Pair block_x = 0, block_y = 0, block_z = 0;
+#pragma omp simd reduction(+ : block_x, block_y, block_z)
+            for (int j = start; j < end; j++) {
+                //			if (j == i) continue;
+                // Direction x,y,z vectors
+                Pair dx = px[j] - px[i];
+                Pair dy = py[j] - py[i];
+                Pair dz = pz[j] - pz[i];
 
-            float mag_sq = dx * dx + dy * dy + dz * dz + EPS;
-            float mag_sixth = mag_sq * mag_sq * mag_sq;
+                Pair mag_sq = dx * dx + dy * dy + dz * dz + static_cast<Pair>(EPS);
+                Pair mag_sixth = mag_sq * mag_sq * mag_sq;
 
-            // Inverse cube = 1/r^2 (Newton's equation) * 1/r (normalize the direction vectors
-            float inv_mag_cubed = 1.0f / std::sqrt(mag_sixth);
+                // Inverse cube = 1/r^2 (Newton's equation) * 1/r (normalize the direction vectors
+                Pair inv_mag_cubed = Pair{1} / std::sqrt(mag_sixth);
 
-            // We dont need to multiply by i's mass because we will eventually be dividing
-            // it away when calculating the acceleration due to gravity (F=ma -> a=F/m)
+                // We dont need to multiply by i's mass because we will eventually be dividing
+                // it away when calculating the acceleration due to gravity (F=ma -> a=F/m)
 
-            float f_gravity_j =
-                (mass[j] * inv_mag_cubed);  // Partial force due to jth body on ith body
+                Pair f_gravity_j =
+                    (mass[j] * inv_mag_cubed);  // Partial force due to jth body on ith body
 
-            // Accumulate forces for this tick
-            acc[i].x += dx * f_gravity_j;
-            acc[i].y += dy * f_gravity_j;
-            acc[i].z += dz * f_gravity_j;
+                // Accumulate forces for this tick
+                block_x += dx * f_gravity_j;
+                block_y += dy * f_gravity_j;
+                block_z += dz * f_gravity_j;
+            }
+            sum_x += block_x;
+            sum_y += block_y;
+            sum_z += block_z;
         }
+        ax[i] += sum_x;
+        ay[i] += sum_y;
+        az[i] += sum_z;
     }
+}
+
+template<typename T, typename Pair>
+void basic_bodies<T, Pair>::integrate(float dt)
+{
+    PROFILE_SCOPE("integrate");
+    int n = this->count;
+    T *px = pos.x(), *py = pos.y(), *pz = pos.z();
+    T *vx = vel.x(), *vy = vel.y(), *vz = vel.z();
+    T *ax = acc.x(), *ay = acc.y(), *az = acc.z();
 
 #pragma omp parallel for
     for (int i = 0; i < n; i++) {
         // Update positions for next tick (x(t) = x0 + v0*t + 1/2 at^2)
-        pos[i].x += vel[i].x * dt + (G_CONSTANT * acc[i].x * dt * dt * 0.5f);
-        pos[i].y += vel[i].y * dt + (G_CONSTANT * acc[i].y * dt * dt * 0.5f);
-        pos[i].z += vel[i].z * dt + (G_CONSTANT * acc[i].z * dt * dt * 0.5f);
+        px[i] += vx[i] * dt + (G_CONSTANT * ax[i] * dt * dt * 0.5f);
+        py[i] += vy[i] * dt + (G_CONSTANT * ay[i] * dt * dt * 0.5f);
+        pz[i] += vz[i] * dt + (G_CONSTANT * az[i] * dt * dt * 0.5f);
 
         // Update velocities for next tick
-        vel[i].x += G_CONSTANT * acc[i].x * dt;
-        vel[i].y += G_CONSTANT * acc[i].y * dt;
-        vel[i].z += G_CONSTANT * acc[i].z * dt;
+        vx[i] += G_CONSTANT * ax[i] * dt;
+        vy[i] += G_CONSTANT * ay[i] * dt;
+        vz[i] += G_CONSTANT * az[i] * dt;
 
         // Clear the acceleration for next tick
-        acc[i].x = 0;
-        acc[i].y = 0;
-        acc[i].z = 0;
+        ax[i] = 0;
+        ay[i] = 0;
+        az[i] = 0;
+    }
+}
+
+template<typename T, typename Pair>
+void basic_bodies<T, Pair>::kick(float dt)
+{
+    PROFILE_SCOPE("integrate");
+    int n = this->count;
+    T *vx = vel.x(), *vy = vel.y(), *vz = vel.z();
+    const T *ax = acc.x(), *ay = acc.y(), *az = acc.z();
+    T gdt = G_CONSTANT * dt;
+
+#pragma omp parallel for simd
+    for (int i = 0; i < n; i++) {
+        vx[i] += gdt * ax[i];
+        vy[i] += gdt * ay[i];
+        vz[i] += gdt * az[i];
+    }
+}
+
+template<typename T, typename Pair>
+void basic_bodies<T, Pair>::drift(float dt)
+{
+    PROFILE_SCOPE("integrate");
+    int n = this->count;
+    T *px = pos.x(), *py = pos.y(), *pz = pos.z();
+    const T *vx = vel.x(), *vy = vel.y(), *vz = vel.z();
+
+#pragma omp parallel for simd
+    for (int i = 0; i < n; i++) {
+        px[i] += vx[i] * dt;
+        py[i] += vy[i] * dt;
+        pz[i] += vz[i] * dt;
+    }
+}
+
+template<typename T, typename Pair>
+const glm::vec3 *basic_bodies<T, Pair>::packed_positions()
+{
+    packed.resize(count);
+    pack_positions(packed.data());
+    return packed.data();
+}
+
+template<typename T, typename Pair>
+void basic_bodies<T, Pair>::pack_positions(glm::vec3 *out)
+{
+    int n = this->count;
+    const T *px = pos.x(), *py = pos.y(), *pz = pos.z();
+
+#pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+        out[i] = {static_cast<float>(px[i]), static_cast<float>(py[i]),
+                  static_cast<float>(pz[i])};
     }
 }
 
-void PBodies::printBody(int i)
+template<typename T, typename Pair>
+void basic_bodies<T, Pair>::printBody(int i)
 {
-    std::cout << "(" << pos[i].x << ", " << pos[i].y << ", " << pos[i].z << "), "
-              << "(" << vel[i].x << ", " << vel[i].y << ", " << vel[i].z << "), "
-              << "(" << acc[i].x << ", " << acc[i].y << ", " << acc[i].z << ")";
+    auto p = pos.get(i), v = vel.get(i), a = acc.get(i);
+    std::cout << "(" << p.x << ", " << p.y << ", " << p.z << "), "
+              << "(" << v.x << ", " << v.y << ", " << v.z << "), "
+              << "(" << a.x << ", " << a.y << ", " << a.z << ")";
 }
+
+template struct basic_vec3_array<float>;
+template struct basic_vec3_array<double>;
+
+template class basic_bodies<float>;
+template class basic_bodies<double>;
+template class basic_bodies<double, float>;
@@ -4,20 +4,162 @@
 #include <glm/glm.hpp>
 #include <vector>
 
-class PBodies
+#include "aligned_allocator.h"
+
+// The glm vector type of a scalar type
+template<typename T>
+struct glm_vec3;
+
+template<>
+struct glm_vec3<float> {
+    using type = glm::vec3;
+};
+
+template<>
+struct glm_vec3<double> {
+    using type = glm::dvec3;
+};
+
+// x, y and z components stored as three planes of one page aligned allocation. Each plane is
+// stride scalars long, so every plane starts on a cache line.
+template<typename T>
+struct basic_vec3_array {
+    using vec_type = typename glm_vec3<T>::type;
+
+    aligned_vector<T> data;
+    int stride;
+
+    void resize(int padded_size);
+
+    inline T *x()
+    {
+        return data.data();
+    }
+
+    inline T *y()
+    {
+        return data.data() + stride;
+    }
+
+    inline T *z()
+    {
+        return data.data() + 2 * stride;
+    }
+
+    inline const T *x() const
+    {
+        return data.data();
+    }
+
+    inline const T *y() const
+    {
+        return data.data() + stride;
+    }
+
+    inline const T *z() const
+    {
+        return data.data() + 2 * stride;
+    }
+
+    inline vec_type get(int i) const
+    {
+        return {x()[i], y()[i], z()[i]};
+    }
+
+    inline void set(int i, const vec_type &v)
+    {
+        x()[i] = v.x;
+        y()[i] = v.y;
+        z()[i] = v.z;
+    }
+};
+
+extern template struct basic_vec3_array<float>;
+extern template struct basic_vec3_array<double>;
+
+using vec3_array = basic_vec3_array<float>;
+
+// Bodies whose positions, velocities and accelerations are stored as T. The direct sum evaluates
+// each pair in Pair and adds it to the per-body sums in T, so basic_bodies<double, float> keeps
+// float throughput in the O(n^2) part while positions far from the origin and long sums keep
+// double precision. Everything beyond the direct sum and the integrators works on PBodies.
+template<typename T, typename Pair = T>
+class basic_bodies
 {
 public:
-    PBodies(int size);
+    using scalar_type = T;
+    using pair_type = Pair;
+
+    basic_bodies(int size);
     inline int size()
     {
         return count;
     }
+    // Length of each array including padding, always a multiple of PADDING
+    inline int padded_size()
+    {
+        return stride;
+    }
+    // Direct O(n^2) summation followed by integrate(dt)
     void applyGravity(float dt);
+    // Accumulate the acceleration of every body (without G) into acc
+    void computeGravity();
+    // Advance positions and velocities using acc, then clear acc for the next step
+    void integrate(float dt);
+    // The two halves of a symplectic step: velocities by G * acc * dt, leaving acc alone, and
+    // positions by vel * dt
+    void kick(float dt);
+    void drift(float dt);
     void printBody(int index);
+    // Positions interleaved as glm::vec3, only built when something needs that layout (OpenGL)
+    const glm::vec3 *packed_positions();
+    // The same into caller provided storage of size() vec3s, such as a mapped vertex buffer
+    void pack_positions(glm::vec3 *out);
+    // Copy the state of bodies of the same size and another precision, rounding or widening
+    template<typename U, typename UPair>
+    void assign(const basic_bodies<U, UPair> &other);
+    // The positions in Pair, relative to their mean, for pair kernels narrower than T. Refreshed
+    // from pos on every call.
+    const basic_vec3_array<Pair> &narrowed_positions();
+
+    // Padding bodies have zero mass and sit at the origin, so kernels can run over the whole
+    // padded length without handling a remainder
+    basic_vec3_array<T> pos, vel, acc;
+    aligned_vector<Pair> mass;
+    std::vector<glm::vec3> color;  // Only used for rendering
+    int count, stride;
 
-    std::vector<glm::vec3> pos, vel, acc, color;
-    std::vector<float> mass;
-    int count;
+    static constexpr T G_CONSTANT = static_cast<T>(6.67408E-11);
+    static constexpr T EPS = static_cast<T>(1e-6);  // Softening added to squared distances
+    static constexpr int PADDING = 16;               // Floats per cache line
+    // Sources per partial sum when pair terms are narrower than the sums
+    static constexpr int SUM_BLOCK = 256;
+
+private:
+    std::vector<glm::vec3> packed;
+    // Positions narrowed to Pair for the direct sum, when that is narrower than T
+    basic_vec3_array<Pair> narrow;
 };
 
+template<typename T, typename Pair>
+template<typename U, typename UPair>
+void basic_bodies<T, Pair>::assign(const basic_bodies<U, UPair> &other)
+{
+    auto convert = [](const auto &from, auto &to) { to.assign(from.begin(), from.end()); };
+    convert(other.pos.data, pos.data);
+    convert(other.vel.data, vel.data);
+    convert(other.acc.data, acc.data);
+    convert(other.mass, mass);
+    color = other.color;
+}
+
+// The precisions built in pobject.cc: float, double, and double sums of float pair terms
+extern template class basic_bodies<float>;
+extern template class basic_bodies<double>;
+extern template class basic_bodies<double, float>;
+
+using PBodies = basic_bodies<float>;
+using double_bodies = basic_bodies<double>;
+using mixed_bodies = basic_bodies<double, float>;
+
 #endif
@@ -0,0 +1,149 @@
+#ifdef GRAVITY_PROFILE
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+#include "profiler.h"
+
+static const auto clock_start = std::chrono::steady_clock::now();
+
+profiler &profiler::instance()
+{
+    static profiler p;
+    return p;
+}
+
+profiler::profiler() : device{"OpenCL device", {}, {}, 0}
+{
+}
+
+int64_t profiler::now()
+{
+    auto elapsed = std::chrono::steady_clock::now() - clock_start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+void profiler::track::add(const char *name, int64_t start, int64_t end)
+{
+    if (events.size() < MAX_TRACE_EVENTS)
+        events.push_back({name, start, end});
+    else
+        dropped++;
+
+    // A handful of phases per track, so a linear search on the name pointer is enough
+    auto duration = end - start;
+    for (auto &s : stats) {
+        if (s.name == name) {
+            s.count++;
+            s.total += duration;
+            s.min = std::min(s.min, duration);
+            s.max = std::max(s.max, duration);
+            return;
+        }
+    }
+    stats.push_back({name, 1, duration, duration, duration});
+}
+
+profiler::track &profiler::thread_track()
+{
+    thread_local track *mine = nullptr;
+    if (!mine) {
+        std::lock_guard<std::mutex> guard{mu};
+        tracks.push_back(std::make_unique<track>());
+        mine = tracks.back().get();
+        mine->name = "thread " + std::to_string(tracks.size());
+        mine->dropped = 0;
+    }
+    return *mine;
+}
+
+void profiler::record(const char *name, int64_t start, int64_t end)
+{
+    thread_track().add(name, start, end);
+}
+
+void profiler::record_device(const char *name, int64_t start, int64_t end)
+{
+    std::lock_guard<std::mutex> guard{mu};
+    device.add(name, start, end);
+}
+
+void profiler::set_thread_name(const std::string &name)
+{
+    thread_track().name = name;
+}
+
+const char *profiler::intern(const std::string &name)
+{
+    std::lock_guard<std::mutex> guard{mu};
+    return names.insert(name).first->c_str();
+}
+
+// Complete ("X") events with microsecond timestamps, one tid per track
+void profiler::write_trace(const std::string &path)
+{
+    std::lock_guard<std::mutex> guard{mu};
+    auto out = std::ofstream{path};
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+
+    auto first = true;
+    auto write_track = [&](const track &t, int tid) {
+        out << (first ? "" : ",") << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+            << "\"tid\": " << tid << ", \"args\": {\"name\": \"" << t.name << "\"}}";
+        first = false;
+        for (auto &e : t.events) {
+            out << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": "
+                << tid << ", \"ts\": " << e.start * 1e-3 << ", \"dur\": "
+                << (e.end - e.start) * 1e-3 << "}";
+        }
+    };
+    for (size_t i = 0; i < tracks.size(); i++)
+        write_track(*tracks[i], static_cast<int>(i + 1));
+    if (!device.stats.empty())
+        write_track(device, 0);
+
+    out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    if (!out)
+        throw std::runtime_error{"failed to write " + path};
+}
+
+void profiler::print_summary()
+{
+    std::lock_guard<std::mutex> guard{mu};
+    auto print_track = [](const track &t) {
+        if (t.stats.empty())
+            return;
+        std::cout << t.name << ":\n";
+        for (auto &s : t.stats) {
+            std::cout << "  " << std::left << std::setw(24) << s.name << std::right
+                      << std::setw(10) << s.count << " calls " << std::setw(12)
+                      << s.total * 1e-6 << " ms total " << std::setw(10)
+                      << s.total * 1e-3 / s.count << " us mean " << std::setw(10)
+                      << s.min * 1e-3 << " us min " << std::setw(10) << s.max * 1e-3
+                      << " us max\n";
+        }
+        if (t.dropped)
+            std::cout << "  " << t.dropped << " events left out of the trace\n";
+    };
+
+    std::cout << "profile:\n";
+    for (auto &t : tracks)
+        print_track(*t);
+    print_track(device);
+    std::cout << std::flush;
+}
+
+void profiler::finish(const std::string &path)
+{
+    if (!path.empty()) {
+        write_trace(path);
+        std::cout << "wrote trace to " << path << "\n";
+    }
+    print_summary();
+}
+
+#endif  // GRAVITY_PROFILE
@@ -0,0 +1,108 @@
+#ifndef GRAVITY_PROFILER_H
+#define GRAVITY_PROFILER_H
+
+// Phase timers for finding where a step's time goes, built with -DGRAVITY_PROFILE=ON. Without it
+// PROFILE_SCOPE expands to nothing and none of this is compiled.
+#ifdef GRAVITY_PROFILE
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// One timed phase, in nanoseconds since the profiler started
+struct trace_event {
+    const char *name;
+    int64_t start, end;
+};
+
+struct phase_stats {
+    const char *name;
+    uint64_t count;
+    int64_t total, min, max;
+};
+
+// Every thread records into its own track, found once per thread, so a timer costs two clock
+// reads and an append without locking. The tracks are read by write_trace and print_summary,
+// which must only run once the profiled threads have stopped.
+class profiler
+{
+public:
+    static profiler &instance();
+
+    // Steady clock nanoseconds since the profiler started
+    static int64_t now();
+
+    // Phase of the calling thread. name must outlive the profiler, a string literal or intern().
+    void record(const char *name, int64_t start, int64_t end);
+    // Phase that ran on the OpenCL device, already moved to the host clock
+    void record_device(const char *name, int64_t start, int64_t end);
+    // Label for the calling thread's track in the trace
+    void set_thread_name(const std::string &name);
+    // Stable copy of a name built at runtime
+    const char *intern(const std::string &name);
+
+    // Chrome trace event format, viewable in chrome://tracing or Perfetto
+    void write_trace(const std::string &path);
+    // Count, total and mean/min/max time of every phase on every track
+    void print_summary();
+    // write_trace, if path is not empty, then print_summary
+    void finish(const std::string &path);
+
+    // Tracks keep aggregating into the summary after this many events, but stop tracing
+    static constexpr size_t MAX_TRACE_EVENTS = 1 << 20;
+
+private:
+    struct track {
+        std::string name;
+        std::vector<trace_event> events;
+        std::vector<phase_stats> stats;
+        uint64_t dropped;
+
+        void add(const char *name, int64_t start, int64_t end);
+    };
+
+    std::mutex mu;
+    std::vector<std::unique_ptr<track>> tracks;
+    track device;
+    std::set<std::string> names;
+
+    profiler();
+    track &thread_track();
+};
+
+class scoped_timer
+{
+public:
+    explicit scoped_timer(const char *name) : name{name}, start{profiler::now()}
+    {
+    }
+
+    ~scoped_timer()
+    {
+        profiler::instance().record(name, start, profiler::now());
+    }
+
+    scoped_timer(const scoped_timer &) = delete;
+    scoped_timer &operator=(const scoped_timer &) = delete;
+
+private:
+    const char *name;
+    int64_t start;
+};
+
+#define GRAVITY_PROFILE_JOIN(a, b) a##b
+#define GRAVITY_PROFILE_NAME(line) GRAVITY_PROFILE_JOIN(profile_scope_, line)
+#define PROFILE_SCOPE(name) scoped_timer GRAVITY_PROFILE_NAME(__LINE__){name}
+#define PROFILE_THREAD_NAME(name) profiler::instance().set_thread_name(name)
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_THREAD_NAME(name)
+
+#endif  // GRAVITY_PROFILE
+
+#endif  // GRAVITY_PROFILER_H
@@ -0,0 +1,129 @@
+#include <algorithm>
+
+#include "replay.h"
+
+trajectory_player::trajectory_player(const trajectory_file &file, int lookahead)
+    : file{file},
+      decoder{static_cast<int>(file.header().count), file.header().quantum},
+      buffers(std::max(1, lookahead)),
+      seek_to{-1},
+      step_by{1},
+      wanted{0},
+      closing{false}
+{
+    for (size_t i = 0; i < buffers.size(); i++) {
+        buffers[i].positions.resize(file.header().count);
+        free_buffers.push_back(i);
+    }
+    worker = std::thread{&trajectory_player::run, this};
+}
+
+trajectory_player::~trajectory_player()
+{
+    {
+        std::lock_guard<std::mutex> guard(mu);
+        closing = true;
+    }
+    changed.notify_one();
+    worker.join();
+}
+
+void trajectory_player::seek(int index)
+{
+    {
+        std::lock_guard<std::mutex> guard(mu);
+        seek_to = std::min(std::max(index, 0), file.frames() - 1);
+    }
+    changed.notify_one();
+}
+
+void trajectory_player::set_stride(int stride)
+{
+    std::lock_guard<std::mutex> guard(mu);
+    step_by = std::max(1, stride);
+}
+
+int trajectory_player::stride()
+{
+    std::lock_guard<std::mutex> guard(mu);
+    return step_by;
+}
+
+bool trajectory_player::next(replay_frame &frame)
+{
+    {
+        std::lock_guard<std::mutex> guard(mu);
+        if (ready.empty() || seek_to >= 0)
+            return false;
+        auto &decoded = buffers[ready.front()];
+        frame.index = decoded.index;
+        frame.step = decoded.step;
+        frame.positions.swap(decoded.positions);
+        decoded.positions.resize(frame.positions.size());
+        free_buffers.push_back(ready.front());
+        ready.pop_front();
+    }
+    changed.notify_one();
+    return true;
+}
+
+bool trajectory_player::finished()
+{
+    std::lock_guard<std::mutex> guard(mu);
+    return seek_to < 0 && ready.empty() && wanted >= file.frames();
+}
+
+void trajectory_player::run()
+{
+    auto count = static_cast<int>(file.header().count);
+    auto planes = std::vector<float>(3 * static_cast<size_t>(count));
+    auto position = 0;  // Next frame the decoder can continue with
+    while (true) {
+        auto buffer = 0;
+        auto index = 0;
+        {
+            std::unique_lock<std::mutex> lock(mu);
+            changed.wait(lock, [this] {
+                return closing || seek_to >= 0 ||
+                       (!free_buffers.empty() && wanted < file.frames());
+            });
+            if (closing)
+                return;
+            if (seek_to >= 0) {
+                free_buffers.insert(free_buffers.end(), ready.begin(), ready.end());
+                ready.clear();
+                wanted = seek_to;
+                seek_to = -1;
+                continue;
+            }
+            buffer = free_buffers.front();
+            free_buffers.pop_front();
+            index = wanted;
+        }
+
+        // The decoder holds the frame before position, deltas can only be applied in order
+        auto key = file.keyframe_before(index);
+        if (position > index || key > position)
+            position = key;
+        auto step = uint64_t{0};
+        while (position <= index)
+            step = decoder.decode(file.frame(position++), planes.data(), planes.data() + count,
+                                  planes.data() + 2 * count);
+
+        auto &frame = buffers[buffer];
+#pragma omp parallel for
+        for (int i = 0; i < count; i++)
+            frame.positions[i] = {planes[i], planes[count + i], planes[2 * count + i]};
+        frame.index = index;
+        frame.step = step;
+
+        // A seek that came in meanwhile makes this frame stale
+        std::lock_guard<std::mutex> guard(mu);
+        if (seek_to >= 0) {
+            free_buffers.push_back(buffer);
+        } else {
+            ready.push_back(buffer);
+            wanted = index + step_by;
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef GRAVITY_REPLAY_H
+#define GRAVITY_REPLAY_H
+
+#include <glm/glm.hpp>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trajectory.h"
+
+struct replay_frame {
+    int index;
+    uint64_t step;
+    std::vector<glm::vec3> positions;  // Interleaved, ready for the positions VBO
+};
+
+// Decodes the frames of a trajectory ahead of the display on a background thread, keeping up to
+// lookahead of them ready. Fast-forward shows every stride-th frame, jumping straight to a
+// keyframe when that is shorter than decoding the frames in between.
+class trajectory_player
+{
+public:
+    trajectory_player(const trajectory_file &file, int lookahead = 4);
+    ~trajectory_player();
+    trajectory_player(const trajectory_player &) = delete;
+    trajectory_player &operator=(const trajectory_player &) = delete;
+
+    // Drops the frames decoded so far and continues from index
+    void seek(int index);
+    void set_stride(int stride);
+    int stride();
+
+    // Swaps the next decoded frame into frame if one is ready. Never waits for the decoder.
+    bool next(replay_frame &frame);
+    // The last frame has been handed out
+    bool finished();
+
+private:
+    const trajectory_file &file;
+    trajectory_decoder decoder;
+    std::vector<replay_frame> buffers;
+    std::deque<int> free_buffers, ready;
+    std::mutex mu;
+    std::condition_variable changed;
+    int seek_to;
+    int step_by;
+    int wanted;  // Next frame to decode for the display
+    bool closing;
+    std::thread worker;
+
+    void run();
+};
+
+#endif  // GRAVITY_REPLAY_H
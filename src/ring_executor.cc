@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "initial_conditions.h"
+#include "ring_executor.h"
+#include "simd_gravity.h"
+
+static int ring_block_size(int count, int ranks)
+{
+    auto per_rank = (count + ranks - 1) / ranks;
+    return (per_rank + PBodies::PADDING - 1) / PBodies::PADDING * PBodies::PADDING;
+}
+
+static int ring_local_count(int count, int ranks, int rank)
+{
+    auto block = ring_block_size(count, ranks);
+    auto local = std::min(block, count - rank * block);
+    if (local <= 0)
+        throw std::runtime_error{std::to_string(count) + " bodies are too few for " +
+                                 std::to_string(ranks) + " ranks"};
+    return local;
+}
+
+ring_executor::ring_executor(ring_transport &transport, int count, const ic_options &ic)
+    : transport{transport},
+      count{count},
+      block_size{ring_block_size(count, transport.size())},
+      first{transport.rank() * block_size},
+      bodies{ring_local_count(count, transport.size(), transport.rank())},
+      current(4 * block_size),
+      incoming(4 * block_size)
+{
+    init_bodies(bodies, ic, count, first);
+}
+
+PBodies &ring_executor::local_bodies()
+{
+    return bodies;
+}
+
+int ring_executor::first_body() const
+{
+    return first;
+}
+
+void ring_executor::pack_own_block()
+{
+    auto B = block_size;
+    std::fill(current.begin(), current.end(), 0.0f);
+    std::copy_n(bodies.pos.x(), bodies.size(), current.data());
+    std::copy_n(bodies.pos.y(), bodies.size(), current.data() + B);
+    std::copy_n(bodies.pos.z(), bodies.size(), current.data() + 2 * B);
+    std::copy_n(bodies.mass.data(), bodies.size(), current.data() + 3 * B);
+}
+
+void ring_executor::step(float dt)
+{
+    auto B = block_size;
+    auto bytes = current.size() * sizeof(float);
+    auto ranks = transport.size();
+
+    pack_own_block();
+    for (int s = 0; s < ranks; s++) {
+        auto more = s + 1 < ranks;
+        if (more)
+            transport.start_shift(current.data(), incoming.data(), bytes);
+
+        auto source = current.data();
+        simd_gravity_sources(bodies.pos.x(), bodies.pos.y(), bodies.pos.z(), bodies.size(),
+                             source, source + B, source + 2 * B, source + 3 * B, B,
+                             bodies.acc.x(), bodies.acc.y(), bodies.acc.z());
+
+        if (more) {
+            transport.wait_shift();
+            current.swap(incoming);
+        }
+    }
+    bodies.integrate(dt);
+}
+
+void ring_executor::totals(double out[4])
+{
+    out[0] = out[1] = out[2] = out[3] = 0.0;
+    for (int i = 0; i < bodies.size(); i++) {
+        auto v = bodies.vel.get(i);
+        out[0] += static_cast<double>(bodies.mass[i]) * v.x;
+        out[1] += static_cast<double>(bodies.mass[i]) * v.y;
+        out[2] += static_cast<double>(bodies.mass[i]) * v.z;
+        out[3] += bodies.mass[i];
+    }
+    transport.all_reduce_sum(out, 4);
+}
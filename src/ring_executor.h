@@ -0,0 +1,39 @@
+#ifndef GRAVITY_RING_EXECUTOR_H
+#define GRAVITY_RING_EXECUTOR_H
+
+#include "aligned_allocator.h"
+#include "initial_conditions.h"
+#include "pobject.h"
+#include "ring_transport.h"
+
+// Direct summation with the bodies partitioned across the ranks of a ring. Every rank owns a
+// block of block_size bodies and only accumulates forces on those. Each step the x, y, z and mass
+// planes of the blocks travel once around the ring; while one block is summed the next one is
+// already being received.
+class ring_executor
+{
+public:
+    // Every rank generates its own block of the count body scene
+    ring_executor(ring_transport &transport, int count, const ic_options &ic);
+
+    void step(float dt);
+
+    // Bodies owned by this rank, and the index of its first body in the whole system
+    PBodies &local_bodies();
+    int first_body() const;
+
+    // Total momentum and mass over all ranks, as px, py, pz, m
+    void totals(double out[4]);
+
+private:
+    ring_transport &transport;
+    int count, block_size, first;
+    PBodies bodies;
+    // x, y, z and mass planes of block_size floats, for the block being summed and the block
+    // being received. Blocks past the end of the system are padded with zero mass.
+    aligned_vector<float> current, incoming;
+
+    void pack_own_block();
+};
+
+#endif  // GRAVITY_RING_EXECUTOR_H
@@ -0,0 +1,225 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "ring_transport.h"
+
+void ring_transport::shift(const void *send, void *recv, size_t bytes)
+{
+    start_shift(send, recv, bytes);
+    wait_shift();
+}
+
+// Each rank keeps forwarding what it last received, so after size - 1 shifts every rank has
+// seen every other rank's values exactly once
+void ring_transport::all_reduce_sum(double *values, int count)
+{
+    auto passing = std::vector<double>(values, values + count);
+    auto received = std::vector<double>(count);
+    for (int s = 1; s < size(); s++) {
+        shift(passing.data(), received.data(), count * sizeof(double));
+        for (int i = 0; i < count; i++)
+            values[i] += received[i];
+        passing.swap(received);
+    }
+}
+
+static std::runtime_error socket_error(const char *message)
+{
+    return std::runtime_error{std::string{message} + ": " + std::strerror(errno)};
+}
+
+static sockaddr_in localhost_address(int port)
+{
+    auto address = sockaddr_in{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return address;
+}
+
+static void write_all(int fd, const char *data, size_t bytes)
+{
+    while (bytes > 0) {
+        auto written = ::send(fd, data, bytes, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            throw socket_error("ring send failed");
+        data += written;
+        bytes -= written;
+    }
+}
+
+static void read_all(int fd, char *data, size_t bytes)
+{
+    while (bytes > 0) {
+        auto got = ::recv(fd, data, bytes, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got == 0)
+            throw std::runtime_error{"ring peer closed the connection"};
+        if (got < 0)
+            throw socket_error("ring receive failed");
+        data += got;
+        bytes -= got;
+    }
+}
+
+// Every rank listens before connecting, and a connect completes as soon as the peer is listening,
+// so the ring forms whatever order the processes start in
+socket_transport::socket_transport(int rank, int size, int base_port)
+    : my_rank{rank}, ranks{size}, next_fd{-1}, prev_fd{-1}
+{
+    if (ranks == 1)
+        return;
+
+    auto listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        throw socket_error("socket");
+    auto one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    auto address = localhost_address(base_port + my_rank);
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+        throw socket_error("bind");
+    if (listen(listen_fd, 1) < 0)
+        throw socket_error("listen");
+
+    // The next rank may not have started yet, so keep trying for a while
+    auto next_address = localhost_address(base_port + (my_rank + 1) % ranks);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (true) {
+        next_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(next_fd, reinterpret_cast<sockaddr *>(&next_address),
+                    sizeof(next_address)) == 0)
+            break;
+        close(next_fd);
+        if (std::chrono::steady_clock::now() > deadline)
+            throw socket_error("could not connect to the next rank");
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    prev_fd = accept(listen_fd, nullptr, nullptr);
+    close(listen_fd);
+    if (prev_fd < 0)
+        throw socket_error("accept");
+
+    setsockopt(next_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(prev_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+socket_transport::~socket_transport()
+{
+    if (sender.joinable())
+        sender.join();
+    if (receiver.joinable())
+        receiver.join();
+    if (next_fd >= 0)
+        close(next_fd);
+    if (prev_fd >= 0)
+        close(prev_fd);
+}
+
+int socket_transport::rank() const
+{
+    return my_rank;
+}
+
+int socket_transport::size() const
+{
+    return ranks;
+}
+
+// Sending and receiving run on their own threads. Every rank sends at once, so a rank that only
+// sent would fill the socket buffers and wait forever on a neighbour that is also only sending.
+void socket_transport::start_shift(const void *send, void *recv, size_t bytes)
+{
+    if (ranks == 1) {
+        std::memcpy(recv, send, bytes);
+        return;
+    }
+
+    send_error = nullptr;
+    recv_error = nullptr;
+    sender = std::thread{[this, send, bytes] {
+        try {
+            write_all(next_fd, static_cast<const char *>(send), bytes);
+        } catch (...) {
+            send_error = std::current_exception();
+        }
+    }};
+    receiver = std::thread{[this, recv, bytes] {
+        try {
+            read_all(prev_fd, static_cast<char *>(recv), bytes);
+        } catch (...) {
+            recv_error = std::current_exception();
+        }
+    }};
+}
+
+void socket_transport::wait_shift()
+{
+    if (sender.joinable())
+        sender.join();
+    if (receiver.joinable())
+        receiver.join();
+    if (send_error)
+        std::rethrow_exception(send_error);
+    if (recv_error)
+        std::rethrow_exception(recv_error);
+}
+
+#ifdef GRAVITY_HAVE_MPI
+mpi_transport::mpi_transport(int *argc, char ***argv) : owns_mpi{false}
+{
+    auto initialized = 0;
+    MPI_Initialized(&initialized);
+    if (!initialized) {
+        MPI_Init(argc, argv);
+        owns_mpi = true;
+    }
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+}
+
+mpi_transport::~mpi_transport()
+{
+    if (owns_mpi)
+        MPI_Finalize();
+}
+
+int mpi_transport::rank() const
+{
+    return my_rank;
+}
+
+int mpi_transport::size() const
+{
+    return ranks;
+}
+
+void mpi_transport::start_shift(const void *send, void *recv, size_t bytes)
+{
+    if (bytes > INT_MAX)
+        throw std::runtime_error{"ring block too large for one MPI message"};
+    auto next = (my_rank + 1) % ranks;
+    auto prev = (my_rank + ranks - 1) % ranks;
+    auto count = static_cast<int>(bytes);
+    MPI_Irecv(recv, count, MPI_BYTE, prev, 0, MPI_COMM_WORLD, &requests[0]);
+    MPI_Isend(send, count, MPI_BYTE, next, 0, MPI_COMM_WORLD, &requests[1]);
+}
+
+void mpi_transport::wait_shift()
+{
+    MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+}
+#endif
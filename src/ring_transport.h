@@ -0,0 +1,75 @@
+#ifndef GRAVITY_RING_TRANSPORT_H
+#define GRAVITY_RING_TRANSPORT_H
+
+#include <cstddef>
+#include <exception>
+#include <string>
+#include <thread>
+
+#ifdef GRAVITY_HAVE_MPI
+#include <mpi.h>
+#endif
+
+// Moves equally sized buffers one step around a ring of ranks: every rank sends to rank + 1 and
+// receives from rank - 1 at the same time. A shift is started and waited for separately so the
+// caller can compute while the data is in flight.
+class ring_transport
+{
+public:
+    virtual ~ring_transport() = default;
+
+    virtual int rank() const = 0;
+    virtual int size() const = 0;
+
+    // send and recv must not be touched until wait_shift returns, and must not overlap
+    virtual void start_shift(const void *send, void *recv, size_t bytes) = 0;
+    virtual void wait_shift() = 0;
+
+    void shift(const void *send, void *recv, size_t bytes);
+
+    // Sum count values over all ranks, leaving the total on every rank
+    void all_reduce_sum(double *values, int count);
+};
+
+// One process per rank on the same machine, connected by TCP over localhost. Rank r listens on
+// base_port + r.
+class socket_transport : public ring_transport
+{
+public:
+    socket_transport(int rank, int size, int base_port);
+    ~socket_transport() override;
+
+    int rank() const override;
+    int size() const override;
+    void start_shift(const void *send, void *recv, size_t bytes) override;
+    void wait_shift() override;
+
+private:
+    int my_rank, ranks;
+    int next_fd, prev_fd;
+    std::thread sender, receiver;
+    std::exception_ptr send_error, recv_error;
+};
+
+#ifdef GRAVITY_HAVE_MPI
+// Ranks of MPI_COMM_WORLD, with nonblocking point-to-point messages. Initializes MPI if it has
+// not been already, and then also finalizes it.
+class mpi_transport : public ring_transport
+{
+public:
+    mpi_transport(int *argc, char ***argv);
+    ~mpi_transport() override;
+
+    int rank() const override;
+    int size() const override;
+    void start_shift(const void *send, void *recv, size_t bytes) override;
+    void wait_shift() override;
+
+private:
+    int my_rank, ranks;
+    bool owns_mpi;
+    MPI_Request requests[2];
+};
+#endif
+
+#endif  // GRAVITY_RING_TRANSPORT_H
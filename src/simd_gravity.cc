@@ -0,0 +1,443 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GRAVITY_X86_SIMD
+#endif
+
+#include "simd_gravity.h"
+
+using gravity_kernel = void (*)(const float *, const float *, const float *, const float *, int,
+                                int, float *, float *, float *);
+
+// Adds the pull of sources [j_begin, j_end) on one block of targets starting at i. Targets and
+// sources are separate arrays so a block of remote sources can be summed onto local targets.
+using block_kernel = void (*)(const float *, const float *, const float *, const float *,
+                              const float *, const float *, const float *, int, int, int, int,
+                              float *, float *, float *);
+
+// Add a block of partial sums to the accumulators, skipping lanes past the last target
+static void add_block(const float *sum_x, const float *sum_y, const float *sum_z, int i,
+                      int width, int targets, float *ax, float *ay, float *az)
+{
+    auto lanes = std::min(width, targets - i);
+    for (int k = 0; k < lanes; k++) {
+        ax[i + k] += sum_x[k];
+        ay[i + k] += sum_y[k];
+        az[i + k] += sum_z[k];
+    }
+}
+
+static constexpr int SCALAR_BLOCK = 16;
+
+static void block_scalar(const float *tx, const float *ty, const float *tz, const float *x,
+                         const float *y, const float *z, const float *mass, int i, int j_begin,
+                         int j_end, int targets, float *ax, float *ay, float *az)
+{
+    float xi[SCALAR_BLOCK], yi[SCALAR_BLOCK], zi[SCALAR_BLOCK];
+    float sum_x[SCALAR_BLOCK] = {}, sum_y[SCALAR_BLOCK] = {}, sum_z[SCALAR_BLOCK] = {};
+    for (int k = 0; k < SCALAR_BLOCK; k++) {
+        xi[k] = tx[i + k];
+        yi[k] = ty[i + k];
+        zi[k] = tz[i + k];
+    }
+
+    for (int j = j_begin; j < j_end; j++) {
+#pragma omp simd
+        for (int k = 0; k < SCALAR_BLOCK; k++) {
+            float dx = x[j] - xi[k];
+            float dy = y[j] - yi[k];
+            float dz = z[j] - zi[k];
+            float mag_sq = dx * dx + dy * dy + dz * dz + PBodies::EPS;
+            float f_gravity_j = mass[j] / std::sqrt(mag_sq * mag_sq * mag_sq);
+            sum_x[k] += dx * f_gravity_j;
+            sum_y[k] += dy * f_gravity_j;
+            sum_z[k] += dz * f_gravity_j;
+        }
+    }
+    add_block(sum_x, sum_y, sum_z, i, SCALAR_BLOCK, targets, ax, ay, az);
+}
+
+static void gravity_scalar(const float *x, const float *y, const float *z, const float *mass,
+                           int n, int targets, float *ax, float *ay, float *az)
+{
+#pragma omp parallel for
+    for (int i = 0; i < targets; i++) {
+        auto sum_x = 0.0f, sum_y = 0.0f, sum_z = 0.0f;
+        for (int j = 0; j < n; j++) {
+            float dx = x[j] - x[i];
+            float dy = y[j] - y[i];
+            float dz = z[j] - z[i];
+            float mag_sq = dx * dx + dy * dy + dz * dz + PBodies::EPS;
+            float f_gravity_j = mass[j] / std::sqrt(mag_sq * mag_sq * mag_sq);
+            sum_x += dx * f_gravity_j;
+            sum_y += dy * f_gravity_j;
+            sum_z += dz * f_gravity_j;
+        }
+        ax[i] += sum_x;
+        ay[i] += sum_y;
+        az[i] += sum_z;
+    }
+}
+
+#ifdef GRAVITY_X86_SIMD
+__attribute__((target("avx2,fma"))) static float horizontal_sum(__m256 v)
+{
+    auto sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_hadd_ps(sum, sum);
+    sum = _mm_hadd_ps(sum, sum);
+    return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma"))) static void gravity_avx2(const float *x, const float *y,
+                                                             const float *z, const float *mass,
+                                                             int n, int targets, float *ax,
+                                                             float *ay, float *az)
+{
+    auto eps = _mm256_set1_ps(PBodies::EPS);
+    auto half = _mm256_set1_ps(0.5f);
+    auto three_halves = _mm256_set1_ps(1.5f);
+
+#pragma omp parallel for
+    for (int i = 0; i < targets; i++) {
+        auto xi = _mm256_set1_ps(x[i]);
+        auto yi = _mm256_set1_ps(y[i]);
+        auto zi = _mm256_set1_ps(z[i]);
+        auto sum_x = _mm256_setzero_ps();
+        auto sum_y = _mm256_setzero_ps();
+        auto sum_z = _mm256_setzero_ps();
+
+        for (int j = 0; j < n; j += 8) {
+            auto dx = _mm256_sub_ps(_mm256_loadu_ps(x + j), xi);
+            auto dy = _mm256_sub_ps(_mm256_loadu_ps(y + j), yi);
+            auto dz = _mm256_sub_ps(_mm256_loadu_ps(z + j), zi);
+            auto mag_sq = _mm256_fmadd_ps(dx, dx, eps);
+            mag_sq = _mm256_fmadd_ps(dy, dy, mag_sq);
+            mag_sq = _mm256_fmadd_ps(dz, dz, mag_sq);
+
+            // 1/r to ~12 bits, then one Newton-Raphson step: r' = r * (1.5 - 0.5 * x * r * r)
+            auto inv_mag = _mm256_rsqrt_ps(mag_sq);
+            auto half_x = _mm256_mul_ps(half, mag_sq);
+            inv_mag = _mm256_mul_ps(
+                inv_mag,
+                _mm256_fnmadd_ps(half_x, _mm256_mul_ps(inv_mag, inv_mag), three_halves));
+
+            auto inv_mag_cubed = _mm256_mul_ps(inv_mag, _mm256_mul_ps(inv_mag, inv_mag));
+            auto f_gravity_j = _mm256_mul_ps(_mm256_loadu_ps(mass + j), inv_mag_cubed);
+            sum_x = _mm256_fmadd_ps(dx, f_gravity_j, sum_x);
+            sum_y = _mm256_fmadd_ps(dy, f_gravity_j, sum_y);
+            sum_z = _mm256_fmadd_ps(dz, f_gravity_j, sum_z);
+        }
+
+        ax[i] += horizontal_sum(sum_x);
+        ay[i] += horizontal_sum(sum_y);
+        az[i] += horizontal_sum(sum_z);
+    }
+}
+
+__attribute__((target("avx512f"))) static void gravity_avx512(const float *x, const float *y,
+                                                              const float *z, const float *mass,
+                                                              int n, int targets, float *ax,
+                                                              float *ay, float *az)
+{
+    auto eps = _mm512_set1_ps(PBodies::EPS);
+    auto half = _mm512_set1_ps(0.5f);
+    auto three_halves = _mm512_set1_ps(1.5f);
+
+#pragma omp parallel for
+    for (int i = 0; i < targets; i++) {
+        auto xi = _mm512_set1_ps(x[i]);
+        auto yi = _mm512_set1_ps(y[i]);
+        auto zi = _mm512_set1_ps(z[i]);
+        auto sum_x = _mm512_setzero_ps();
+        auto sum_y = _mm512_setzero_ps();
+        auto sum_z = _mm512_setzero_ps();
+
+        for (int j = 0; j < n; j += 16) {
+            auto dx = _mm512_sub_ps(_mm512_loadu_ps(x + j), xi);
+            auto dy = _mm512_sub_ps(_mm512_loadu_ps(y + j), yi);
+            auto dz = _mm512_sub_ps(_mm512_loadu_ps(z + j), zi);
+            auto mag_sq = _mm512_fmadd_ps(dx, dx, eps);
+            mag_sq = _mm512_fmadd_ps(dy, dy, mag_sq);
+            mag_sq = _mm512_fmadd_ps(dz, dz, mag_sq);
+
+            // 1/r to ~14 bits, then one Newton-Raphson step
+            auto inv_mag = _mm512_rsqrt14_ps(mag_sq);
+            auto half_x = _mm512_mul_ps(half, mag_sq);
+            inv_mag = _mm512_mul_ps(
+                inv_mag,
+                _mm512_fnmadd_ps(half_x, _mm512_mul_ps(inv_mag, inv_mag), three_halves));
+
+            auto inv_mag_cubed = _mm512_mul_ps(inv_mag, _mm512_mul_ps(inv_mag, inv_mag));
+            auto f_gravity_j = _mm512_mul_ps(_mm512_loadu_ps(mass + j), inv_mag_cubed);
+            sum_x = _mm512_fmadd_ps(dx, f_gravity_j, sum_x);
+            sum_y = _mm512_fmadd_ps(dy, f_gravity_j, sum_y);
+            sum_z = _mm512_fmadd_ps(dz, f_gravity_j, sum_z);
+        }
+
+        ax[i] += _mm512_reduce_add_ps(sum_x);
+        ay[i] += _mm512_reduce_add_ps(sum_y);
+        az[i] += _mm512_reduce_add_ps(sum_z);
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void block_avx2(
+    const float *tx, const float *ty, const float *tz, const float *x, const float *y,
+    const float *z, const float *mass, int i, int j_begin, int j_end, int targets, float *ax,
+    float *ay, float *az)
+{
+    auto eps = _mm256_set1_ps(PBodies::EPS);
+    auto half = _mm256_set1_ps(0.5f);
+    auto three_halves = _mm256_set1_ps(1.5f);
+
+    auto xi = _mm256_loadu_ps(tx + i);
+    auto yi = _mm256_loadu_ps(ty + i);
+    auto zi = _mm256_loadu_ps(tz + i);
+    auto sum_x = _mm256_setzero_ps();
+    auto sum_y = _mm256_setzero_ps();
+    auto sum_z = _mm256_setzero_ps();
+
+    for (int j = j_begin; j < j_end; j++) {
+        auto dx = _mm256_sub_ps(_mm256_broadcast_ss(x + j), xi);
+        auto dy = _mm256_sub_ps(_mm256_broadcast_ss(y + j), yi);
+        auto dz = _mm256_sub_ps(_mm256_broadcast_ss(z + j), zi);
+        auto mag_sq = _mm256_fmadd_ps(dx, dx, eps);
+        mag_sq = _mm256_fmadd_ps(dy, dy, mag_sq);
+        mag_sq = _mm256_fmadd_ps(dz, dz, mag_sq);
+
+        auto inv_mag = _mm256_rsqrt_ps(mag_sq);
+        auto half_x = _mm256_mul_ps(half, mag_sq);
+        inv_mag = _mm256_mul_ps(
+            inv_mag, _mm256_fnmadd_ps(half_x, _mm256_mul_ps(inv_mag, inv_mag), three_halves));
+
+        auto inv_mag_cubed = _mm256_mul_ps(inv_mag, _mm256_mul_ps(inv_mag, inv_mag));
+        auto f_gravity_j = _mm256_mul_ps(_mm256_broadcast_ss(mass + j), inv_mag_cubed);
+        sum_x = _mm256_fmadd_ps(dx, f_gravity_j, sum_x);
+        sum_y = _mm256_fmadd_ps(dy, f_gravity_j, sum_y);
+        sum_z = _mm256_fmadd_ps(dz, f_gravity_j, sum_z);
+    }
+
+    alignas(32) float out_x[8], out_y[8], out_z[8];
+    _mm256_store_ps(out_x, sum_x);
+    _mm256_store_ps(out_y, sum_y);
+    _mm256_store_ps(out_z, sum_z);
+    add_block(out_x, out_y, out_z, i, 8, targets, ax, ay, az);
+}
+
+__attribute__((target("avx512f"))) static void block_avx512(
+    const float *tx, const float *ty, const float *tz, const float *x, const float *y,
+    const float *z, const float *mass, int i, int j_begin, int j_end, int targets, float *ax,
+    float *ay, float *az)
+{
+    auto eps = _mm512_set1_ps(PBodies::EPS);
+    auto half = _mm512_set1_ps(0.5f);
+    auto three_halves = _mm512_set1_ps(1.5f);
+
+    auto xi = _mm512_loadu_ps(tx + i);
+    auto yi = _mm512_loadu_ps(ty + i);
+    auto zi = _mm512_loadu_ps(tz + i);
+    auto sum_x = _mm512_setzero_ps();
+    auto sum_y = _mm512_setzero_ps();
+    auto sum_z = _mm512_setzero_ps();
+
+    for (int j = j_begin; j < j_end; j++) {
+        auto dx = _mm512_sub_ps(_mm512_set1_ps(x[j]), xi);
+        auto dy = _mm512_sub_ps(_mm512_set1_ps(y[j]), yi);
+        auto dz = _mm512_sub_ps(_mm512_set1_ps(z[j]), zi);
+        auto mag_sq = _mm512_fmadd_ps(dx, dx, eps);
+        mag_sq = _mm512_fmadd_ps(dy, dy, mag_sq);
+        mag_sq = _mm512_fmadd_ps(dz, dz, mag_sq);
+
+        auto inv_mag = _mm512_rsqrt14_ps(mag_sq);
+        auto half_x = _mm512_mul_ps(half, mag_sq);
+        inv_mag = _mm512_mul_ps(
+            inv_mag, _mm512_fnmadd_ps(half_x, _mm512_mul_ps(inv_mag, inv_mag), three_halves));
+
+        auto inv_mag_cubed = _mm512_mul_ps(inv_mag, _mm512_mul_ps(inv_mag, inv_mag));
+        auto f_gravity_j = _mm512_mul_ps(_mm512_set1_ps(mass[j]), inv_mag_cubed);
+        sum_x = _mm512_fmadd_ps(dx, f_gravity_j, sum_x);
+        sum_y = _mm512_fmadd_ps(dy, f_gravity_j, sum_y);
+        sum_z = _mm512_fmadd_ps(dz, f_gravity_j, sum_z);
+    }
+
+    alignas(64) float out_x[16], out_y[16], out_z[16];
+    _mm512_store_ps(out_x, sum_x);
+    _mm512_store_ps(out_y, sum_y);
+    _mm512_store_ps(out_z, sum_z);
+    add_block(out_x, out_y, out_z, i, 16, targets, ax, ay, az);
+}
+#endif
+
+struct kernel_choice {
+    gravity_kernel kernel;
+    block_kernel block;
+    int block_width;
+    const char *isa;
+};
+
+static kernel_choice pick_kernel()
+{
+#ifdef GRAVITY_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return {gravity_avx512, block_avx512, 16, "avx512"};
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return {gravity_avx2, block_avx2, 8, "avx2"};
+#endif
+    return {gravity_scalar, block_scalar, SCALAR_BLOCK, "scalar"};
+}
+
+static const kernel_choice &selected_kernel()
+{
+    static const auto choice = pick_kernel();
+    return choice;
+}
+
+void simd_gravity(const float *x, const float *y, const float *z, const float *mass, int n,
+                  int targets, float *ax, float *ay, float *az)
+{
+    selected_kernel().kernel(x, y, z, mass, n, targets, ax, ay, az);
+}
+
+void simd_gravity_range(const float *x, const float *y, const float *z, const float *mass, int n,
+                        int first, int last, float *ax, float *ay, float *az)
+{
+    auto &choice = selected_kernel();
+    auto width = choice.block_width;
+    auto first_block = first / width;
+    auto last_block = (last + width - 1) / width;
+
+#pragma omp parallel for schedule(static)
+    for (int b = first_block; b < last_block; b++)
+        choice.block(x, y, z, x, y, z, mass, b * width, 0, n, last, ax, ay, az);
+}
+
+void simd_gravity_sources(const float *tx, const float *ty, const float *tz, int targets,
+                          const float *x, const float *y, const float *z, const float *mass, int n,
+                          float *ax, float *ay, float *az)
+{
+    auto &choice = selected_kernel();
+    auto width = choice.block_width;
+    auto blocks = (targets + width - 1) / width;
+
+#pragma omp parallel for schedule(static)
+    for (int b = 0; b < blocks; b++)
+        choice.block(tx, ty, tz, x, y, z, mass, b * width, 0, n, targets, ax, ay, az);
+}
+
+void tiled_gravity(const float *x, const float *y, const float *z, const float *mass, int n,
+                   int targets, float *ax, float *ay, float *az, int tile_size)
+{
+    auto &choice = selected_kernel();
+    auto width = choice.block_width;
+    auto blocks = (targets + width - 1) / width;
+
+    // Blocks are split statically so each thread reuses a source tile for all of its blocks
+    // before moving on to the next tile
+#pragma omp parallel
+    {
+        auto thread = 0, threads = 1;
+#ifdef _OPENMP
+        thread = omp_get_thread_num();
+        threads = omp_get_num_threads();
+#endif
+        auto first = static_cast<int>(static_cast<long>(blocks) * thread / threads);
+        auto last = static_cast<int>(static_cast<long>(blocks) * (thread + 1) / threads);
+        for (int j_begin = 0; j_begin < n; j_begin += tile_size) {
+            auto j_end = std::min(n, j_begin + tile_size);
+            for (int b = first; b < last; b++)
+                choice.block(x, y, z, x, y, z, mass, b * width, j_begin, j_end, targets, ax, ay,
+                             az);
+        }
+    }
+}
+
+void simd_gravity_mixed(mixed_bodies &bodies)
+{
+    auto &choice = selected_kernel();
+    auto width = choice.block_width;
+    auto n = bodies.size();
+    auto blocks = (n + width - 1) / width;
+    auto &narrowed = bodies.narrowed_positions();
+    const float *x = narrowed.x(), *y = narrowed.y(), *z = narrowed.z();
+    const float *mass = bodies.mass.data();
+    double *ax = bodies.acc.x(), *ay = bodies.acc.y(), *az = bodies.acc.z();
+
+#pragma omp parallel for schedule(static)
+    for (int b = 0; b < blocks; b++) {
+        auto i = b * width;
+        auto lanes = std::min(width, n - i);
+        for (int j_begin = 0; j_begin < n; j_begin += mixed_bodies::SUM_BLOCK) {
+            auto j_end = std::min(n, j_begin + mixed_bodies::SUM_BLOCK);
+            // The kernel adds the block's sums to lanes [0, lanes) of these
+            float sum_x[SIMD_WIDTH] = {}, sum_y[SIMD_WIDTH] = {}, sum_z[SIMD_WIDTH] = {};
+            choice.block(x + i, y + i, z + i, x, y, z, mass, 0, j_begin, j_end, lanes, sum_x,
+                         sum_y, sum_z);
+            for (int k = 0; k < lanes; k++) {
+                ax[i + k] += sum_x[k];
+                ay[i + k] += sum_y[k];
+                az[i + k] += sum_z[k];
+            }
+        }
+    }
+}
+
+int default_tile_size()
+{
+    auto l2_size = 0L;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    l2_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (l2_size <= 0)
+        l2_size = 256 * 1024;
+
+    // x, y, z and mass are 16 bytes per source body
+    auto tile = static_cast<int>(l2_size / 2 / 16);
+    return std::max(PBodies::PADDING, tile / PBodies::PADDING * PBodies::PADDING);
+}
+
+const char *simd_gravity_isa()
+{
+    return selected_kernel().isa;
+}
+
+int simd_gravity_block_width()
+{
+    return selected_kernel().block_width;
+}
+
+void simd_solver::compute(PBodies &bodies)
+{
+    simd_gravity(bodies.pos.x(), bodies.pos.y(), bodies.pos.z(), bodies.mass.data(),
+                 bodies.padded_size(), bodies.size(), bodies.acc.x(), bodies.acc.y(),
+                 bodies.acc.z());
+}
+
+const char *simd_solver::name()
+{
+    return simd_gravity_isa();
+}
+
+tiled_solver::tiled_solver(int tile_size)
+    : tile_size{tile_size > 0 ? tile_size : default_tile_size()}
+{
+}
+
+void tiled_solver::compute(PBodies &bodies)
+{
+    tiled_gravity(bodies.pos.x(), bodies.pos.y(), bodies.pos.z(), bodies.mass.data(),
+                  bodies.size(), bodies.size(), bodies.acc.x(), bodies.acc.y(), bodies.acc.z(),
+                  tile_size);
+}
+
+const char *tiled_solver::name()
+{
+    return "tiled";
+}
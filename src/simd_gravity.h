@@ -0,0 +1,67 @@
+#ifndef GRAVITY_SIMD_GRAVITY_H
+#define GRAVITY_SIMD_GRAVITY_H
+
+#include "pobject.h"
+#include "solver.h"
+
+// Direct summation over structure-of-arrays positions. Sources are processed 16 (AVX-512) or
+// 8 (AVX2) at a time using a fast reciprocal square root refined with one Newton-Raphson step.
+// n must be a multiple of SIMD_WIDTH, with any padding bodies given zero mass, which
+// PBodies::padded_size guarantees.
+void simd_gravity(const float *x, const float *y, const float *z, const float *mass, int n,
+                  int targets, float *ax, float *ay, float *az);
+
+// Same sum, cache blocked: each thread keeps a block of targets in vector registers and walks
+// the sources in tiles of tile_size bodies, so a tile stays in L1/L2 while it is reused by
+// every block the thread owns.
+void tiled_gravity(const float *x, const float *y, const float *z, const float *mass, int n,
+                   int targets, float *ax, float *ay, float *az, int tile_size);
+
+// simd_gravity for targets [first, last) only, threaded over blocks of targets. first must be a
+// multiple of SIMD_WIDTH.
+void simd_gravity_range(const float *x, const float *y, const float *z, const float *mass, int n,
+                        int first, int last, float *ax, float *ay, float *az);
+
+// Adds the pull of n sources on targets bodies held in separate arrays. The target arrays must be
+// readable up to a multiple of SIMD_WIDTH, as PBodies arrays are.
+void simd_gravity_sources(const float *tx, const float *ty, const float *tz, int targets,
+                          const float *x, const float *y, const float *z, const float *mass, int n,
+                          float *ax, float *ay, float *az);
+
+// Direct sum for mixed precision bodies: the same block kernels evaluate the pair terms in float
+// lanes on the narrowed positions, each block of targets sums SUM_BLOCK sources at a time in
+// float, and those partial sums are added into the double accelerations
+void simd_gravity_mixed(mixed_bodies &bodies);
+
+// Source tile size that fits in half of the L2 cache
+int default_tile_size();
+
+// Name of the instruction set simd_gravity picked for this CPU
+const char *simd_gravity_isa();
+
+// Targets the picked kernel keeps in registers, each source load is shared by all of them
+int simd_gravity_block_width();
+
+constexpr int SIMD_WIDTH = 16;
+static_assert(PBodies::PADDING % SIMD_WIDTH == 0, "PBodies padding must fit the widest kernel");
+
+class simd_solver : public gravity_solver
+{
+public:
+    void compute(PBodies &bodies) override;
+    const char *name() override;
+};
+
+class tiled_solver : public gravity_solver
+{
+public:
+    // tile_size <= 0 picks one from the cache size
+    tiled_solver(int tile_size);
+    void compute(PBodies &bodies) override;
+    const char *name() override;
+
+private:
+    int tile_size;
+};
+
+#endif  // GRAVITY_SIMD_GRAVITY_H
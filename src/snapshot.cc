@@ -0,0 +1,217 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "snapshot.h"
+
+static_assert(sizeof(snapshot_header) <= SNAPSHOT_ALIGNMENT, "snapshot header must fit a page");
+static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "colors are stored as packed floats");
+
+static uint64_t align_up(uint64_t offset)
+{
+    return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+}
+
+static std::runtime_error file_error(const std::string &message, const std::string &path)
+{
+    return std::runtime_error{message + " " + path + ": " + std::strerror(errno)};
+}
+
+static void write_file(const std::string &path, const std::vector<char> &image)
+{
+    auto temp = path + ".tmp";
+    auto fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw file_error("could not create", temp);
+
+    auto data = image.data();
+    auto left = image.size();
+    while (left > 0) {
+        auto written = ::write(fd, data, left);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0) {
+            close(fd);
+            throw file_error("could not write", temp);
+        }
+        data += written;
+        left -= written;
+    }
+
+    // The rename must not reach the disk before the data does
+    if (fsync(fd) < 0) {
+        close(fd);
+        throw file_error("could not sync", temp);
+    }
+    close(fd);
+    if (std::rename(temp.c_str(), path.c_str()) < 0)
+        throw file_error("could not rename snapshot to", path);
+}
+
+snapshot_writer::snapshot_writer() : in_flight{0}
+{
+}
+
+// Still lets a write in progress finish, but errors can no longer be reported
+snapshot_writer::~snapshot_writer()
+{
+    if (worker.joinable())
+        worker.join();
+}
+
+void snapshot_writer::write(PBodies &bodies, const std::string &path, uint64_t step, double time)
+{
+    wait();
+
+    auto stride = static_cast<uint64_t>(bodies.padded_size());
+    auto count = static_cast<uint64_t>(bodies.size());
+    auto vec_bytes = 3 * stride * sizeof(float);
+
+    auto header = snapshot_header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.count = count;
+    header.stride = stride;
+    header.step = step;
+    header.time = time;
+    header.pos_offset = SNAPSHOT_ALIGNMENT;
+    header.vel_offset = align_up(header.pos_offset + vec_bytes);
+    header.mass_offset = align_up(header.vel_offset + vec_bytes);
+    header.color_offset = align_up(header.mass_offset + stride * sizeof(float));
+    header.file_size = align_up(header.color_offset + count * sizeof(glm::vec3));
+
+    image.assign(header.file_size, 0);
+    std::memcpy(image.data(), &header, sizeof(header));
+    std::memcpy(image.data() + header.pos_offset, bodies.pos.data.data(), vec_bytes);
+    std::memcpy(image.data() + header.vel_offset, bodies.vel.data.data(), vec_bytes);
+    std::memcpy(image.data() + header.mass_offset, bodies.mass.data(), stride * sizeof(float));
+    std::memcpy(image.data() + header.color_offset, bodies.color.data(),
+                count * sizeof(glm::vec3));
+
+    in_flight = 1;
+    worker = std::thread{[this, path] {
+        try {
+            write_file(path, image);
+        } catch (std::exception &e) {
+            error = e.what();
+        }
+        in_flight = 0;
+    }};
+}
+
+// Errors from the background thread are reported here, where the caller can handle them
+void snapshot_writer::wait()
+{
+    if (worker.joinable())
+        worker.join();
+    if (!error.empty()) {
+        auto message = error;
+        error.clear();
+        throw std::runtime_error{message};
+    }
+}
+
+snapshot_file::snapshot_file(const std::string &path) : data{nullptr}, size{0}
+{
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw file_error("could not open", path);
+
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        close(fd);
+        throw file_error("could not stat", path);
+    }
+    size = info.st_size;
+    if (size < sizeof(snapshot_header)) {
+        close(fd);
+        throw std::runtime_error{path + " is too small to be a snapshot"};
+    }
+
+    auto mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        throw file_error("could not map", path);
+    data = static_cast<const char *>(mapped);
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    auto &h = header();
+    auto fail = [&](const char *message) {
+        munmap(mapped, size);
+        throw std::runtime_error{path + ": " + message};
+    };
+    if (std::memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0)
+        fail("not a gravity snapshot");
+    if (h.version != SNAPSHOT_VERSION)
+        fail("unsupported snapshot version");
+    if (h.byte_order != SNAPSHOT_BYTE_ORDER)
+        fail("snapshot was written with a different byte order");
+    if (h.file_size > size)
+        fail("snapshot is truncated");
+    // Every section has to lie inside the mapping. Sizes are checked against what is left after
+    // the offset, so a corrupt header cannot overflow the sums.
+    auto fits = [&](uint64_t offset, uint64_t elements, uint64_t element_size) {
+        return offset <= size && elements <= (size - offset) / element_size;
+    };
+    if (h.stride < h.count || h.stride > size / (3 * sizeof(float)) ||
+        !fits(h.pos_offset, 3 * h.stride, sizeof(float)) ||
+        !fits(h.vel_offset, 3 * h.stride, sizeof(float)) ||
+        !fits(h.mass_offset, h.stride, sizeof(float)) ||
+        !fits(h.color_offset, h.count, sizeof(glm::vec3)))
+        fail("snapshot header is inconsistent");
+}
+
+snapshot_file::~snapshot_file()
+{
+    munmap(const_cast<char *>(data), size);
+}
+
+const snapshot_header &snapshot_file::header() const
+{
+    return *reinterpret_cast<const snapshot_header *>(data);
+}
+
+const float *snapshot_file::positions() const
+{
+    return reinterpret_cast<const float *>(data + header().pos_offset);
+}
+
+const float *snapshot_file::velocities() const
+{
+    return reinterpret_cast<const float *>(data + header().vel_offset);
+}
+
+const float *snapshot_file::masses() const
+{
+    return reinterpret_cast<const float *>(data + header().mass_offset);
+}
+
+const float *snapshot_file::colors() const
+{
+    return reinterpret_cast<const float *>(data + header().color_offset);
+}
+
+void snapshot_file::restore(PBodies &bodies) const
+{
+    auto &h = header();
+    if (static_cast<uint64_t>(bodies.size()) != h.count ||
+        static_cast<uint64_t>(bodies.padded_size()) != h.stride)
+        throw std::runtime_error{"snapshot holds " + std::to_string(h.count) +
+                                 " bodies, not " + std::to_string(bodies.size())};
+
+    auto vec_bytes = 3 * h.stride * sizeof(float);
+    std::memcpy(bodies.pos.data.data(), positions(), vec_bytes);
+    std::memcpy(bodies.vel.data.data(), velocities(), vec_bytes);
+    std::memcpy(bodies.mass.data(), masses(), h.stride * sizeof(float));
+    std::memcpy(static_cast<void *>(bodies.color.data()), colors(), h.count * sizeof(glm::vec3));
+    std::fill(bodies.acc.data.begin(), bodies.acc.data.end(), 0.0f);
+}
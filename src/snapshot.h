@@ -0,0 +1,84 @@
+#ifndef GRAVITY_SNAPSHOT_H
+#define GRAVITY_SNAPSHOT_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pobject.h"
+
+// Binary snapshot of a simulation. A one page header is followed by the fields, each starting on
+// a page boundary and stored exactly as PBodies keeps them in memory:
+//   pos, vel  x, y and z planes of stride floats
+//   mass      stride floats, zero for padding bodies
+//   color     count interleaved r, g, b floats
+// Restoring is a single copy out of the mapped file, with no parsing.
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;  // SNAPSHOT_BYTE_ORDER as written by the host that saved the file
+    uint64_t count;
+    uint64_t stride;
+    uint64_t step;
+    double time;
+    uint64_t pos_offset, vel_offset, mass_offset, color_offset;
+    uint64_t file_size;
+};
+
+constexpr char SNAPSHOT_MAGIC[8] = {'G', 'R', 'A', 'V', 'S', 'N', 'A', 'P'};
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+constexpr uint64_t SNAPSHOT_ALIGNMENT = 4096;
+
+// Writes snapshots on a background thread. The bodies are copied before write returns, so the
+// simulation can carry on straight away. The file is written under a temporary name and renamed
+// into place once it is on disk, so a job killed mid-write still leaves the previous snapshot.
+class snapshot_writer
+{
+public:
+    snapshot_writer();
+    ~snapshot_writer();
+
+    // Waits for the previous snapshot first, so at most one is ever in flight
+    void write(PBodies &bodies, const std::string &path, uint64_t step, double time);
+    void wait();
+
+    // Snapshots still being written, 0 or 1. Safe to call from any thread.
+    int queue_depth() const
+    {
+        return in_flight;
+    }
+
+private:
+    std::atomic<int> in_flight;
+    std::thread worker;
+    std::vector<char> image;
+    std::string error;
+};
+
+// A snapshot mapped read-only into memory
+class snapshot_file
+{
+public:
+    explicit snapshot_file(const std::string &path);
+    ~snapshot_file();
+    snapshot_file(const snapshot_file &) = delete;
+    snapshot_file &operator=(const snapshot_file &) = delete;
+
+    const snapshot_header &header() const;
+    const float *positions() const;
+    const float *velocities() const;
+    const float *masses() const;
+    const float *colors() const;
+
+    // Copy every field into bodies, which must have been created with header().count bodies
+    void restore(PBodies &bodies) const;
+
+private:
+    const char *data;
+    size_t size;
+};
+
+#endif  // GRAVITY_SNAPSHOT_H
@@ -0,0 +1,38 @@
+#include <stdexcept>
+
+#include "barnes_hut.h"
+#include "fmm.h"
+#include "simd_gravity.h"
+#include "symmetric_gravity.h"
+#include "solver.h"
+
+class direct_solver : public gravity_solver
+{
+public:
+    void compute(PBodies &bodies) override
+    {
+        bodies.computeGravity();
+    }
+
+    const char *name() override
+    {
+        return "direct";
+    }
+};
+
+std::unique_ptr<gravity_solver> make_solver(const solver_options &options)
+{
+    if (options.name == "direct")
+        return std::make_unique<direct_solver>();
+    if (options.name == "simd")
+        return std::make_unique<simd_solver>();
+    if (options.name == "tiled")
+        return std::make_unique<tiled_solver>(options.tile_size);
+    if (options.name == "symmetric")
+        return std::make_unique<symmetric_solver>();
+    if (options.name == "bh")
+        return std::make_unique<barnes_hut>(options.theta, options.leaf_size);
+    if (options.name == "fmm")
+        return std::make_unique<fmm>(options.order, options.theta, options.leaf_size);
+    throw std::runtime_error{"unknown solver: " + options.name};
+}
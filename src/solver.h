@@ -0,0 +1,30 @@
+#ifndef GRAVITY_SOLVER_H
+#define GRAVITY_SOLVER_H
+
+#include <memory>
+#include <string>
+
+#include "pobject.h"
+
+// Computes the gravitational acceleration of every body for one step. Implementations accumulate
+// into PBodies::acc (without G), the same as PBodies::computeGravity, so PBodies::integrate can
+// be used with any of them.
+class gravity_solver
+{
+public:
+    virtual ~gravity_solver() = default;
+    virtual void compute(PBodies &bodies) = 0;
+    virtual const char *name() = 0;
+};
+
+struct solver_options {
+    std::string name;  // direct, simd, tiled, symmetric, bh, fmm
+    float theta;       // Barnes-Hut opening angle, or FMM cell separation criterion
+    int leaf_size;     // Maximum number of bodies in an octree leaf
+    int order;         // FMM expansion order
+    int tile_size;     // Source bodies per cache tile, 0 to size tiles from the L2 cache
+};
+
+std::unique_ptr<gravity_solver> make_solver(const solver_options &options);
+
+#endif  // GRAVITY_SOLVER_H
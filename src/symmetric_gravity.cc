@@ -0,0 +1,82 @@
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "symmetric_gravity.h"
+
+void symmetric_solver::compute(PBodies &bodies)
+{
+    auto n = bodies.size();
+    auto threads = 1;
+
+    const float *px = bodies.pos.x(), *py = bodies.pos.y(), *pz = bodies.pos.z();
+    const float *mass = bodies.mass.data();
+
+#pragma omp parallel
+    {
+        auto thread = 0;
+#ifdef _OPENMP
+        thread = omp_get_thread_num();
+#endif
+        // The team may be smaller than omp_get_max_threads, so only its own buffers are used
+#pragma omp single
+        {
+#ifdef _OPENMP
+            threads = omp_get_num_threads();
+#endif
+            buffers.resize(threads);
+        }
+        auto &buffer = buffers[thread];
+        buffer.resize(bodies.padded_size());
+        float *bx = buffer.x(), *by = buffer.y(), *bz = buffer.z();
+
+        // Row i has n - 1 - i pairs, so hand out small chunks to keep the threads balanced
+#pragma omp for schedule(dynamic, 16)
+        for (int i = 0; i < n; i++) {
+            float xi = px[i], yi = py[i], zi = pz[i], mi = mass[i];
+            float sum_x = 0.0f, sum_y = 0.0f, sum_z = 0.0f;
+
+#pragma omp simd reduction(+ : sum_x, sum_y, sum_z)
+            for (int j = i + 1; j < n; j++) {
+                float dx = px[j] - xi;
+                float dy = py[j] - yi;
+                float dz = pz[j] - zi;
+                float mag_sq = dx * dx + dy * dy + dz * dz + PBodies::EPS;
+                float inv_mag_cubed = 1.0f / std::sqrt(mag_sq * mag_sq * mag_sq);
+
+                // j pulls i towards j, i pulls j the opposite way
+                float f_i = mass[j] * inv_mag_cubed;
+                float f_j = mi * inv_mag_cubed;
+                sum_x += dx * f_i;
+                sum_y += dy * f_i;
+                sum_z += dz * f_i;
+                bx[j] -= dx * f_j;
+                by[j] -= dy * f_j;
+                bz[j] -= dz * f_j;
+            }
+
+            bx[i] += sum_x;
+            by[i] += sum_y;
+            bz[i] += sum_z;
+        }
+
+        // The implicit barrier above means every buffer is complete, reduce them per body
+        float *ax = bodies.acc.x(), *ay = bodies.acc.y(), *az = bodies.acc.z();
+#pragma omp for
+        for (int i = 0; i < n; i++) {
+            for (int t = 0; t < threads; t++) {
+                auto &b = buffers[t];
+                ax[i] += b.x()[i];
+                ay[i] += b.y()[i];
+                az[i] += b.z()[i];
+            }
+        }
+    }
+}
+
+const char *symmetric_solver::name()
+{
+    return "symmetric";
+}
@@ -0,0 +1,22 @@
+#ifndef GRAVITY_SYMMETRIC_GRAVITY_H
+#define GRAVITY_SYMMETRIC_GRAVITY_H
+
+#include <vector>
+
+#include "pobject.h"
+#include "solver.h"
+
+// Direct summation that evaluates each pair once and applies equal and opposite contributions
+// to both bodies, halving the work of PBodies::computeGravity. Every thread accumulates into its
+// own buffer, and the buffers are summed at the end of the step, so no atomics are needed.
+class symmetric_solver : public gravity_solver
+{
+public:
+    void compute(PBodies &bodies) override;
+    const char *name() override;
+
+private:
+    std::vector<vec3_array> buffers;  // One per thread
+};
+
+#endif  // GRAVITY_SYMMETRIC_GRAVITY_H
@@ -0,0 +1,571 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include "trajectory.h"
+
+// Quotients this large are written as an escape code followed by the raw 32-bit value, which
+// bounds the cost of outliers such as the first frame after a body is flung far away
+static constexpr int RICE_ESCAPE = 32;
+
+class bit_writer
+{
+public:
+    explicit bit_writer(std::vector<uint8_t> &out) : out{out}, acc{0}, bits{0}
+    {
+    }
+
+    // n <= 32
+    void put(uint64_t value, int n)
+    {
+        acc |= value << bits;
+        bits += n;
+        while (bits >= 8) {
+            out.push_back(static_cast<uint8_t>(acc));
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+
+    void flush()
+    {
+        if (bits > 0)
+            out.push_back(static_cast<uint8_t>(acc));
+        acc = 0;
+        bits = 0;
+    }
+
+private:
+    std::vector<uint8_t> &out;
+    uint64_t acc;
+    int bits;
+};
+
+class bit_reader
+{
+public:
+    bit_reader(const uint8_t *data, size_t size) : p{data}, end{data + size}, acc{0}, bits{0}
+    {
+    }
+
+    uint32_t get(int n)
+    {
+        refill();
+        auto value = static_cast<uint32_t>(acc & ((uint64_t{1} << n) - 1));
+        acc >>= n;
+        bits -= n;
+        return value;
+    }
+
+    // Count leading one bits up to limit, consuming the terminating zero if there is one
+    int ones(int limit)
+    {
+        refill();
+        auto run = ~acc == 0 ? 64 : __builtin_ctzll(~acc);
+        auto q = std::min(run, limit);
+        auto used = q < limit ? q + 1 : q;
+        acc >>= used;
+        bits -= used;
+        return q;
+    }
+
+private:
+    const uint8_t *p, *end;
+    uint64_t acc;
+    int bits;
+
+    void refill()
+    {
+        while (bits <= 56) {
+            acc |= static_cast<uint64_t>(p < end ? *p++ : 0) << bits;
+            bits += 8;
+        }
+    }
+};
+
+static uint32_t zigzag(int32_t v)
+{
+    return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t u)
+{
+    return static_cast<int32_t>((u >> 1) ^ (~(u & 1) + 1));
+}
+
+// The Rice parameter closest to optimal for a geometric distribution with this mean
+static int rice_parameter(const uint32_t *values, int n)
+{
+    auto sum = uint64_t{0};
+    for (int i = 0; i < n; i++)
+        sum += values[i];
+    auto mean = n > 0 ? static_cast<double>(sum) / n : 0.0;
+    auto k = 0;
+    while (k < 31 && static_cast<double>(uint64_t{1} << (k + 1)) <= mean * 0.69)
+        k++;
+    return k;
+}
+
+static void rice_encode(const uint32_t *values, int n, int k, std::vector<uint8_t> &out)
+{
+    auto writer = bit_writer{out};
+    for (int i = 0; i < n; i++) {
+        auto q = values[i] >> k;
+        if (q < RICE_ESCAPE) {
+            writer.put((uint64_t{1} << q) - 1, q + 1);  // q ones and the terminating zero
+            writer.put(values[i] & ((uint64_t{1} << k) - 1), k);
+        } else {
+            writer.put((uint64_t{1} << RICE_ESCAPE) - 1, RICE_ESCAPE);
+            writer.put(values[i], 32);
+        }
+    }
+    writer.flush();
+}
+
+static void rice_decode(const uint8_t *data, size_t size, int k, int n, uint32_t *values)
+{
+    auto reader = bit_reader{data, size};
+    for (int i = 0; i < n; i++) {
+        auto q = static_cast<uint32_t>(reader.ones(RICE_ESCAPE));
+        if (q < RICE_ESCAPE)
+            values[i] = (q << k) | reader.get(k);
+        else
+            values[i] = reader.get(32);
+    }
+}
+
+static int chunks_of(int count)
+{
+    return (count + TRAJECTORY_CHUNK_SIZE - 1) / TRAJECTORY_CHUNK_SIZE;
+}
+
+// Size of the header and chunk table that precede the coded chunks
+static size_t frame_table_size(int chunks)
+{
+    auto table = sizeof(trajectory_frame_header) + 3 * chunks * (sizeof(uint32_t) + 1);
+    return (table + 7) / 8 * 8;
+}
+
+// Saturates at the int32 range, counting the coordinates that did in clamped
+static int32_t quantize(float v, double inv_quantum, uint64_t &clamped)
+{
+    auto q = std::nearbyint(static_cast<double>(v) * inv_quantum);
+    auto low = static_cast<double>(std::numeric_limits<int32_t>::min());
+    auto high = static_cast<double>(std::numeric_limits<int32_t>::max());
+    if (q < low || q > high) {
+        clamped++;
+        q = std::min(std::max(q, low), high);
+    }
+    return static_cast<int32_t>(q);
+}
+
+// Deltas wrap around modulo 2^32, so they are defined for any two quantized values and the
+// decoder's wrapping sum gets the value back exactly
+static int32_t wrapping_delta(int32_t to, int32_t from)
+{
+    return static_cast<int32_t>(static_cast<uint32_t>(to) - static_cast<uint32_t>(from));
+}
+
+static int32_t wrapping_sum(int32_t a, int32_t b)
+{
+    return static_cast<int32_t>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b));
+}
+
+trajectory_encoder::trajectory_encoder(int count, float quantum, int keyframe_interval)
+    : count{count},
+      quantum{quantum},
+      keyframe_interval{std::max(1, keyframe_interval)},
+      frames{0},
+      clamped_total{0},
+      previous(3 * static_cast<size_t>(count), 0)
+{
+}
+
+void trajectory_encoder::encode(const float *x, const float *y, const float *z, uint64_t step,
+                                std::vector<char> &out)
+{
+    auto keyframe = frames % keyframe_interval == 0;
+    auto chunks = chunks_of(count);
+    auto coded = std::vector<std::vector<uint8_t>>(3 * chunks);
+    auto parameters = std::vector<uint8_t>(3 * chunks);
+    const float *axes[3] = {x, y, z};
+    auto inv_quantum = 1.0 / quantum;
+    auto clamped = uint64_t{0};
+
+#pragma omp parallel for schedule(dynamic) reduction(+ : clamped)
+    for (int c = 0; c < 3 * chunks; c++) {
+        auto axis = c / chunks;
+        auto begin = (c % chunks) * static_cast<int>(TRAJECTORY_CHUNK_SIZE);
+        auto n = std::min(count - begin, static_cast<int>(TRAJECTORY_CHUNK_SIZE));
+        auto prev = previous.data() + static_cast<size_t>(axis) * count + begin;
+        auto values = std::vector<uint32_t>(n);
+        for (int i = 0; i < n; i++) {
+            auto q = quantize(axes[axis][begin + i], inv_quantum, clamped);
+            values[i] = zigzag(keyframe ? q : wrapping_delta(q, prev[i]));
+            prev[i] = q;
+        }
+        auto k = rice_parameter(values.data(), n);
+        parameters[c] = static_cast<uint8_t>(k);
+        coded[c].reserve(n);
+        rice_encode(values.data(), n, k, coded[c]);
+    }
+
+    auto header = trajectory_frame_header{};
+    header.magic = TRAJECTORY_FRAME_MAGIC;
+    header.flags = keyframe ? TRAJECTORY_KEYFRAME : 0;
+    header.step = step;
+    header.size = frame_table_size(chunks);
+    for (auto &chunk : coded)
+        header.size += chunk.size();
+
+    auto start = out.size();
+    out.resize(start + frame_table_size(chunks), 0);
+    auto table = out.data() + start;
+    std::memcpy(table, &header, sizeof(header));
+    table += sizeof(header);
+    for (auto &chunk : coded) {
+        auto size = static_cast<uint32_t>(chunk.size());
+        std::memcpy(table, &size, sizeof(size));
+        table += sizeof(size);
+    }
+    std::memcpy(table, parameters.data(), parameters.size());
+    for (auto &chunk : coded)
+        out.insert(out.end(), chunk.begin(), chunk.end());
+    frames++;
+    clamped_total += clamped;
+}
+
+trajectory_decoder::trajectory_decoder(int count, float quantum)
+    : count{count}, quantum{quantum}, current(3 * static_cast<size_t>(count), 0)
+{
+}
+
+uint64_t trajectory_decoder::decode(const char *frame, float *x, float *y, float *z)
+{
+    auto header = trajectory_frame_header{};
+    std::memcpy(&header, frame, sizeof(header));
+    if (header.magic != TRAJECTORY_FRAME_MAGIC)
+        throw std::runtime_error{"corrupt trajectory frame"};
+    auto keyframe = (header.flags & TRAJECTORY_KEYFRAME) != 0;
+
+    auto chunks = chunks_of(count);
+    auto sizes = std::vector<uint32_t>(3 * chunks);
+    std::memcpy(sizes.data(), frame + sizeof(header), sizes.size() * sizeof(uint32_t));
+    auto parameters = reinterpret_cast<const uint8_t *>(frame + sizeof(header) +
+                                                        sizes.size() * sizeof(uint32_t));
+    auto offsets = std::vector<size_t>(3 * chunks);
+    auto offset = frame_table_size(chunks);
+    for (int c = 0; c < 3 * chunks; c++) {
+        offsets[c] = offset;
+        offset += sizes[c];
+    }
+    if (offset != header.size)
+        throw std::runtime_error{"corrupt trajectory frame"};
+
+    float *axes[3] = {x, y, z};
+    auto data = reinterpret_cast<const uint8_t *>(frame);
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < 3 * chunks; c++) {
+        auto axis = c / chunks;
+        auto begin = (c % chunks) * static_cast<int>(TRAJECTORY_CHUNK_SIZE);
+        auto n = std::min(count - begin, static_cast<int>(TRAJECTORY_CHUNK_SIZE));
+        auto values = std::vector<uint32_t>(n);
+        rice_decode(data + offsets[c], sizes[c], parameters[c], n, values.data());
+
+        auto q = current.data() + static_cast<size_t>(axis) * count + begin;
+        for (int i = 0; i < n; i++) {
+            q[i] = keyframe ? unzigzag(values[i]) : wrapping_sum(q[i], unzigzag(values[i]));
+            axes[axis][begin + i] = q[i] * quantum;
+        }
+    }
+    return header.step;
+}
+
+static std::runtime_error file_error(const std::string &message, const std::string &path)
+{
+    return std::runtime_error{message + " " + path + ": " + std::strerror(errno)};
+}
+
+static void write_all(int fd, const char *data, size_t bytes)
+{
+    while (bytes > 0) {
+        auto written = ::write(fd, data, bytes);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            throw std::runtime_error{std::string{"trajectory write failed: "} +
+                                     std::strerror(errno)};
+        data += written;
+        bytes -= written;
+    }
+}
+
+trajectory_writer::trajectory_writer(const std::string &path, PBodies &bodies, float quantum,
+                                     int keyframe_interval, int queue_depth)
+    : count{bodies.size()},
+      fd{-1},
+      encoder{bodies.size(), quantum, keyframe_interval},
+      frames(std::max(1, queue_depth)),
+      closing{false},
+      pending{0},
+      written{0},
+      dropped{0},
+      raw_bytes{0},
+      coded_bytes{0}
+{
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw file_error("could not create", path);
+
+    auto header = trajectory_header{};
+    std::memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    header.version = TRAJECTORY_VERSION;
+    header.byte_order = TRAJECTORY_BYTE_ORDER;
+    header.count = count;
+    header.quantum = quantum;
+    header.chunk_size = TRAJECTORY_CHUNK_SIZE;
+    header.keyframe_interval = std::max(1, keyframe_interval);
+    header.colors_offset = sizeof(header);
+    header.frames_offset = (sizeof(header) + count * sizeof(glm::vec3) + 7) / 8 * 8;
+
+    auto start = std::vector<char>(header.frames_offset, 0);
+    std::memcpy(start.data(), &header, sizeof(header));
+    std::memcpy(start.data() + header.colors_offset, bodies.color.data(),
+                count * sizeof(glm::vec3));
+    try {
+        write_all(fd, start.data(), start.size());
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+
+    for (size_t i = 0; i < frames.size(); i++) {
+        frames[i].positions.resize(3 * static_cast<size_t>(count));
+        free_frames.push_back(i);
+    }
+    worker = std::thread{&trajectory_writer::run, this};
+}
+
+trajectory_writer::~trajectory_writer()
+{
+    try {
+        close();
+    } catch (std::exception &) {
+    }
+}
+
+void trajectory_writer::close()
+{
+    {
+        std::lock_guard<std::mutex> guard(mu);
+        closing = true;
+    }
+    queued.notify_one();
+    if (worker.joinable())
+        worker.join();
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    if (!error.empty()) {
+        auto message = error;
+        error.clear();
+        throw std::runtime_error{message};
+    }
+}
+
+bool trajectory_writer::push(PBodies &bodies, uint64_t step)
+{
+    auto index = 0;
+    {
+        std::lock_guard<std::mutex> guard(mu);
+        if (free_frames.empty() || closing) {
+            dropped++;
+            return false;
+        }
+        index = free_frames.front();
+        free_frames.pop_front();
+    }
+    pending++;
+
+    auto &f = frames[index];
+    std::copy_n(bodies.pos.x(), count, f.positions.data());
+    std::copy_n(bodies.pos.y(), count, f.positions.data() + count);
+    std::copy_n(bodies.pos.z(), count, f.positions.data() + 2 * count);
+    f.step = step;
+
+    {
+        std::lock_guard<std::mutex> guard(mu);
+        queued_frames.push_back(index);
+    }
+    queued.notify_one();
+    return true;
+}
+
+void trajectory_writer::run()
+{
+    auto out = std::vector<char>{};
+    auto failed = false;
+    auto warned = false;
+    while (true) {
+        auto index = 0;
+        {
+            std::unique_lock<std::mutex> lock(mu);
+            queued.wait(lock, [this] { return closing || !queued_frames.empty(); });
+            if (queued_frames.empty())
+                return;
+            index = queued_frames.front();
+            queued_frames.pop_front();
+        }
+
+        // After an error the file is no longer decodable, so the queue is only drained, which
+        // keeps push from running out of buffers
+        auto &f = frames[index];
+        if (failed) {
+            dropped++;
+        } else {
+            try {
+                out.clear();
+                encoder.encode(f.positions.data(), f.positions.data() + count,
+                               f.positions.data() + 2 * count, f.step, out);
+                write_all(fd, out.data(), out.size());
+                written++;
+                if (encoder.clamped() > 0 && !warned) {
+                    std::fprintf(stderr,
+                                 "trajectory: positions beyond %g from the origin are clamped, "
+                                 "use a larger -quantum\n", encoder.range());
+                    warned = true;
+                }
+                raw_bytes += 3 * count * sizeof(float);
+                coded_bytes += out.size();
+            } catch (std::exception &e) {
+                failed = true;
+                dropped++;
+                std::lock_guard<std::mutex> guard(mu);
+                error = e.what();
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(mu);
+        free_frames.push_back(index);
+        pending--;
+    }
+}
+
+void trajectory_writer::print_stats()
+{
+    auto raw = static_cast<double>(raw_bytes);
+    auto coded = static_cast<double>(coded_bytes);
+    std::printf("trajectory: %llu frames written, %llu dropped, %.1f MB (%.2f bits/coordinate, "
+                "%.1fx smaller than raw)\n",
+                static_cast<unsigned long long>(written),
+                static_cast<unsigned long long>(dropped), coded / 1e6,
+                raw > 0 ? 8 * coded / (raw / sizeof(float)) : 0.0, coded > 0 ? raw / coded : 0.0);
+    if (encoder.clamped() > 0)
+        std::printf("trajectory: %llu coordinates clamped to the quantized range\n",
+                    static_cast<unsigned long long>(encoder.clamped()));
+}
+
+trajectory_file::trajectory_file(const std::string &path) : data{nullptr}, size{0}
+{
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw file_error("could not open", path);
+
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        ::close(fd);
+        throw file_error("could not stat", path);
+    }
+    size = info.st_size;
+    if (size < sizeof(trajectory_header)) {
+        ::close(fd);
+        throw std::runtime_error{path + " is too small to be a trajectory"};
+    }
+
+    auto mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+        throw file_error("could not map", path);
+    data = static_cast<const char *>(mapped);
+
+    auto &h = header();
+    auto fail = [&](const char *message) {
+        munmap(mapped, size);
+        throw std::runtime_error{path + ": " + message};
+    };
+    if (std::memcmp(h.magic, TRAJECTORY_MAGIC, sizeof(h.magic)) != 0)
+        fail("not a gravity trajectory");
+    if (h.version != TRAJECTORY_VERSION)
+        fail("unsupported trajectory version");
+    if (h.byte_order != TRAJECTORY_BYTE_ORDER)
+        fail("trajectory was written with a different byte order");
+    if (h.chunk_size != TRAJECTORY_CHUNK_SIZE || h.count > std::numeric_limits<int>::max() ||
+        h.colors_offset + h.count * sizeof(glm::vec3) > h.frames_offset || h.frames_offset > size)
+        fail("trajectory header is inconsistent");
+
+    // Only the frame headers are touched here, one page per frame
+    auto table = frame_table_size(chunks_of(h.count));
+    auto offset = h.frames_offset;
+    while (offset + sizeof(trajectory_frame_header) <= size) {
+        auto frame = trajectory_frame_header{};
+        std::memcpy(&frame, data + offset, sizeof(frame));
+        if (frame.magic != TRAJECTORY_FRAME_MAGIC || frame.size < table ||
+            frame.size > size - offset)
+            break;
+        auto keyframe = (frame.flags & TRAJECTORY_KEYFRAME) != 0;
+        if (!keyframe && keyframes.empty())
+            fail("trajectory does not start with a keyframe");
+        keyframes.push_back(keyframe ? static_cast<int>(offsets.size()) : keyframes.back());
+        offsets.push_back(offset);
+        steps.push_back(frame.step);
+        offset += frame.size;
+    }
+    if (offsets.empty())
+        fail("trajectory holds no frames");
+    madvise(mapped, size, MADV_SEQUENTIAL);
+}
+
+trajectory_file::~trajectory_file()
+{
+    munmap(const_cast<char *>(data), size);
+}
+
+const trajectory_header &trajectory_file::header() const
+{
+    return *reinterpret_cast<const trajectory_header *>(data);
+}
+
+const float *trajectory_file::colors() const
+{
+    return reinterpret_cast<const float *>(data + header().colors_offset);
+}
+
+int trajectory_file::frames() const
+{
+    return static_cast<int>(offsets.size());
+}
+
+const char *trajectory_file::frame(int index) const
+{
+    return data + offsets[index];
+}
+
+uint64_t trajectory_file::step(int index) const
+{
+    return steps[index];
+}
+
+int trajectory_file::keyframe_before(int index) const
+{
+    return keyframes[index];
+}
@@ -0,0 +1,181 @@
+#ifndef GRAVITY_TRAJECTORY_H
+#define GRAVITY_TRAJECTORY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pobject.h"
+
+// Trajectory file: a header, the body colors, then a sequence of frames.
+//
+// Positions are quantized to integer multiples of quantum. A keyframe stores the quantized
+// positions themselves, every other frame the difference to the frame before it. Differences
+// are zigzag mapped to unsigned values and Rice coded, with the bodies of each axis split into
+// chunks of chunk_size bodies that are coded independently, each with its own Rice parameter,
+// so frames can be encoded and decoded in parallel.
+//
+// A frame is a trajectory_frame_header, then for every axis and chunk the coded size in bytes
+// (uint32) followed by the Rice parameter (uint8) of every axis and chunk, padded to 8 bytes,
+// then the coded chunks in the same order.
+struct trajectory_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t count;
+    float quantum;
+    uint32_t chunk_size;
+    uint32_t keyframe_interval;
+    uint32_t reserved;
+    uint64_t colors_offset;  // count interleaved r, g, b floats
+    uint64_t frames_offset;
+};
+
+struct trajectory_frame_header {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t step;
+    uint64_t size;  // Bytes in the whole frame, header included
+};
+
+constexpr char TRAJECTORY_MAGIC[8] = {'G', 'R', 'A', 'V', 'T', 'R', 'A', 'J'};
+constexpr uint32_t TRAJECTORY_VERSION = 1;
+constexpr uint32_t TRAJECTORY_BYTE_ORDER = 0x01020304;
+constexpr uint32_t TRAJECTORY_FRAME_MAGIC = 0x4d415246;  // "FRAM"
+constexpr uint32_t TRAJECTORY_KEYFRAME = 1;
+constexpr uint32_t TRAJECTORY_CHUNK_SIZE = 1 << 16;
+
+// Turns positions into frames. Holds the quantized previous frame that deltas are taken from.
+class trajectory_encoder
+{
+public:
+    trajectory_encoder(int count, float quantum, int keyframe_interval);
+
+    // Appends the encoded frame to out
+    void encode(const float *x, const float *y, const float *z, uint64_t step,
+                std::vector<char> &out);
+
+    // Coordinates encoded so far that were outside the int32 range of multiples of quantum, and
+    // so were stored as its nearest end
+    uint64_t clamped() const
+    {
+        return clamped_total;
+    }
+
+    // Largest distance from the origin a coordinate can have without being clamped
+    double range() const
+    {
+        return static_cast<double>(quantum) * std::numeric_limits<int32_t>::max();
+    }
+
+private:
+    int count;
+    float quantum;
+    int keyframe_interval;
+    uint64_t frames;
+    uint64_t clamped_total;
+    std::vector<int32_t> previous;
+};
+
+// Turns frames back into positions. Frames must be decoded in order, starting at a keyframe.
+class trajectory_decoder
+{
+public:
+    trajectory_decoder(int count, float quantum);
+
+    // frame points at a trajectory_frame_header. Returns the step of the frame.
+    uint64_t decode(const char *frame, float *x, float *y, float *z);
+
+private:
+    int count;
+    float quantum;
+    std::vector<int32_t> current;
+};
+
+// Records frames on a background thread. push copies the positions into a free buffer of a
+// bounded queue and returns at once; when every buffer is still waiting to be written the frame
+// is dropped and counted instead, so the simulation never waits for the disk.
+class trajectory_writer
+{
+public:
+    trajectory_writer(const std::string &path, PBodies &bodies, float quantum,
+                      int keyframe_interval, int queue_depth = 4);
+    ~trajectory_writer();
+    trajectory_writer(const trajectory_writer &) = delete;
+    trajectory_writer &operator=(const trajectory_writer &) = delete;
+
+    // Returns false if the frame was dropped
+    bool push(PBodies &bodies, uint64_t step);
+
+    // Writes the frames still queued and closes the file. Errors from the background thread are
+    // reported here; the destructor closes too, but silently.
+    void close();
+
+    void print_stats();
+
+    // Frames pushed but not yet written. Safe to call from any thread.
+    int queue_depth() const
+    {
+        return pending;
+    }
+
+    uint64_t frames_dropped() const
+    {
+        return dropped;
+    }
+
+private:
+    struct frame {
+        std::vector<float> positions;  // x, y and z planes of count floats
+        uint64_t step;
+    };
+
+    int count;
+    int fd;
+    trajectory_encoder encoder;
+    std::vector<frame> frames;
+    std::deque<int> free_frames, queued_frames;
+    std::mutex mu;
+    std::condition_variable queued;
+    bool closing;
+    std::atomic<int> pending;
+    std::atomic<uint64_t> written, dropped, raw_bytes, coded_bytes;
+    std::string error;
+    std::thread worker;
+
+    void run();
+};
+
+// A recorded trajectory mapped read-only into memory, with an index of its frames. A file that is
+// still being recorded, or whose recording was killed, ends at its last complete frame.
+class trajectory_file
+{
+public:
+    explicit trajectory_file(const std::string &path);
+    ~trajectory_file();
+    trajectory_file(const trajectory_file &) = delete;
+    trajectory_file &operator=(const trajectory_file &) = delete;
+
+    const trajectory_header &header() const;
+    const float *colors() const;
+
+    int frames() const;
+    const char *frame(int index) const;
+    uint64_t step(int index) const;
+    // The last keyframe at or before index, where decoding has to start to reach index
+    int keyframe_before(int index) const;
+
+private:
+    const char *data;
+    size_t size;
+    std::vector<uint64_t> offsets, steps;
+    std::vector<int> keyframes;
+};
+
+#endif  // GRAVITY_TRAJECTORY_H
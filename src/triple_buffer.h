@@ -0,0 +1,60 @@
+#ifndef GRAVITY_TRIPLE_BUFFER_H
+#define GRAVITY_TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+
+// Hands complete frames from one writer thread to one reader thread without locks or waiting.
+// The writer fills its back buffer and publishes it by swapping it with the middle one; the
+// reader takes the middle buffer by swapping it with its front one. Each side only ever touches
+// its own buffer, so the reader never sees a frame being written, and a frame published twice
+// before the reader looks simply replaces the older one.
+template<typename T>
+class triple_buffer
+{
+public:
+    explicit triple_buffer(const T &initial)
+        : buffers{initial, initial, initial}, back{0}, middle{1}, front{2}
+    {
+    }
+
+    triple_buffer(const triple_buffer &) = delete;
+    triple_buffer &operator=(const triple_buffer &) = delete;
+
+    // Writer side: fill this, then publish it
+    T &write_buffer()
+    {
+        return buffers[back];
+    }
+
+    void publish()
+    {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    // Reader side: moves to the latest published frame, returns false if there is none newer
+    // than the current read_buffer
+    bool update()
+    {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH))
+            return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+
+    const T &read_buffer() const
+    {
+        return buffers[front];
+    }
+
+private:
+    static constexpr uint8_t INDEX = 3;
+    static constexpr uint8_t FRESH = 4;  // Set in middle when it holds an unread frame
+
+    T buffers[3];
+    uint8_t back;
+    std::atomic<uint8_t> middle;
+    uint8_t front;
+};
+
+#endif  // GRAVITY_TRIPLE_BUFFER_H